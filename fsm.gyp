@@ -2,12 +2,36 @@
   'variables': {
     'fsm_sources' :  [
                        'src/fsm/state_machine.cc',   'src/fsm/state_machine.hh',
+                       'src/fsm/machine_definition.cc', 'src/fsm/machine_definition.hh',
                        'src/fsm/transition.cc',      'src/fsm/transition.hh',
                        'src/fsm/action.cc',          'src/fsm/action.hh',
+                       'src/fsm/continuation.cc',    'src/fsm/continuation.hh',
                        'src/fsm/loop.cc',            'src/fsm/loop.hh',
                        'src/fsm/timer.cc',           'src/fsm/timer.hh',
+                       'src/fsm/dispatch_table.cc',  'src/fsm/dispatch_table.hh',
+                       'src/fsm/event_queue.cc',     'src/fsm/event_queue.hh',
+                       'src/fsm/locked_queue.cc',    'src/fsm/locked_queue.hh',
+                       'src/fsm/lock_free_queue.cc', 'src/fsm/lock_free_queue.hh',
+                       'src/fsm/prioritized_queue.cc', 'src/fsm/prioritized_queue.hh',
+                       'src/fsm/event_counter.cc',   'src/fsm/event_counter.hh',
+                       'src/fsm/queue_limit.cc',     'src/fsm/queue_limit.hh',
+                       'src/fsm/trace_ring.cc',      'src/fsm/trace_ring.hh',
+                       'src/fsm/latency_histogram.cc', 'src/fsm/latency_histogram.hh',
+                       'src/fsm/transition_stats.cc',  'src/fsm/transition_stats.hh',
+                       'src/fsm/miss_counter.cc',    'src/fsm/miss_counter.hh',
+                       'src/fsm/name_registry.cc',   'src/fsm/name_registry.hh',
+                       'src/fsm/work_deque.cc',      'src/fsm/work_deque.hh',
+                       'src/fsm/executor.cc',        'src/fsm/executor.hh',
+                       'src/fsm/parker.cc',          'src/fsm/parker.hh',
+                       'src/fsm/stop_token.cc',      'src/fsm/stop_token.hh',
+                       'src/fsm/timer_service.cc',   'src/fsm/timer_service.hh',
+                       'src/fsm/payload.cc',         'src/fsm/payload.hh',
+                       'src/fsm/payload_pool.cc',    'src/fsm/payload_pool.hh',
                        # header only helpers
                        'src/fsm/exception.hh',
+                       'src/fsm/trace.hh',
+                       'src/fsm/static_machine.hh',
+                       'src/fsm/inline_function.hh',
                      ],
   },
   'conditions': [
@@ -79,6 +103,18 @@
       'include_dirs':  [ './deps_/gtest/include/', ],
       'sources':       [ 'test/fsm_test.cc', ],
     },
+    {
+      'target_name':     'fsm_bench',
+      'type':            'executable',
+      'dependencies':  [ 'fsm', ],
+      'sources':       [ 'test/fsm_bench.cc', ],
+    },
+    {
+      'target_name':     'fsm_trace_decode',
+      'type':            'executable',
+      'dependencies':  [ 'fsm', ],
+      'sources':       [ 'tools/fsm_trace_decode.cc', ],
+    },
   ],
 }
 
@@ -4,26 +4,21 @@
 
 namespace virtdb { namespace fsm {
   
-  action::action(actor fun,
-                 const std::string & description)
-  : fun_{fun},
-    description_{description}
+  action_status
+  action::invalid(uint16_t seqno,
+                  transition &,
+                  state_machine &)
   {
+    THROW_(std::string{"invalid actor function at: "}+std::to_string(seqno));
   }
   
   void
-  action::execute(uint16_t seqno,
-                  transition & trans,
-                  state_machine & sm)
+  action::check()
   {
-    if( fun_ )
-    {
-      fun_(seqno, trans, sm);
-    }
-    else
-    {
-      THROW_(std::string{"invalid actor function at: "}+std::to_string(seqno));
-    }
+    // execute() makes a single call, so an empty function is replaced
+    // by one that reports it
+    if( !fun_ )
+      fun_ = &invalid;
   }
   
   const std::string &
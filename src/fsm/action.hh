@@ -1,25 +1,97 @@
 #pragma once
 
+#include <fsm/inline_function.hh>
 #include <string>
 #include <memory>
-#include <functional>
+#include <type_traits>
+#include <utility>
 
 namespace virtdb { namespace fsm {
   
   class transition;
   class state_machine;
   
+  // what an action returns to its transition. failed and timeout end
+  // the transition in its error or timeout state, like an exception or
+  // an expired timer would, on the normal return path. next_state ends
+  // it in state_. suspended parks the transition until the continuation
+  // of transition::suspend() is resumed. actions returning void always
+  // return ok.
+  struct action_status
+  {
+    enum result_type : uint8_t {
+      ok,
+      failed,
+      timeout,
+      next_state,
+      suspended
+    };
+    
+    result_type   result_;
+    uint16_t      state_;
+    
+    action_status(result_type result=ok,
+                  uint16_t state=0)
+    : result_{result},
+      state_{state}
+    {
+    }
+  };
+  
   class action
   {
   public:
-    typedef std::function<void(uint16_t seqno,
-                               transition & trans,
-                               state_machine & sm)> actor;
+    typedef inline_function<action_status(uint16_t seqno,
+                                          transition & trans,
+                                          state_machine & sm)> actor;
     
   private:
     actor         fun_;
     std::string   description_;
     
+    template <typename F>
+    struct returns_void
+    : std::is_void<decltype(std::declval<F &>()(uint16_t{},
+                                                std::declval<transition &>(),
+                                                std::declval<state_machine &>()))>
+    {
+    };
+    
+    // runs a callable returning void as one returning ok
+    template <typename F>
+    struct returning_ok
+    {
+      F fun_;
+      
+      action_status operator()(uint16_t seqno,
+                               transition & trans,
+                               state_machine & sm)
+      {
+        fun_(seqno, trans, sm);
+        return action_status{};
+      }
+    };
+    
+    template <typename F>
+    static actor wrap(F && fun, std::false_type)
+    {
+      return actor{std::forward<F>(fun)};
+    }
+    
+    template <typename F>
+    static actor wrap(F && fun, std::true_type)
+    {
+      if( is_null_callable(fun) )
+        return actor{};
+      return actor{returning_ok<typename std::decay<F>::type>{std::forward<F>(fun)}};
+    }
+    
+    // what an action without a function does
+    static action_status invalid(uint16_t seqno,
+                                 transition & trans,
+                                 state_machine & sm);
+    void check();
+    
     // disable default construction
     action() = delete;
     
@@ -30,12 +102,30 @@ namespace virtdb { namespace fsm {
   public:
     typedef std::shared_ptr<action> sptr;
     
-    action(actor fun,
-           const std::string & description);
+    // any callable that fits into actor, stored without allocating.
+    // it may return an action_status or nothing.
+    template <typename F>
+    action(F && fun,
+           const std::string & description)
+    : fun_{wrap(std::forward<F>(fun), returns_void<typename std::decay<F>::type>{})},
+      description_{description}
+    {
+      check();
+    }
+    
+    action(std::nullptr_t,
+           const std::string & description)
+    : description_{description}
+    {
+      check();
+    }
     
-    void execute(uint16_t seqno,
-                 transition & trans,
-                 state_machine & sm);
+    action_status execute(uint16_t seqno,
+                          transition & trans,
+                          state_machine & sm)
+    {
+      return fun_(seqno, trans, sm);
+    }
     
     const std::string & description() const;
     
@@ -0,0 +1,50 @@
+#include <fsm/continuation.hh>
+#include <fsm/state_machine.hh>
+#include <fsm/exception.hh>
+
+namespace virtdb { namespace fsm {
+  
+  continuation::continuation() {}
+  
+  continuation::continuation(const state_ptr & st)
+  : state_{st}
+  {
+  }
+  
+  bool
+  continuation::resume(action_status status)
+  {
+    if( status.result_ == action_status::suspended )
+    {
+      THROW_("a continuation can't be resumed as suspended");
+    }
+    else if( !state_ )
+    {
+      return false;
+    }
+    
+    std::lock_guard<std::mutex> lck(state_->mtx_);
+    if( !state_->machine_ || state_->done_.load(std::memory_order_relaxed) )
+      return false;
+    
+    state_->status_ = status;
+    // pairs with the check of an executor finishing the machine
+    state_->done_.store(true, std::memory_order_seq_cst);
+    // the machine can't go away while the lock is held
+    state_->machine_->notify();
+    return true;
+  }
+  
+  bool
+  continuation::pending() const
+  {
+    if( !state_ )
+      return false;
+    
+    std::lock_guard<std::mutex> lck(state_->mtx_);
+    return state_->machine_ && !state_->done_.load(std::memory_order_relaxed);
+  }
+  
+  continuation::~continuation() {}
+  
+}}
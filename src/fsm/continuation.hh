@@ -0,0 +1,55 @@
+#pragma once
+
+#include <fsm/action.hh>
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+namespace virtdb { namespace fsm {
+  
+  class state_machine;
+  
+  // resumes a transition suspended by one of its actions. the action
+  // gets it from transition::suspend(), hands it to whatever completes
+  // the operation and returns action_status::suspended. resume() may be
+  // called from any thread, the transition goes on with the step after
+  // the suspended one on the thread running the machine, or ends as the
+  // status says. copies refer to the same suspension.
+  class continuation
+  {
+  public:
+    struct shared_state
+    {
+      std::mutex            mtx_;
+      state_machine *       machine_;   // null once nobody waits
+      std::atomic<bool>     done_;
+      action_status         status_;
+      
+      shared_state(state_machine * sm)
+      : machine_{sm},
+        done_{false}
+      {
+      }
+    };
+    
+    typedef std::shared_ptr<shared_state> state_ptr;
+    
+  private:
+    state_ptr   state_;
+    
+  public:
+    continuation();
+    continuation(const state_ptr & st);
+    
+    // returns false when resumed already, or when the transition timed
+    // out or its machine was destroyed in the meantime. suspended is not
+    // a valid status here.
+    bool resume(action_status status=action_status{});
+    
+    // true until resumed, timed out or abandoned
+    bool pending() const;
+    
+    virtual ~continuation();
+  };
+  
+}}
@@ -0,0 +1,95 @@
+#include <fsm/dispatch_table.hh>
+
+namespace virtdb { namespace fsm {
+
+  namespace
+  {
+    // below this many cells the dense table is always used, above it
+    // only when at least every 4th cell holds a transition
+    const uint32_t dense_min_cells = 16*1024;
+    const uint32_t dense_max_ratio = 4;
+  }
+
+  dispatch_table::dispatch_table()
+  : dense_{true},
+    n_events_{0},
+    n_cells_{0},
+    mask_{0},
+    shift_{32}
+  {
+  }
+
+  void
+  dispatch_table::build(const trans_map & transitions)
+  {
+    clear();
+
+    uint32_t max_state = 0;
+    uint32_t max_event = 0;
+    for( auto const & t : transitions )
+    {
+      if( t.first.first > max_state )  max_state = t.first.first;
+      if( t.first.second > max_event ) max_event = t.first.second;
+    }
+
+    uint64_t cells = (uint64_t{max_state}+1) * (uint64_t{max_event}+1);
+    if( transitions.empty() ||
+        cells <= dense_min_cells ||
+        cells <= uint64_t{dense_max_ratio} * transitions.size() )
+    {
+      dense_     = true;
+      n_events_  = max_event+1;
+      n_cells_   = static_cast<uint32_t>(cells);
+      cells_.assign(n_cells_, nullptr);
+      for( auto const & t : transitions )
+      {
+        cells_[t.first.first * n_events_ + t.first.second] = t.second.get();
+      }
+    }
+    else
+    {
+      // keep the load factor at or below 50% so probes stay short
+      uint32_t bits = 1;
+      while( (uint64_t{1} << bits) < 2 * transitions.size() ) ++bits;
+
+      dense_  = false;
+      mask_   = (1U << bits) - 1;
+      shift_  = 32 - bits;
+      slots_.assign(mask_+1, slot{0, nullptr});
+      for( auto const & t : transitions )
+      {
+        uint32_t k = key(t.first.first, t.first.second);
+        uint32_t i = hash(k) >> shift_;
+        while( slots_[i].trans_ ) i = (i+1) & mask_;
+        slots_[i] = slot{k, t.second.get()};
+      }
+    }
+  }
+
+  void
+  dispatch_table::clear()
+  {
+    dense_     = true;
+    n_events_  = 0;
+    n_cells_   = 0;
+    mask_      = 0;
+    shift_     = 32;
+    dense_vec().swap(cells_);
+    slot_vec().swap(slots_);
+  }
+
+  bool
+  dispatch_table::dense() const
+  {
+    return dense_;
+  }
+
+  size_t
+  dispatch_table::size() const
+  {
+    return dense_ ? cells_.size() : slots_.size();
+  }
+
+  dispatch_table::~dispatch_table() {}
+
+}}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <fsm/transition.hh>
+#include <vector>
+#include <map>
+
+namespace virtdb { namespace fsm {
+
+  class dispatch_table
+  {
+  public:
+    typedef std::pair<uint16_t, uint16_t>            state_event;
+    typedef std::map<state_event,transition::sptr>   trans_map;
+
+  private:
+    struct slot
+    {
+      uint32_t       key_;
+      transition *   trans_;
+    };
+
+    typedef std::vector<transition *>   dense_vec;
+    typedef std::vector<slot>           slot_vec;
+
+    bool         dense_;
+    uint32_t     n_events_;
+    uint32_t     n_cells_;
+    uint32_t     mask_;
+    uint32_t     shift_;
+    dense_vec    cells_;
+    slot_vec     slots_;
+
+    static uint32_t key(uint16_t state, uint16_t event)
+    {
+      return (static_cast<uint32_t>(state) << 16) | event;
+    }
+
+    static uint32_t hash(uint32_t k)
+    {
+      // Fibonacci hashing spreads the (state,event) bits over the table
+      return k * 0x9E3779B1U;
+    }
+
+    // disable copying until properly implemented
+    dispatch_table(const dispatch_table &) = delete;
+    dispatch_table & operator=(const dispatch_table &) = delete;
+
+  public:
+    dispatch_table();
+
+    // builds a dense [state][event] array when the id space is small
+    // compared to the number of transitions, and an open addressed
+    // table otherwise. the transitions are owned by the map.
+    void build(const trans_map & transitions);
+    void clear();
+
+    bool dense() const;
+    size_t size() const;
+
+    transition * find(uint16_t state, uint16_t event) const
+    {
+      if( dense_ )
+      {
+        uint32_t idx = state * n_events_ + event;
+        return (event < n_events_ && idx < n_cells_) ? cells_[idx] : nullptr;
+      }
+      else if( slots_.empty() )
+      {
+        return nullptr;
+      }
+
+      uint32_t k = key(state, event);
+      for( uint32_t i=hash(k)>>shift_; ; i=(i+1)&mask_ )
+      {
+        const slot & s = slots_[i];
+        if( !s.trans_ )   return nullptr;
+        if( s.key_ == k ) return s.trans_;
+      }
+    }
+
+    virtual ~dispatch_table();
+  };
+
+}}
@@ -0,0 +1,113 @@
+#include <fsm/event_counter.hh>
+
+namespace virtdb { namespace fsm {
+  
+  event_counter::event_counter()
+  : top_{nullptr},
+    total_{0},
+    high_water_{0}
+  {
+  }
+  
+  template <typename NODE>
+  NODE *
+  event_counter::node(std::atomic<NODE *> & slot)
+  {
+    NODE * n = slot.load(std::memory_order_acquire);
+    if( !n )
+    {
+      // value initialization zeroes the atomics
+      NODE * fresh = new NODE();
+      
+      // another thread may have installed the node in the meantime
+      if( slot.compare_exchange_strong(n, fresh, std::memory_order_acq_rel) )
+        n = fresh;
+      else
+        delete fresh;
+    }
+    return n;
+  }
+  
+  event_counter::counter &
+  event_counter::get(uint16_t event)
+  {
+    top * t = node(top_);
+    mid * m = node(t->mids_[event >> (leaf_bits+mid_bits)]);
+    leaf * l = node(m->leaves_[(event >> leaf_bits) & (mid_size-1)]);
+    return l->counters_[event & (leaf_size-1)];
+  }
+  
+  void
+  event_counter::add(uint16_t event)
+  {
+    get(event).fetch_add(1, std::memory_order_acq_rel);
+    mark(total_.fetch_add(1, std::memory_order_acq_rel)+1);
+  }
+  
+  bool
+  event_counter::add_unique(uint16_t event)
+  {
+    uint32_t expected = 0;
+    if( !get(event).compare_exchange_strong(expected, 1, std::memory_order_acq_rel) )
+      return false;
+    
+    mark(total_.fetch_add(1, std::memory_order_acq_rel)+1);
+    return true;
+  }
+  
+  bool
+  event_counter::add_if_empty(uint16_t event)
+  {
+    uint64_t expected = 0;
+    if( !total_.compare_exchange_strong(expected, 1, std::memory_order_acq_rel) )
+      return false;
+    
+    get(event).fetch_add(1, std::memory_order_acq_rel);
+    mark(1);
+    return true;
+  }
+  
+  bool
+  event_counter::add_below(uint16_t event,
+                           uint64_t limit)
+  {
+    uint64_t total = total_.load(std::memory_order_acquire);
+    do
+    {
+      if( total >= limit )
+        return false;
+    }
+    while( !total_.compare_exchange_weak(total, total+1, std::memory_order_acq_rel) );
+    
+    get(event).fetch_add(1, std::memory_order_acq_rel);
+    mark(total+1);
+    return true;
+  }
+  
+  void
+  event_counter::remove(uint16_t event)
+  {
+    get(event).fetch_sub(1, std::memory_order_acq_rel);
+    total_.fetch_sub(1, std::memory_order_acq_rel);
+  }
+  
+  event_counter::~event_counter()
+  {
+    top * t = top_.load(std::memory_order_relaxed);
+    if( !t )
+      return;
+    
+    for( auto & ms : t->mids_ )
+    {
+      mid * m = ms.load(std::memory_order_relaxed);
+      if( !m )
+        continue;
+      
+      for( auto & ls : m->leaves_ )
+        delete ls.load(std::memory_order_relaxed);
+      delete m;
+    }
+    delete t;
+  }
+  
+}}
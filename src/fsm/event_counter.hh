@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace virtdb { namespace fsm {
+  
+  // number of queued instances per event id. the 64K counters are kept
+  // in a three level radix tree whose nodes are allocated on first use,
+  // so an idle counter is two words and only the event ranges actually
+  // used cost memory. all operations are lock free. the largest total
+  // ever reached is kept as the high water mark.
+  class event_counter
+  {
+    enum {
+      leaf_bits  = 6,
+      leaf_size  = 1 << leaf_bits,
+      mid_bits   = 5,
+      mid_size   = 1 << mid_bits,
+      top_size   = (1 << 16) >> (leaf_bits + mid_bits)
+    };
+    
+    typedef std::atomic<uint32_t>   counter;
+    
+    struct leaf { counter              counters_[leaf_size]; };
+    struct mid  { std::atomic<leaf *>  leaves_[mid_size]; };
+    struct top  { std::atomic<mid *>   mids_[top_size]; };
+    
+    std::atomic<top *>       top_;
+    std::atomic<uint64_t>    total_;
+    std::atomic<uint64_t>    high_water_;
+    
+    // installs a zeroed node unless another thread was faster
+    template <typename NODE>
+    static NODE * node(std::atomic<NODE *> & slot);
+    
+    counter & get(uint16_t event);
+    
+    void mark(uint64_t total)
+    {
+      uint64_t hw = high_water_.load(std::memory_order_relaxed);
+      while( total > hw &&
+             !high_water_.compare_exchange_weak(hw, total, std::memory_order_relaxed) )
+      {
+      }
+    }
+    
+    const counter * find(uint16_t event) const
+    {
+      const top * t = top_.load(std::memory_order_acquire);
+      if( !t ) return nullptr;
+      const mid * m = t->mids_[event >> (leaf_bits+mid_bits)].load(std::memory_order_acquire);
+      if( !m ) return nullptr;
+      const leaf * l = m->leaves_[(event >> leaf_bits) & (mid_size-1)].load(std::memory_order_acquire);
+      return l ? l->counters_ + (event & (leaf_size-1)) : nullptr;
+    }
+    
+    // disable copying until properly implemented
+    event_counter(const event_counter &) = delete;
+    event_counter & operator=(const event_counter &) = delete;
+    
+  public:
+    event_counter();
+    
+    void add(uint16_t event);
+    
+    // add only if the event has no queued instance
+    bool add_unique(uint16_t event);
+    
+    // add only if nothing is queued at all
+    bool add_if_empty(uint16_t event);
+    
+    // add only if fewer than limit events are queued
+    bool add_below(uint16_t event, uint64_t limit);
+    
+    void remove(uint16_t event);
+    
+    bool has(uint16_t event) const
+    {
+      const counter * c = find(event);
+      return c && c->load(std::memory_order_acquire) > 0;
+    }
+    
+    uint64_t size() const
+    {
+      return total_.load(std::memory_order_acquire);
+    }
+    
+    uint64_t high_water() const
+    {
+      return high_water_.load(std::memory_order_relaxed);
+    }
+    
+    virtual ~event_counter();
+  };
+  
+}}
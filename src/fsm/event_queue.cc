@@ -0,0 +1,32 @@
+#include <fsm/event_queue.hh>
+#include <fsm/locked_queue.hh>
+#include <fsm/lock_free_queue.hh>
+#include <fsm/prioritized_queue.hh>
+#include <fsm/exception.hh>
+
+namespace virtdb { namespace fsm {
+  
+  event_queue::uptr
+  event_queue::create(const queue_options & opts)
+  {
+    if( opts.priorities_ == 0 )
+    {
+      THROW_("number of priorities must be between 1 and max_priorities");
+    }
+    else if( opts.priorities_ > 1 )
+    {
+      return uptr{new prioritized_queue{opts}};
+    }
+    
+    switch( opts.kind_ )
+    {
+      case queue_options::locked:
+        return uptr{new locked_queue};
+        
+      case queue_options::lock_free:
+        return uptr{new lock_free_queue{opts.capacity_}};
+    };
+    THROW_("invalid queue kind");
+  }
+  
+}}
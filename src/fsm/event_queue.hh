@@ -0,0 +1,126 @@
+#pragma once
+
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+namespace virtdb { namespace fsm {
+  
+  // higher classes are dequeued first. a machine with fewer classes
+  // puts the higher priorities into its highest class.
+  enum event_priority : uint8_t {
+    normal_priority   = 0,
+    high_priority     = 1,
+    urgent_priority   = 2,
+    control_priority  = 3,
+    max_priorities    = 4
+  };
+  
+  struct queue_options
+  {
+    enum kind_type {
+      locked,     // mutex protected ring, unbounded
+      lock_free   // bounded multi-producer single-consumer ring
+    };
+    
+    enum scheduling_type {
+      strict,     // a class only runs when all higher ones are empty
+      weighted    // classes get weights_ events per round, highest first
+    };
+    
+    // what an enqueue does when limit_ events are queued already
+    enum overflow_type {
+      block,        // the producer waits up to block_timeout_ for room
+      reject,       // the event is refused
+      drop_oldest,  // the oldest event not taken by the machine yet goes
+      coalesce      // duplicates of queued events merge, others are refused
+    };
+    
+    kind_type                   kind_;
+    uint32_t                    capacity_;    // per class, rounded up to a power of two by lock_free
+    uint8_t                     priorities_;  // number of classes, 1..max_priorities
+    scheduling_type             scheduling_;
+    uint32_t                    weights_[max_priorities];
+    uint64_t                    limit_;       // events per machine, zero is unbounded
+    overflow_type               overflow_;
+    std::chrono::microseconds   block_timeout_;
+    
+    queue_options(kind_type kind=locked,
+                  uint32_t capacity=1024,
+                  uint8_t priorities=1,
+                  scheduling_type scheduling=strict)
+    : kind_{kind},
+      capacity_{capacity},
+      priorities_{priorities},
+      scheduling_{scheduling},
+      weights_{1, 4, 16, 64},
+      limit_{0},
+      overflow_{reject},
+      block_timeout_{std::chrono::seconds(1)}
+    {
+    }
+  };
+  
+  struct queued_event
+  {
+    enum { inline_size = 16 };
+    
+    uint16_t   event_;
+    uint16_t   payload_size_; // zero when the event has no payload
+    bool       in_block_;
+    uint8_t    priority_;
+    uint64_t   enqueued_ns_;  // zero unless statistics are collected
+    
+    // small payloads are copied inline, larger ones and the ones filled
+    // in place live in a block of the machine's payload_pool
+    union
+    {
+      unsigned char   inline_[inline_size];
+      uint32_t        block_;
+    } payload_;
+    
+    queued_event() = default;
+    
+    queued_event(uint16_t event,
+                 uint64_t enqueued_ns)
+    : event_{event},
+      payload_size_{0},
+      in_block_{false},
+      priority_{normal_priority},
+      enqueued_ns_{enqueued_ns}
+    {
+    }
+  };
+  
+  // events are pushed by any number of threads and popped only by the
+  // thread running the state machine. per event bookkeeping, like
+  // uniqueness, is done by the state machine's event_counter.
+  class event_queue
+  {
+  public:
+    typedef std::unique_ptr<event_queue> uptr;
+    
+    static uptr create(const queue_options & opts);
+    
+    virtual void push(const queued_event & event) = 0;
+    virtual bool pop(queued_event & event) = 0;
+    
+    // the batch versions take one synchronization for all the events
+    virtual void push_bulk(const queued_event * events, size_t n) = 0;
+    virtual size_t pop_bulk(queued_event * events, size_t max) = 0;
+    
+    // for the threads that can't wait for the consumer to make room:
+    // the consumer itself and the timer thread. bounded queues keep
+    // what doesn't fit aside, the others just push.
+    virtual void push_nowait(const queued_event * events, size_t n) { push_bulk(events, n); }
+    
+    virtual uint64_t size() const = 0;
+    
+    // removes the event at the front, for queues that can do this
+    // while other threads push
+    virtual bool drop_oldest(queued_event &) { return false; }
+    
+    virtual ~event_queue() {}
+  };
+  
+}}
@@ -0,0 +1,328 @@
+#include <fsm/executor.hh>
+#include <fsm/exception.hh>
+
+namespace virtdb { namespace fsm {
+  
+  namespace
+  {
+    // the worker running on this thread, if any
+    struct current_worker
+    {
+      const executor *  exec_;
+      uint32_t          index_;
+    };
+    
+    thread_local current_worker current{nullptr, 0};
+    
+    // how often a worker looks at the injection queue before its deque
+    const uint32_t injected_every = 61;
+    
+    uint64_t
+    xorshift(uint64_t & seed)
+    {
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      return seed;
+    }
+  }
+  
+  executor::executor(uint32_t n_workers,
+                     uint32_t max_slice,
+                     error_fun on_error)
+  : max_slice_{max_slice},
+    stopping_{false},
+    on_error_{on_error},
+    errors_{0},
+    n_injected_{0},
+    parked_{0},
+    active_{0}
+  {
+    if( n_workers == 0 )
+    {
+      THROW_("executor needs at least one worker");
+    }
+    else if( max_slice == 0 )
+    {
+      THROW_("max_slice must be positive");
+    }
+    
+    for( uint32_t i=0; i<n_workers; ++i )
+    {
+      workers_.push_back(worker_uptr{new worker});
+      workers_.back()->seed_ = 0x9e3779b97f4a7c15ULL * (i+1);
+      workers_.back()->ticks_ = 0;
+    }
+    
+    // all deques exist before any worker can steal
+    for( uint32_t i=0; i<n_workers; ++i )
+      workers_[i]->thread_ = std::thread{[this,i]() { work(i); }};
+  }
+  
+  void
+  executor::add(state_machine::sptr sm)
+  {
+    if( !sm )
+    {
+      THROW_("invalid state machine received");
+    }
+    else if( sm->executor_.load(std::memory_order_acquire) )
+    {
+      THROW_("state machine already belongs to an executor");
+    }
+    else if( stopping_.load(std::memory_order_acquire) )
+    {
+      THROW_("executor is stopped");
+    }
+    
+    {
+      lock lck(machines_mtx_);
+      machines_.push_back(sm);
+    }
+    sm->executor_.store(this, std::memory_order_seq_cst);
+    
+    if( sm->runnable() )
+      sm->notify();
+  }
+  
+  void
+  executor::schedule(state_machine * sm)
+  {
+    // no worker would take it, the machine stays scheduled until the
+    // executor detaches it
+    if( stopping_.load(std::memory_order_acquire) )
+      return;
+    
+    active_.fetch_add(1, std::memory_order_relaxed);
+    
+    if( current.exec_ == this )
+    {
+      workers_[current.index_]->deque_.push(sm);
+    }
+    else
+    {
+      lock lck(injected_mtx_);
+      injected_.push_back(sm);
+      n_injected_.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    // pairs with the fence in has_work(): either the parking worker
+    // sees the machine or we see the parked worker
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if( parked_.load(std::memory_order_relaxed) > 0 )
+    {
+      lock lck(park_mtx_);
+      park_cv_.notify_one();
+    }
+  }
+  
+  bool
+  executor::has_work() const
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if( n_injected_.load(std::memory_order_relaxed) > 0 )
+      return true;
+    
+    for( auto const & w : workers_ )
+    {
+      if( !w->deque_.empty() )
+        return true;
+    }
+    return false;
+  }
+  
+  state_machine *
+  executor::take_injected()
+  {
+    if( n_injected_.load(std::memory_order_relaxed) == 0 )
+      return nullptr;
+    
+    lock lck(injected_mtx_);
+    if( injected_.empty() )
+      return nullptr;
+    
+    state_machine * sm = injected_.front();
+    injected_.pop_front();
+    n_injected_.fetch_sub(1, std::memory_order_relaxed);
+    return sm;
+  }
+  
+  state_machine *
+  executor::take(uint32_t self)
+  {
+    worker & me = *workers_[self];
+    state_machine * sm = nullptr;
+    if( ++me.ticks_ % injected_every == 0 )
+      sm = take_injected();
+    if( !sm )
+      sm = me.deque_.steal();
+    if( !sm )
+      sm = take_injected();
+    if( sm )
+      return sm;
+    
+    // start at a random victim so thieves spread out
+    uint32_t n = static_cast<uint32_t>(workers_.size());
+    uint32_t start = static_cast<uint32_t>(xorshift(me.seed_) % n);
+    for( uint32_t i=0; i<n; ++i )
+    {
+      uint32_t victim = (start+i) % n;
+      if( victim == self )
+        continue;
+      
+      sm = workers_[victim]->deque_.steal();
+      if( sm )
+        return sm;
+    }
+    return nullptr;
+  }
+  
+  void
+  executor::finish(uint32_t self,
+                   state_machine * sm)
+  {
+    worker & me = *workers_[self];
+    if( sm->runnable() )
+    {
+      me.deque_.push(sm);
+      return;
+    }
+    
+    // an enqueue between the store and the check finds the machine
+    // idle and schedules it, or we find its event and take it back
+    sm->scheduled_.store(false, std::memory_order_seq_cst);
+    if( sm->runnable() &&
+        !sm->scheduled_.exchange(true, std::memory_order_seq_cst) )
+    {
+      me.deque_.push(sm);
+      return;
+    }
+    
+    if( active_.fetch_sub(1, std::memory_order_acq_rel) == 1 )
+    {
+      lock lck(idle_mtx_);
+      idle_cv_.notify_all();
+    }
+  }
+  
+  void
+  executor::report(state_machine & sm,
+                   std::exception_ptr err)
+  {
+    errors_.fetch_add(1, std::memory_order_relaxed);
+    if( on_error_ )
+    {
+      try
+      {
+        on_error_(sm, err);
+      }
+      catch (...)
+      {
+        // the worker has to go on with the other machines
+      }
+    }
+  }
+  
+  void
+  executor::work(uint32_t self)
+  {
+    current = current_worker{this, self};
+    
+    while( !stopping_.load(std::memory_order_acquire) )
+    {
+      state_machine * sm = take(self);
+      if( sm )
+      {
+        try
+        {
+          sm->drain(max_slice_);
+        }
+        catch (...)
+        {
+          // a throwing unhandled or trace callback, the machine keeps
+          // the state it had before the failing event
+          report(*sm, std::current_exception());
+        }
+        finish(self, sm);
+        continue;
+      }
+      
+      lock lck(park_mtx_);
+      if( stopping_.load(std::memory_order_acquire) )
+        break;
+      
+      parked_.fetch_add(1, std::memory_order_relaxed);
+      if( !has_work() )
+        park_cv_.wait(lck);
+      parked_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    
+    current = current_worker{nullptr, 0};
+  }
+  
+  void
+  executor::wait_idle()
+  {
+    lock lck(idle_mtx_);
+    idle_cv_.wait(lck, [this]() {
+      return (active_.load(std::memory_order_acquire) == 0 ||
+              stopping_.load(std::memory_order_acquire));
+    });
+  }
+  
+  void
+  executor::stop()
+  {
+    {
+      lock lck(park_mtx_);
+      stopping_.store(true, std::memory_order_release);
+      park_cv_.notify_all();
+    }
+    
+    for( auto & w : workers_ )
+    {
+      if( w->thread_.joinable() )
+        w->thread_.join();
+    }
+    
+    // machines left scheduled won't run anymore
+    lock lck(idle_mtx_);
+    idle_cv_.notify_all();
+  }
+  
+  uint32_t
+  executor::workers() const
+  {
+    return static_cast<uint32_t>(workers_.size());
+  }
+  
+  uint32_t
+  executor::max_slice() const
+  {
+    return max_slice_;
+  }
+  
+  uint64_t
+  executor::errors() const
+  {
+    return errors_.load(std::memory_order_relaxed);
+  }
+  
+  executor::~executor()
+  {
+    stop();
+    
+    // the machines outlive the executor if shared elsewhere. the timer
+    // thread or a continuation may be notifying them, a notify either
+    // sees the executor detached or is waited for.
+    lock lck(machines_mtx_);
+    for( auto & sm : machines_ )
+    {
+      sm->executor_.store(nullptr, std::memory_order_seq_cst);
+      while( sm->notifying_.load(std::memory_order_acquire) > 0 )
+        std::this_thread::yield();
+      sm->scheduled_.store(false, std::memory_order_relaxed);
+    }
+  }
+  
+}}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <fsm/state_machine.hh>
+#include <fsm/work_deque.hh>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace virtdb { namespace fsm {
+  
+  // runs many machines on a fixed set of worker threads. enqueueing into
+  // an idle machine schedules it: onto the deque of the current worker
+  // when called from one, otherwise onto a shared injection queue. idle
+  // workers steal from the others. a machine is scheduled at most once,
+  // so it never runs on two threads at the same time, and it runs at most
+  // max_slice events before it goes to the back of its worker's deque.
+  // workers look at the injection queue first every few slices, so busy
+  // deques don't starve newly scheduled machines.
+  class executor
+  {
+    friend class state_machine;
+    
+  public:
+    typedef std::shared_ptr<executor> sptr;
+    
+    typedef std::function<void(state_machine & sm,
+                               std::exception_ptr err)> error_fun;
+    
+  private:
+    struct worker
+    {
+      work_deque    deque_;
+      std::thread   thread_;
+      uint64_t      seed_;
+      uint32_t      ticks_;
+    };
+    
+    typedef std::unique_ptr<worker>            worker_uptr;
+    typedef std::unique_lock<std::mutex>       lock;
+    
+    uint32_t                          max_slice_;
+    std::vector<worker_uptr>          workers_;
+    std::atomic<bool>                 stopping_;
+    error_fun                         on_error_;
+    std::atomic<uint64_t>             errors_;
+    
+    // scheduled from outside of the workers
+    std::mutex                        injected_mtx_;
+    std::deque<state_machine *>       injected_;
+    std::atomic<uint64_t>             n_injected_;
+    
+    // workers with nothing to do sleep here
+    std::mutex                        park_mtx_;
+    std::condition_variable           park_cv_;
+    std::atomic<uint32_t>             parked_;
+    
+    // machines scheduled or running
+    std::atomic<uint64_t>             active_;
+    std::mutex                        idle_mtx_;
+    std::condition_variable           idle_cv_;
+    
+    std::mutex                        machines_mtx_;
+    std::vector<state_machine::sptr>  machines_;
+    
+    // disable default construction
+    executor() = delete;
+    
+    // disable copying until properly implemented
+    executor(const executor &) = delete;
+    executor & operator=(const executor &) = delete;
+    
+    // called when an idle machine got an event
+    void schedule(state_machine * sm);
+    
+    void work(uint32_t self);
+    state_machine * take(uint32_t self);
+    state_machine * take_injected();
+    void finish(uint32_t self, state_machine * sm);
+    void report(state_machine & sm, std::exception_ptr err);
+    bool has_work() const;
+    
+  public:
+    // an exception a machine throws on a worker, from an unhandled or
+    // trace callback, is counted and passed to on_error on that worker.
+    // the machine keeps the state it had before the failing event, the
+    // events popped with that one stay queued and it is scheduled again
+    // while it has any. exceptions of on_error itself are dropped.
+    executor(uint32_t n_workers,
+             uint32_t max_slice=64,
+             error_fun on_error=error_fun{});
+    
+    // the machine must not be running, and must not be enqueued into by
+    // other threads while it is being added. its run() can't be called
+    // anymore, the executor keeps it alive until destruction.
+    void add(state_machine::sptr sm);
+    
+    // blocks until every machine ran out of events, or the executor is
+    // stopped. enqueues racing with this call may or may not be waited for.
+    void wait_idle();
+    
+    // workers finish their current slice and exit, queued events stay.
+    // nothing is scheduled and no machine can be added afterwards, the
+    // machines can run on their own once the executor is destroyed.
+    void stop();
+    
+    uint32_t workers() const;
+    uint32_t max_slice() const;
+    
+    // exceptions thrown by the machines on the workers
+    uint64_t errors() const;
+    
+    virtual ~executor();
+  };
+  
+}}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace virtdb { namespace fsm {
+  
+  // enough for a few pointers, a std::function or a shared_ptr
+  enum { inline_function_capacity = 6*sizeof(void*) };
+  
+  template <typename SIG, size_t CAPACITY=inline_function_capacity>
+  class inline_function;
+  
+  // null function pointers and empty std::functions, which make an
+  // empty inline_function
+  template <typename F> bool is_null_callable(const F &) { return false; }
+  template <typename F> bool is_null_callable(F * const & f) { return f == nullptr; }
+  template <typename S> bool is_null_callable(const std::function<S> & f) { return !f; }
+  
+  // a move-only callable kept inside the object, never on the heap.
+  // callables bigger than CAPACITY don't compile, capture less or by
+  // reference. calling is one indirect call, an empty one throws
+  // std::bad_function_call like std::function.
+  template <typename R, typename... ARGS, size_t CAPACITY>
+  class inline_function<R(ARGS...), CAPACITY>
+  {
+    typedef R (*invoker)(void * obj, ARGS... args);
+    typedef void (*relocator)(void * dst, void * src);  // destroys src
+    
+    typename std::aligned_storage<CAPACITY, alignof(std::max_align_t)>::type storage_;
+    invoker     invoke_;
+    relocator   relocate_;
+    
+    template <typename F>
+    static R call(void * obj, ARGS... args)
+    {
+      return (*static_cast<F *>(obj))(std::forward<ARGS>(args)...);
+    }
+    
+    static R call_empty(void *, ARGS...)
+    {
+      throw std::bad_function_call();
+    }
+    
+    template <typename F>
+    static void relocate(void * dst, void * src)
+    {
+      F * f = static_cast<F *>(src);
+      if( dst )
+        new (dst) F(std::move(*f));
+      f->~F();
+    }
+    
+    void reset()
+    {
+      if( relocate_ )
+        relocate_(nullptr, &storage_);
+      invoke_    = &call_empty;
+      relocate_  = nullptr;
+    }
+    
+    void take(inline_function & other)
+    {
+      invoke_    = other.invoke_;
+      relocate_  = other.relocate_;
+      if( relocate_ )
+        relocate_(&storage_, &other.storage_);
+      other.invoke_    = &call_empty;
+      other.relocate_  = nullptr;
+    }
+    
+    // disable copying, the callables may not be copyable
+    inline_function(const inline_function &) = delete;
+    inline_function & operator=(const inline_function &) = delete;
+    
+  public:
+    inline_function()
+    : invoke_{&call_empty},
+      relocate_{nullptr}
+    {
+    }
+    
+    inline_function(std::nullptr_t)
+    : inline_function{}
+    {
+    }
+    
+    template <typename F,
+              typename T=typename std::decay<F>::type,
+              typename=typename std::enable_if<!std::is_same<T, inline_function>::value>::type>
+    inline_function(F && fun)
+    : inline_function{}
+    {
+      static_assert(sizeof(T) <= CAPACITY,
+                    "callable too large for inline_function, capture less or by reference");
+      static_assert(alignof(T) <= alignof(std::max_align_t),
+                    "callable too strictly aligned for inline_function");
+      
+      if( is_null_callable(fun) )
+        return;
+      
+      new (&storage_) T(std::forward<F>(fun));
+      invoke_    = &call<T>;
+      relocate_  = &relocate<T>;
+    }
+    
+    inline_function(inline_function && other)
+    : inline_function{}
+    {
+      take(other);
+    }
+    
+    inline_function & operator=(inline_function && other)
+    {
+      if( this != &other )
+      {
+        reset();
+        take(other);
+      }
+      return *this;
+    }
+    
+    inline_function & operator=(std::nullptr_t)
+    {
+      reset();
+      return *this;
+    }
+    
+    R operator()(ARGS... args) const
+    {
+      // like std::function, a const call may change the callable
+      return invoke_(const_cast<void *>(static_cast<const void *>(&storage_)),
+                     std::forward<ARGS>(args)...);
+    }
+    
+    explicit operator bool() const { return invoke_ != &call_empty; }
+    
+    ~inline_function() { reset(); }
+  };
+  
+}}
@@ -0,0 +1,135 @@
+#include <fsm/latency_histogram.hh>
+#include <chrono>
+
+namespace virtdb { namespace fsm {
+  
+  uint64_t
+  latency_histogram::now_ns()
+  {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+  }
+  
+  uint32_t
+  latency_histogram::bucket_of(uint64_t ns)
+  {
+    if( ns < sub_count )
+      return static_cast<uint32_t>(ns);
+    
+    uint32_t msb = 63 - __builtin_clzll(ns);
+    if( msb >= max_bits )
+      return n_buckets-1;
+    
+    uint32_t shift = msb - sub_bits;
+    return (shift+1) * sub_count + ((ns >> shift) & (sub_count-1));
+  }
+  
+  uint64_t
+  latency_histogram::bucket_low(uint32_t bucket)
+  {
+    if( bucket < sub_count )
+      return bucket;
+    
+    uint32_t shift = bucket / sub_count - 1;
+    uint64_t sub   = bucket % sub_count;
+    return (sub_count + sub) << shift;
+  }
+  
+  uint64_t
+  latency_histogram::bucket_high(uint32_t bucket)
+  {
+    if( bucket+1 >= n_buckets )
+      return UINT64_MAX;
+    return bucket_low(bucket+1) - 1;
+  }
+  
+  latency_histogram::latency_histogram()
+  : buckets_{nullptr},
+    count_{0},
+    total_ns_{0},
+    max_ns_{0}
+  {
+  }
+  
+  latency_histogram::counter *
+  latency_histogram::buckets()
+  {
+    counter * b = buckets_.load(std::memory_order_acquire);
+    if( !b )
+    {
+      counter * fresh = new counter[n_buckets];
+      for( int i=0; i<n_buckets; ++i )
+        fresh[i].store(0, std::memory_order_relaxed);
+      
+      // another thread may have installed the buckets in the meantime
+      if( buckets_.compare_exchange_strong(b, fresh, std::memory_order_acq_rel) )
+        b = fresh;
+      else
+        delete [] fresh;
+    }
+    return b;
+  }
+  
+  void
+  latency_histogram::record(uint64_t ns)
+  {
+    buckets()[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    total_ns_.fetch_add(ns, std::memory_order_relaxed);
+    
+    uint64_t max = max_ns_.load(std::memory_order_relaxed);
+    while( ns > max &&
+           !max_ns_.compare_exchange_weak(max, ns, std::memory_order_relaxed) )
+    {
+    }
+  }
+  
+  void
+  latency_histogram::take(snapshot & snap) const
+  {
+    snap.count_     = count_.load(std::memory_order_relaxed);
+    snap.total_ns_  = total_ns_.load(std::memory_order_relaxed);
+    snap.max_ns_    = max_ns_.load(std::memory_order_relaxed);
+    snap.buckets_.assign(n_buckets, 0);
+    
+    const counter * b = buckets_.load(std::memory_order_acquire);
+    if( b )
+    {
+      for( int i=0; i<n_buckets; ++i )
+        snap.buckets_[i] = b[i].load(std::memory_order_relaxed);
+    }
+  }
+  
+  uint64_t
+  latency_histogram::snapshot::percentile(double fraction) const
+  {
+    uint64_t total = 0;
+    for( auto c : buckets_ ) total += c;
+    if( total == 0 )
+      return 0;
+    
+    uint64_t target = static_cast<uint64_t>(fraction * total);
+    if( target >= total ) target = total-1;
+    
+    uint64_t seen = 0;
+    for( uint32_t i=0; i<buckets_.size(); ++i )
+    {
+      seen += buckets_[i];
+      if( seen > target )
+        return (bucket_high(i) < max_ns_ ? bucket_high(i) : max_ns_);
+    }
+    return max_ns_;
+  }
+  
+  uint64_t
+  latency_histogram::snapshot::mean() const
+  {
+    return count_ ? total_ns_/count_ : 0;
+  }
+  
+  latency_histogram::~latency_histogram()
+  {
+    delete [] buckets_.load(std::memory_order_relaxed);
+  }
+  
+}}
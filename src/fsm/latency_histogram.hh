@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+namespace virtdb { namespace fsm {
+  
+  // log-linear (HDR style) histogram of nanosecond values: every power
+  // of two range is split into 8 linear buckets, so a bucket is at most
+  // 12.5% wide. values above 2^40 ns end up in the last bucket. the
+  // buckets are allocated on the first record, recording is wait free.
+  class latency_histogram
+  {
+  public:
+    enum {
+      sub_bits    = 3,
+      sub_count   = 1 << sub_bits,
+      max_bits    = 40,
+      n_buckets   = (max_bits - sub_bits + 1) * sub_count
+    };
+    
+    struct snapshot
+    {
+      uint64_t                count_;
+      uint64_t                total_ns_;
+      uint64_t                max_ns_;
+      std::vector<uint64_t>   buckets_;
+      
+      // upper bound of the bucket holding the given fraction (0..1)
+      uint64_t percentile(double fraction) const;
+      uint64_t mean() const;
+    };
+    
+    static uint64_t now_ns();
+    static uint32_t bucket_of(uint64_t ns);
+    static uint64_t bucket_low(uint32_t bucket);
+    static uint64_t bucket_high(uint32_t bucket);
+    
+  private:
+    typedef std::atomic<uint64_t> counter;
+    
+    std::atomic<counter *>   buckets_;
+    counter                  count_;
+    counter                  total_ns_;
+    counter                  max_ns_;
+    
+    counter * buckets();
+    
+    // disable copying until properly implemented
+    latency_histogram(const latency_histogram &) = delete;
+    latency_histogram & operator=(const latency_histogram &) = delete;
+    
+  public:
+    latency_histogram();
+    
+    void record(uint64_t ns);
+    void take(snapshot & snap) const;
+    
+    virtual ~latency_histogram();
+  };
+  
+}}
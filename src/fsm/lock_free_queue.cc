@@ -0,0 +1,178 @@
+#include <fsm/lock_free_queue.hh>
+#include <thread>
+
+namespace virtdb { namespace fsm {
+  
+  lock_free_queue::lock_free_queue(uint32_t capacity)
+  : mask_{0},
+    tail_{0},
+    head_{0},
+    spilled_{0}
+  {
+    uint64_t cap = 2;
+    while( cap < capacity ) cap <<= 1;
+    
+    mask_ = cap-1;
+    cells_.reset(new cell[cap]);
+    for( uint64_t i=0; i<cap; ++i )
+    {
+      cells_[i].seq_.store(i, std::memory_order_relaxed);
+      cells_[i].event_ = queued_event{0, 0};
+    }
+  }
+  
+  bool
+  lock_free_queue::try_push(const queued_event & event)
+  {
+    return try_push_bulk(&event, 1);
+  }
+  
+  bool
+  lock_free_queue::try_push_bulk(const queued_event * events,
+                                 size_t n)
+  {
+    if( n == 0 )
+      return true;
+    
+    // the consumer releases cells in order, so when the last cell of
+    // the range is free all the ones before it are free too
+    uint64_t pos = tail_.load(std::memory_order_relaxed);
+    while( true )
+    {
+      uint64_t last = pos+n-1;
+      uint64_t seq = cells_[last & mask_].seq_.load(std::memory_order_acquire);
+      int64_t diff = static_cast<int64_t>(seq - last);
+      if( diff == 0 )
+      {
+        if( tail_.compare_exchange_weak(pos, pos+n, std::memory_order_relaxed) )
+          break;
+      }
+      else if( diff < 0 )
+      {
+        // the consumer has not released this cell yet: full
+        return false;
+      }
+      else
+      {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    
+    for( size_t i=0; i<n; ++i )
+    {
+      cell & c = cells_[(pos+i) & mask_];
+      c.event_ = events[i];
+      c.seq_.store(pos+i+1, std::memory_order_release);
+    }
+    return true;
+  }
+  
+  uint64_t
+  lock_free_queue::capacity() const
+  {
+    return mask_+1;
+  }
+  
+  void
+  lock_free_queue::push(const queued_event & event)
+  {
+    while( !try_push(event) )
+      std::this_thread::yield();
+  }
+  
+  bool
+  lock_free_queue::pop(queued_event & event)
+  {
+    return pop_bulk(&event, 1) == 1;
+  }
+  
+  void
+  lock_free_queue::push_bulk(const queued_event * events,
+                             size_t n)
+  {
+    while( n > 0 )
+    {
+      size_t chunk = n < capacity() ? n : capacity();
+      while( !try_push_bulk(events, chunk) )
+        std::this_thread::yield();
+      events += chunk;
+      n -= chunk;
+    }
+  }
+  
+  size_t
+  lock_free_queue::pop_ring(queued_event * events,
+                            size_t max)
+  {
+    uint64_t pos = head_.load(std::memory_order_relaxed);
+    size_t n = 0;
+    for( ; n<max; ++n, ++pos )
+    {
+      cell & c = cells_[pos & mask_];
+      if( c.seq_.load(std::memory_order_acquire) != pos+1 )
+        break;
+      
+      events[n] = c.event_;
+      c.seq_.store(pos+mask_+1, std::memory_order_release);
+    }
+    if( n > 0 )
+      head_.store(pos, std::memory_order_release);
+    return n;
+  }
+  
+  void
+  lock_free_queue::refill()
+  {
+    std::lock_guard<std::mutex> lck(spill_mtx_);
+    while( !spill_.empty() && try_push(spill_.front()) )
+      spill_.pop_front();
+    spilled_.store(spill_.size(), std::memory_order_release);
+  }
+  
+  size_t
+  lock_free_queue::pop_bulk(queued_event * events,
+                            size_t max)
+  {
+    size_t n = pop_ring(events, max);
+    if( spilled_.load(std::memory_order_acquire) )
+    {
+      refill();
+      if( n == 0 )
+        n = pop_ring(events, max);
+    }
+    return n;
+  }
+  
+  void
+  lock_free_queue::push_nowait(const queued_event * events,
+                               size_t n)
+  {
+    // spilled events go first, the order of a pusher is kept
+    if( spilled_.load(std::memory_order_acquire) == 0 )
+    {
+      while( n > 0 && try_push(*events) )
+      {
+        ++events;
+        --n;
+      }
+      if( n == 0 )
+        return;
+    }
+    
+    std::lock_guard<std::mutex> lck(spill_mtx_);
+    spill_.insert(spill_.end(), events, events+n);
+    spilled_.store(spill_.size(), std::memory_order_release);
+  }
+  
+  uint64_t
+  lock_free_queue::size() const
+  {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t tail = tail_.load(std::memory_order_acquire);
+    uint64_t spilled = spilled_.load(std::memory_order_acquire);
+    return (tail > head ? tail-head : 0) + spilled;
+  }
+  
+  lock_free_queue::~lock_free_queue() {}
+  
+}}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <fsm/event_queue.hh>
+#include <atomic>
+#include <deque>
+#include <mutex>
+
+namespace virtdb { namespace fsm {
+  
+  // bounded MPSC ring: every cell carries a sequence number telling
+  // whether it is free for the producer claiming position `pos`
+  // (seq == pos) or published for the consumer (seq == pos+1).
+  // producers block while the ring is full. push_nowait() puts what
+  // doesn't fit into a locked side list instead, which the consumer
+  // moves into the cells it frees. the list is only touched while it
+  // has events, so it costs one atomic load per pop otherwise.
+  class lock_free_queue : public event_queue
+  {
+    struct cell
+    {
+      std::atomic<uint64_t>   seq_;
+      queued_event            event_;
+    };
+    
+    enum { cache_line = 64 };
+    
+    std::unique_ptr<cell[]>   cells_;
+    uint64_t                  mask_;
+    char                      pad0_[cache_line];
+    std::atomic<uint64_t>     tail_;
+    char                      pad1_[cache_line];
+    std::atomic<uint64_t>     head_;
+    char                      pad2_[cache_line];
+    std::atomic<uint64_t>     spilled_;
+    std::mutex                spill_mtx_;
+    std::deque<queued_event>  spill_;
+    
+    size_t pop_ring(queued_event * events, size_t max);
+    
+    // moves spilled events into the free cells, consumer only
+    void refill();
+    
+    // disable default construction
+    lock_free_queue() = delete;
+    
+    // disable copying until properly implemented
+    lock_free_queue(const lock_free_queue &) = delete;
+    lock_free_queue & operator=(const lock_free_queue &) = delete;
+    
+  public:
+    lock_free_queue(uint32_t capacity);
+    
+    bool try_push(const queued_event & event);
+    
+    // all or nothing, n must not exceed the capacity
+    bool try_push_bulk(const queued_event * events, size_t n);
+    uint64_t capacity() const;
+    
+    void push(const queued_event & event);
+    bool pop(queued_event & event);
+    void push_bulk(const queued_event * events, size_t n);
+    size_t pop_bulk(queued_event * events, size_t max);
+    void push_nowait(const queued_event * events, size_t n);
+    uint64_t size() const;
+    
+    virtual ~lock_free_queue();
+  };
+  
+}}
@@ -0,0 +1,107 @@
+#include <fsm/locked_queue.hh>
+#include <fsm/exception.hh>
+
+namespace virtdb { namespace fsm {
+  
+  namespace
+  {
+    const uint32_t initial_capacity = 4;
+  }
+  
+  locked_queue::locked_queue()
+  : capacity_{0},
+    head_{0},
+    size_{0}
+  {
+  }
+  
+  void
+  locked_queue::reserve(size_t n)
+  {
+    if( size_+n <= capacity_ )
+      return;
+    
+    size_t capacity = (capacity_ ? capacity_ : initial_capacity);
+    while( capacity < size_+n )
+      capacity *= 2;
+    
+    if( capacity > UINT32_MAX )
+    {
+      THROW_("event queue is too large");
+    }
+    
+    // unwrap into the new buffer
+    std::unique_ptr<queued_event[]> events{new queued_event[capacity]};
+    for( uint32_t i=0; i<size_; ++i )
+      events[i] = events_[(head_+i) & (capacity_-1)];
+    
+    events_.swap(events);
+    capacity_  = static_cast<uint32_t>(capacity);
+    head_      = 0;
+  }
+  
+  void
+  locked_queue::push(const queued_event & event)
+  {
+    lock lck(mtx_);
+    reserve(1);
+    events_[(head_+size_) & (capacity_-1)] = event;
+    ++size_;
+  }
+  
+  bool
+  locked_queue::pop(queued_event & event)
+  {
+    lock lck(mtx_);
+    if( size_ == 0 )
+      return false;
+    
+    event = events_[head_];
+    head_ = (head_+1) & (capacity_-1);
+    --size_;
+    return true;
+  }
+  
+  void
+  locked_queue::push_bulk(const queued_event * events,
+                          size_t n)
+  {
+    lock lck(mtx_);
+    reserve(n);
+    for( size_t i=0; i<n; ++i )
+      events_[(head_+size_+i) & (capacity_-1)] = events[i];
+    size_ += static_cast<uint32_t>(n);
+  }
+  
+  size_t
+  locked_queue::pop_bulk(queued_event * events,
+                         size_t max)
+  {
+    lock lck(mtx_);
+    size_t n = size_ < max ? size_ : max;
+    for( size_t i=0; i<n; ++i )
+      events[i] = events_[(head_+i) & (capacity_-1)];
+    if( n )
+    {
+      head_  = (head_+n) & (capacity_-1);
+      size_ -= static_cast<uint32_t>(n);
+    }
+    return n;
+  }
+  
+  uint64_t
+  locked_queue::size() const
+  {
+    lock lck(mtx_);
+    return size_;
+  }
+  
+  bool
+  locked_queue::drop_oldest(queued_event & event)
+  {
+    return pop(event);
+  }
+  
+  locked_queue::~locked_queue() {}
+  
+}}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <fsm/event_queue.hh>
+#include <memory>
+#include <mutex>
+
+namespace virtdb { namespace fsm {
+  
+  // a ring buffer that doubles when full, guarded by a mutex. nothing
+  // is allocated until the first push, so idle machines stay small.
+  class locked_queue : public event_queue
+  {
+    typedef std::unique_lock<std::mutex>  lock;
+    
+    std::unique_ptr<queued_event[]>  events_;
+    uint32_t                         capacity_;
+    uint32_t                         head_;
+    uint32_t                         size_;
+    mutable std::mutex               mtx_;
+    
+    // callers hold the lock
+    void reserve(size_t n);
+    
+    // disable copying until properly implemented
+    locked_queue(const locked_queue &) = delete;
+    locked_queue & operator=(const locked_queue &) = delete;
+    
+  public:
+    locked_queue();
+    
+    void push(const queued_event & event);
+    bool pop(queued_event & event);
+    void push_bulk(const queued_event * events, size_t n);
+    size_t pop_bulk(queued_event * events, size_t max);
+    uint64_t size() const;
+    bool drop_oldest(queued_event & event);
+    
+    virtual ~locked_queue();
+  };
+  
+}}
@@ -3,27 +3,55 @@
 
 namespace virtdb { namespace fsm {
   
-  loop::loop(actor fun,
-             const std::string & description)
-  : fun_{fun},
-    description_{description}
+  bool
+  loop::invalid(uint16_t seqno,
+                transition &,
+                state_machine &,
+                uint64_t)
+  {
+    THROW_(std::string{"invalid actor function at: "}+std::to_string(seqno));
+  }
+  
+  void
+  loop::check()
+  {
+    // execute() makes a single call, so an empty function is replaced
+    // by one that reports it
+    if( !fun_ )
+      fun_ = &invalid;
+  }
+  
+  uint32_t
+  loop::check_every() const
   {
+    return check_every_;
   }
   
   bool
-  loop::execute(uint16_t seqno,
-                transition & trans,
-                state_machine & sm,
-                uint64_t iteration)
+  loop::adaptive() const
   {
-    if( fun_ )
-    {
-      return fun_(seqno, trans, sm, iteration);
-    }
-    else
+    return max_late_ > clock_type::duration::zero();
+  }
+  
+  uint32_t
+  loop::adapt(uint32_t interval,
+              uint64_t iterations,
+              clock_type::duration elapsed) const
+  {
+    const uint32_t max_interval = 1 << 20;
+    
+    // grow at most twofold per check so a sudden slowdown of the
+    // iterations is noticed before it adds up
+    uint64_t next = uint64_t{interval} * 2;
+    if( elapsed > clock_type::duration::zero() && iterations > 0 )
     {
-      THROW_(std::string{"invalid actor function at: "}+std::to_string(seqno));
+      uint64_t fits = (max_late_.count() * iterations) / elapsed.count();
+      if( fits < next ) next = fits;
     }
+    
+    if( next < 1 )            next = 1;
+    if( next > max_interval ) next = max_interval;
+    return static_cast<uint32_t>(next);
   }
   
   const std::string &
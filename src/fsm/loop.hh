@@ -1,8 +1,10 @@
 #pragma once
 
+#include <fsm/inline_function.hh>
 #include <string>
 #include <memory>
-#include <functional>
+#include <chrono>
+#include <utility>
 
 namespace virtdb { namespace fsm {
   
@@ -12,13 +14,34 @@ namespace virtdb { namespace fsm {
   class loop
   {
   public:
-    typedef std::function<bool(uint16_t seqno,
-                               transition & trans,
-                               state_machine & sm,
-                               uint64_t iteration)> actor;
+    typedef std::chrono::steady_clock clock_type;
+    
+    typedef inline_function<bool(uint16_t seqno,
+                                 transition & trans,
+                                 state_machine & sm,
+                                 uint64_t iteration)> actor;
+    
+    // passed to the trace callback through transition::loop_stats()
+    struct stats
+    {
+      uint64_t               iterations_;
+      uint64_t               timeout_checks_;
+      clock_type::duration   elapsed_;
+      bool                   timed_out_;
+    };
+    
   private:
-    actor         fun_;
-    std::string   description_;
+    actor                   fun_;
+    std::string             description_;
+    uint32_t                check_every_;
+    clock_type::duration    max_late_;
+    
+    // what a loop without a function does
+    static bool invalid(uint16_t seqno,
+                        transition & trans,
+                        state_machine & sm,
+                        uint64_t iteration);
+    void check();
     
     // disable default construction
     loop() = delete;
@@ -30,13 +53,60 @@ namespace virtdb { namespace fsm {
   public:
     typedef std::shared_ptr<loop> sptr;
     
-    loop(actor fun,
-         const std::string & description);
+    // any callable that fits into actor, stored without allocating
+    template <typename F>
+    loop(F && fun,
+         const std::string & description)
+    : fun_{std::forward<F>(fun)},
+      description_{description},
+      check_every_{1},
+      max_late_{clock_type::duration::zero()}
+    {
+      check();
+    }
+    
+    // checks the timers only every `check_every` iterations
+    template <typename F>
+    loop(F && fun,
+         const std::string & description,
+         uint32_t check_every)
+    : fun_{std::forward<F>(fun)},
+      description_{description},
+      check_every_{check_every > 0 ? check_every : 1},
+      max_late_{clock_type::duration::zero()}
+    {
+      check();
+    }
+    
+    // adapts the check interval to the measured iteration cost, so
+    // a timeout is noticed about `max_late` after it expired
+    template <typename F>
+    loop(F && fun,
+         const std::string & description,
+         clock_type::duration max_late)
+    : fun_{std::forward<F>(fun)},
+      description_{description},
+      check_every_{1},
+      max_late_{max_late}
+    {
+      check();
+    }
+    
+    uint32_t check_every() const;
+    bool adaptive() const;
+    
+    // next check interval given the time the last `iterations` took
+    uint32_t adapt(uint32_t interval,
+                   uint64_t iterations,
+                   clock_type::duration elapsed) const;
     
     bool execute(uint16_t seqno,
                  transition & trans,
                  state_machine & sm,
-                 uint64_t iteration);
+                 uint64_t iteration)
+    {
+      return fun_(seqno, trans, sm, iteration);
+    }
     
     const std::string & description() const;
     
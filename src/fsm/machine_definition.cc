@@ -0,0 +1,192 @@
+#include <fsm/machine_definition.hh>
+#include <fsm/exception.hh>
+
+namespace virtdb { namespace fsm {
+  
+  machine_definition::machine_definition(const std::string & description,
+                                         trace_fun trace_cb)
+  : description_{description},
+    trace_{trace_cb},
+    unhandled_{trace_unhandled},
+    frozen_{false},
+    registry_{nullptr}
+  {
+  }
+  
+  void
+  machine_definition::check_not_frozen() const
+  {
+    if( frozen_ )
+    {
+      THROW_("cannot change a frozen machine definition");
+    }
+  }
+  
+  const std::string &
+  machine_definition::description() const
+  {
+    return description_;
+  }
+  
+  const machine_definition::trace_fun &
+  machine_definition::trace_cb() const
+  {
+    return trace_;
+  }
+  
+  void
+  machine_definition::add_transition(transition::sptr trans)
+  {
+    if( frozen_ )
+    {
+      THROW_("cannot add transition to a frozen state machine");
+    }
+    else if( trans )
+    {
+      state_event se{trans->state(), trans->event()};
+      transitions_[se] = trans;
+    }
+    else
+    {
+      THROW_("invalid transition received");
+    }
+  }
+  
+  void
+  machine_definition::freeze()
+  {
+    if( !frozen_ )
+    {
+      table_.build(transitions_);
+      for( auto & t : transitions_ )
+        t.second->freeze();
+      if( fallback_ )
+        fallback_->freeze();
+      frozen_ = true;
+    }
+  }
+  
+  bool
+  machine_definition::frozen() const
+  {
+    return frozen_;
+  }
+  
+  void
+  machine_definition::on_unhandled(unhandled_policy policy)
+  {
+    check_not_frozen();
+    if( policy == fallback_unhandled )
+    {
+      THROW_("fallback_unhandled needs a fallback transition");
+    }
+    else if( policy == callback_unhandled )
+    {
+      THROW_("callback_unhandled needs a callback");
+    }
+    unhandled_ = policy;
+  }
+  
+  void
+  machine_definition::on_unhandled(transition::sptr fallback)
+  {
+    check_not_frozen();
+    if( !fallback )
+    {
+      THROW_("invalid fallback transition received");
+    }
+    fallback_   = fallback;
+    unhandled_  = fallback_unhandled;
+  }
+  
+  void
+  machine_definition::on_unhandled(unhandled_fun cb)
+  {
+    check_not_frozen();
+    if( !cb )
+    {
+      THROW_("invalid unhandled callback received");
+    }
+    unhandled_cb_  = cb;
+    unhandled_     = callback_unhandled;
+  }
+  
+  machine_definition::unhandled_policy
+  machine_definition::unhandled() const
+  {
+    return unhandled_;
+  }
+  
+  transition *
+  machine_definition::fallback() const
+  {
+    return fallback_.get();
+  }
+  
+  const machine_definition::unhandled_fun &
+  machine_definition::unhandled_cb() const
+  {
+    return unhandled_cb_;
+  }
+  
+  miss_counter &
+  machine_definition::misses()
+  {
+    return misses_;
+  }
+  
+  latency_histogram &
+  machine_definition::queue_wait()
+  {
+    return queue_wait_;
+  }
+  
+  machine_definition::stats_snapshot
+  machine_definition::stats() const
+  {
+    stats_snapshot snap;
+    snap.transitions_.resize(transitions_.size());
+    size_t i = 0;
+    for( auto const & t : transitions_ )
+    {
+      transition_stats::snapshot & ts = snap.transitions_[i++];
+      ts.state_  = t.first.first;
+      ts.event_  = t.first.second;
+      t.second->stats().take(ts);
+    }
+    queue_wait_.take(snap.queue_wait_);
+    misses_.take(snap.unhandled_);
+    return snap;
+  }
+  
+  void
+  machine_definition::names(name_registry::sptr registry)
+  {
+    check_not_frozen();
+    if( !registry )
+    {
+      THROW_("invalid name registry received");
+    }
+    std::unique_lock<std::mutex> lck(names_mtx_);
+    names_ = registry;
+    registry_.store(names_.get(), std::memory_order_release);
+  }
+  
+  const name_registry::sptr &
+  machine_definition::names() const
+  {
+    if( !registry_.load(std::memory_order_acquire) )
+    {
+      std::unique_lock<std::mutex> lck(names_mtx_);
+      if( !names_ )
+      {
+        names_.reset(new name_registry);
+        registry_.store(names_.get(), std::memory_order_release);
+      }
+    }
+    return names_;
+  }
+  
+  machine_definition::~machine_definition() {}
+  
+}}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <fsm/transition.hh>
+#include <fsm/dispatch_table.hh>
+#include <fsm/latency_histogram.hh>
+#include <fsm/miss_counter.hh>
+#include <fsm/name_registry.hh>
+#include <memory>
+#include <string>
+#include <functional>
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+namespace virtdb { namespace fsm {
+  
+  class state_machine;
+  
+  // the transition graph and the policies of a machine type. once frozen
+  // it is immutable and can be shared by any number of machines running
+  // on any number of threads. only the counters it collects change.
+  class machine_definition
+  {
+  public:
+    typedef std::shared_ptr<machine_definition>  sptr;
+    typedef transition::trace_fun                trace_fun;
+    
+    typedef std::function<void(uint16_t state,
+                               uint16_t event,
+                               state_machine & sm)> unhandled_fun;
+    
+    // what run() does with an event that has no transition in the
+    // current state. all but trace_unhandled are allocation free and
+    // all but ignore_unhandled count the miss per (state,event).
+    enum unhandled_policy {
+      trace_unhandled,      // report through the trace callback
+      ignore_unhandled,     // drop silently
+      count_unhandled,      // drop after counting
+      fallback_unhandled,   // execute the fallback transition
+      callback_unhandled    // call the unhandled callback
+    };
+    
+    struct stats_snapshot
+    {
+      std::vector<transition_stats::snapshot>   transitions_;
+      latency_histogram::snapshot               queue_wait_;
+      std::vector<miss_counter::entry>          unhandled_;
+    };
+    
+  private:
+    typedef dispatch_table::state_event              state_event;
+    typedef dispatch_table::trans_map                trans_map;
+    
+    std::string           description_;
+    trace_fun             trace_;
+    unhandled_policy      unhandled_;
+    transition::sptr      fallback_;
+    unhandled_fun         unhandled_cb_;
+    miss_counter          misses_;
+    latency_histogram     queue_wait_;
+    trans_map             transitions_;
+    dispatch_table        table_;
+    bool                  frozen_;
+    
+    // created by the first name registered or asked for, unnamed ids
+    // resolve to numbers without a registry
+    mutable std::mutex                    names_mtx_;
+    mutable name_registry::sptr           names_;
+    mutable std::atomic<name_registry *>  registry_;
+    
+    // disable default construction
+    machine_definition() = delete;
+    
+    // disable copying until properly implemented
+    machine_definition(const machine_definition &) = delete;
+    machine_definition & operator=(const machine_definition &) = delete;
+    
+    void check_not_frozen() const;
+    
+  public:
+    machine_definition(const std::string & description,
+                       trace_fun trace_cb=trace_fun{});
+    
+    const std::string & description() const;
+    const trace_fun & trace_cb() const;
+    
+    void add_transition(transition::sptr trans);
+    
+    // compiles the registered transitions into a flat dispatch table.
+    // nothing but the names can be changed after this.
+    void freeze();
+    bool frozen() const;
+    
+    transition * find(uint16_t state, uint16_t event) const
+    {
+      if( frozen_ )
+        return table_.find(state, event);
+      
+      auto it = transitions_.find(state_event{state, event});
+      return (it != transitions_.end() ? (it->second).get() : nullptr);
+    }
+    
+    void on_unhandled(unhandled_policy policy);
+    void on_unhandled(transition::sptr fallback);
+    void on_unhandled(unhandled_fun cb);
+    unhandled_policy unhandled() const;
+    transition * fallback() const;
+    const unhandled_fun & unhandled_cb() const;
+    
+    // shared by all machines of the definition
+    miss_counter & misses();
+    latency_histogram & queue_wait();
+    stats_snapshot stats() const;
+    
+    // the registry can only be replaced before freezing, names can be
+    // registered any time
+    void names(name_registry::sptr registry);
+    const name_registry::sptr & names() const;
+    
+    const std::string & state_name(uint16_t st) const
+    {
+      const name_registry * r = registry_.load(std::memory_order_acquire);
+      return r ? r->state_name(st) : name_registry::numeric(st);
+    }
+    
+    const std::string & event_name(uint16_t ev) const
+    {
+      const name_registry * r = registry_.load(std::memory_order_acquire);
+      return r ? r->event_name(ev) : name_registry::numeric(ev);
+    }
+    
+    virtual ~machine_definition();
+  };
+  
+}}
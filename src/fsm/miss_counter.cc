@@ -0,0 +1,131 @@
+#include <fsm/miss_counter.hh>
+
+namespace virtdb { namespace fsm {
+  
+  namespace
+  {
+    uint64_t key_of(uint16_t state, uint16_t event)
+    {
+      return ((uint64_t{state} << 16) | event) + 1;
+    }
+    
+    uint32_t hash_of(uint64_t key)
+    {
+      return static_cast<uint32_t>((key * 0x9E3779B97F4A7C15ULL) >> 32);
+    }
+  }
+  
+  miss_counter::miss_counter()
+  : slots_{nullptr},
+    total_{0},
+    overflow_{0}
+  {
+  }
+  
+  miss_counter::slot *
+  miss_counter::slots()
+  {
+    slot * s = slots_.load(std::memory_order_acquire);
+    if( !s )
+    {
+      // allocated once, on the first miss
+      slot * fresh = new slot[n_slots];
+      for( int i=0; i<n_slots; ++i )
+      {
+        fresh[i].key_.store(0, std::memory_order_relaxed);
+        fresh[i].count_.store(0, std::memory_order_relaxed);
+      }
+      
+      if( slots_.compare_exchange_strong(s, fresh, std::memory_order_acq_rel) )
+        s = fresh;
+      else
+        delete [] fresh;
+    }
+    return s;
+  }
+  
+  void
+  miss_counter::add(uint16_t state,
+                    uint16_t event)
+  {
+    total_.fetch_add(1, std::memory_order_relaxed);
+    
+    slot * s = slots();
+    uint64_t key = key_of(state, event);
+    uint32_t idx = hash_of(key);
+    for( int probe=0; probe<max_probes; ++probe, ++idx )
+    {
+      slot & sl = s[idx & (n_slots-1)];
+      uint64_t k = sl.key_.load(std::memory_order_acquire);
+      if( k == 0 )
+      {
+        if( sl.key_.compare_exchange_strong(k, key, std::memory_order_acq_rel) )
+          k = key;
+      }
+      if( k == key )
+      {
+        sl.count_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+    overflow_.fetch_add(1, std::memory_order_relaxed);
+  }
+  
+  uint64_t
+  miss_counter::count(uint16_t state,
+                      uint16_t event) const
+  {
+    const slot * s = slots_.load(std::memory_order_acquire);
+    if( !s )
+      return 0;
+    
+    uint64_t key = key_of(state, event);
+    uint32_t idx = hash_of(key);
+    for( int probe=0; probe<max_probes; ++probe, ++idx )
+    {
+      const slot & sl = s[idx & (n_slots-1)];
+      uint64_t k = sl.key_.load(std::memory_order_acquire);
+      if( k == 0 )   return 0;
+      if( k == key ) return sl.count_.load(std::memory_order_relaxed);
+    }
+    return 0;
+  }
+  
+  uint64_t
+  miss_counter::total() const
+  {
+    return total_.load(std::memory_order_relaxed);
+  }
+  
+  uint64_t
+  miss_counter::overflow() const
+  {
+    return overflow_.load(std::memory_order_relaxed);
+  }
+  
+  void
+  miss_counter::take(std::vector<entry> & entries) const
+  {
+    entries.clear();
+    const slot * s = slots_.load(std::memory_order_acquire);
+    if( !s )
+      return;
+    
+    for( int i=0; i<n_slots; ++i )
+    {
+      uint64_t k = s[i].key_.load(std::memory_order_acquire);
+      if( k != 0 )
+      {
+        entries.push_back(entry{static_cast<uint16_t>((k-1) >> 16),
+                                static_cast<uint16_t>((k-1) & 0xffff),
+                                s[i].count_.load(std::memory_order_relaxed)});
+      }
+    }
+  }
+  
+  miss_counter::~miss_counter()
+  {
+    delete [] slots_.load(std::memory_order_relaxed);
+  }
+  
+}}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+namespace virtdb { namespace fsm {
+  
+  // counts (state,event) pairs that had no transition. a fixed open
+  // addressed table of atomic slots, claimed with CAS on first use of
+  // a pair. pairs not fitting into the table are counted as overflow.
+  class miss_counter
+  {
+  public:
+    struct entry
+    {
+      uint16_t   state_;
+      uint16_t   event_;
+      uint64_t   count_;
+    };
+    
+  private:
+    enum {
+      n_slots     = 1024,
+      max_probes  = 32
+    };
+    
+    struct slot
+    {
+      std::atomic<uint64_t>   key_;   // (state<<16|event)+1, zero when free
+      std::atomic<uint64_t>   count_;
+    };
+    
+    std::atomic<slot *>     slots_;
+    std::atomic<uint64_t>   total_;
+    std::atomic<uint64_t>   overflow_;
+    
+    slot * slots();
+    
+    // disable copying until properly implemented
+    miss_counter(const miss_counter &) = delete;
+    miss_counter & operator=(const miss_counter &) = delete;
+    
+  public:
+    miss_counter();
+    
+    void add(uint16_t state, uint16_t event);
+    
+    uint64_t count(uint16_t state, uint16_t event) const;
+    uint64_t total() const;
+    uint64_t overflow() const;
+    void take(std::vector<entry> & entries) const;
+    
+    virtual ~miss_counter();
+  };
+  
+}}
@@ -0,0 +1,113 @@
+#include <fsm/name_registry.hh>
+
+namespace virtdb { namespace fsm {
+  
+  name_registry::table::table()
+  {
+    for( auto & p : pages_ )
+      p.store(nullptr, std::memory_order_relaxed);
+  }
+  
+  void
+  name_registry::table::set(uint16_t id,
+                            const std::string * name)
+  {
+    auto & slot = pages_[id >> page_bits];
+    entry * page = slot.load(std::memory_order_acquire);
+    if( !page )
+    {
+      page = new entry[page_size];
+      for( int i=0; i<page_size; ++i )
+        page[i].store(nullptr, std::memory_order_relaxed);
+      slot.store(page, std::memory_order_release);
+    }
+    page[id & (page_size-1)].store(name, std::memory_order_release);
+  }
+  
+  void
+  name_registry::table::take(name_map & names) const
+  {
+    names.clear();
+    for( int p=0; p<n_pages; ++p )
+    {
+      const entry * page = pages_[p].load(std::memory_order_acquire);
+      if( !page )
+        continue;
+      
+      for( int i=0; i<page_size; ++i )
+      {
+        const std::string * n = page[i].load(std::memory_order_acquire);
+        if( n )
+          names[static_cast<uint16_t>((p << page_bits) | i)] = *n;
+      }
+    }
+  }
+  
+  name_registry::table::~table()
+  {
+    for( auto & p : pages_ )
+      delete [] p.load(std::memory_order_relaxed);
+  }
+  
+  name_registry::name_registry() {}
+  
+  const std::string &
+  name_registry::numeric(uint16_t id)
+  {
+    // filled on first use of an id, shared by every registry
+    static table             numbers;
+    static std::mutex        numbers_mtx;
+    static string_set        numbers_interned;
+    
+    const std::string * n = numbers.find(id);
+    if( !n )
+    {
+      std::unique_lock<std::mutex> lck(numbers_mtx);
+      n = numbers.find(id);
+      if( !n )
+      {
+        n = &(*numbers_interned.insert(std::to_string(id)).first);
+        numbers.set(id, n);
+      }
+    }
+    return *n;
+  }
+  
+  const std::string *
+  name_registry::intern(const std::string & name)
+  {
+    // unordered_set nodes never move, so the address is stable
+    return &(*interned_.insert(name).first);
+  }
+  
+  void
+  name_registry::state_name(uint16_t st,
+                            const std::string & name)
+  {
+    std::unique_lock<std::mutex> lck(mtx_);
+    states_.set(st, intern(name));
+  }
+  
+  void
+  name_registry::event_name(uint16_t ev,
+                            const std::string & name)
+  {
+    std::unique_lock<std::mutex> lck(mtx_);
+    events_.set(ev, intern(name));
+  }
+  
+  void
+  name_registry::state_names(name_map & names) const
+  {
+    states_.take(names);
+  }
+  
+  void
+  name_registry::event_names(name_map & names) const
+  {
+    events_.take(names);
+  }
+  
+  name_registry::~name_registry() {}
+  
+}}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <map>
+#include <unordered_set>
+#include <cstdint>
+
+namespace virtdb { namespace fsm {
+  
+  // interned state and event names. registering takes a mutex, looking
+  // up is a lock free read from a dense table indexed by id. names stay
+  // valid for the lifetime of the registry, even when re-registered,
+  // and unnamed ids resolve to a process wide table of numbers.
+  // machines of the same type can share one registry.
+  class name_registry
+  {
+  public:
+    typedef std::shared_ptr<name_registry>      sptr;
+    typedef std::map<uint16_t, std::string>     name_map;
+    
+  private:
+    class table
+    {
+      enum {
+        page_bits  = 8,
+        page_size  = 1 << page_bits,
+        n_pages    = (1 << 16) >> page_bits
+      };
+      
+      typedef std::atomic<const std::string *> entry;
+      
+      std::atomic<entry *>   pages_[n_pages];
+      
+      // disable copying until properly implemented
+      table(const table &) = delete;
+      table & operator=(const table &) = delete;
+      
+    public:
+      table();
+      
+      const std::string * find(uint16_t id) const
+      {
+        const entry * page = pages_[id >> page_bits].load(std::memory_order_acquire);
+        return page ? page[id & (page_size-1)].load(std::memory_order_acquire) : nullptr;
+      }
+      
+      // callers serialize the writes
+      void set(uint16_t id, const std::string * name);
+      void take(name_map & names) const;
+      
+      ~table();
+    };
+    
+    typedef std::unordered_set<std::string> string_set;
+    
+    std::mutex    mtx_;
+    string_set    interned_;
+    table         states_;
+    table         events_;
+    
+    const std::string * intern(const std::string & name);
+    
+    // disable copying until properly implemented
+    name_registry(const name_registry &) = delete;
+    name_registry & operator=(const name_registry &) = delete;
+    
+  public:
+    name_registry();
+    
+    static const std::string & numeric(uint16_t id);
+    
+    void state_name(uint16_t st, const std::string & name);
+    void event_name(uint16_t ev, const std::string & name);
+    
+    const std::string & state_name(uint16_t st) const
+    {
+      const std::string * n = states_.find(st);
+      return n ? *n : numeric(st);
+    }
+    
+    const std::string & event_name(uint16_t ev) const
+    {
+      const std::string * n = events_.find(ev);
+      return n ? *n : numeric(ev);
+    }
+    
+    // the explicitly registered names
+    void state_names(name_map & names) const;
+    void event_names(name_map & names) const;
+    
+    virtual ~name_registry();
+  };
+  
+}}
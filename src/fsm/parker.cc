@@ -0,0 +1,59 @@
+#include <fsm/parker.hh>
+
+namespace virtdb { namespace fsm {
+  
+  parker::parker()
+  : state_{empty}
+  {
+  }
+  
+  void
+  parker::park(const clock_type::time_point & deadline)
+  {
+    int expected = notified;
+    if( state_.compare_exchange_strong(expected, empty) )
+      return;
+    
+    lock lck(mtx_);
+    expected = empty;
+    if( !state_.compare_exchange_strong(expected, parked) )
+    {
+      // notified since the first check
+      state_.store(empty);
+      return;
+    }
+    
+    while( true )
+    {
+      if( deadline == clock_type::time_point::max() )
+        cv_.wait(lck);
+      else
+        cv_.wait_until(lck, deadline);
+      
+      expected = notified;
+      if( state_.compare_exchange_strong(expected, empty) )
+        return;
+      
+      if( clock_type::now() >= deadline )
+      {
+        state_.store(empty);
+        return;
+      }
+      // spurious wakeup
+    }
+  }
+  
+  void
+  parker::unpark()
+  {
+    if( state_.exchange(notified) == parked )
+    {
+      // the sleeper holds the lock until it waits, so it can't miss this
+      lock lck(mtx_);
+      cv_.notify_one();
+    }
+  }
+  
+  parker::~parker() {}
+  
+}}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace virtdb { namespace fsm {
+  
+  // lets one thread sleep until another one has something for it. the
+  // state word makes unpark() a single atomic exchange while the sleeper
+  // is awake, the mutex and the condition variable are only touched when
+  // it is really parked. a wakeup arriving before park() is not lost,
+  // the next park() returns at once.
+  class parker
+  {
+  public:
+    typedef std::chrono::steady_clock clock_type;
+    
+  private:
+    enum {
+      empty,
+      parked,
+      notified
+    };
+    
+    typedef std::unique_lock<std::mutex> lock;
+    
+    std::atomic<int>          state_;
+    std::mutex                mtx_;
+    std::condition_variable   cv_;
+    
+    // disable copying until properly implemented
+    parker(const parker &) = delete;
+    parker & operator=(const parker &) = delete;
+    
+  public:
+    parker();
+    
+    // returns when unparked or at the deadline, whichever comes first
+    void park(const clock_type::time_point & deadline=clock_type::time_point::max());
+    void unpark();
+    
+    virtual ~parker();
+  };
+  
+}}
@@ -0,0 +1,38 @@
+#include <fsm/payload.hh>
+
+namespace virtdb { namespace fsm {
+  
+  payload::payload()
+  : data_{nullptr},
+    size_{0}
+  {
+  }
+  
+  payload::payload(const void * data,
+                   uint32_t size)
+  : data_{data},
+    size_{size}
+  {
+  }
+  
+  const void *
+  payload::data() const
+  {
+    return data_;
+  }
+  
+  uint32_t
+  payload::size() const
+  {
+    return size_;
+  }
+  
+  bool
+  payload::empty() const
+  {
+    return size_ == 0;
+  }
+  
+  payload::~payload() {}
+  
+}}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <fsm/exception.hh>
+#include <cstdint>
+
+namespace virtdb { namespace fsm {
+  
+  // read only view of the payload of the event being dispatched. the
+  // data stays where the producer put it and is recycled when the
+  // transition finishes, so it must not be kept beyond that.
+  class payload
+  {
+    const void *   data_;
+    uint32_t       size_;
+    
+  public:
+    payload();
+    payload(const void * data, uint32_t size);
+    
+    const void * data() const;
+    uint32_t size() const;
+    bool empty() const;
+    
+    template <typename T>
+    const T & as() const
+    {
+      if( size_ != sizeof(T) )
+      {
+        THROW_("payload size mismatch");
+      }
+      return *static_cast<const T *>(data_);
+    }
+    
+    virtual ~payload();
+  };
+  
+}}
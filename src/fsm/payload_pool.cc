@@ -0,0 +1,146 @@
+#include <fsm/payload_pool.hh>
+#include <fsm/exception.hh>
+
+namespace virtdb { namespace fsm {
+  
+  namespace
+  {
+    const uint64_t index_mask = 0xffffffffULL;
+    
+    uint64_t
+    make_head(uint64_t tag,
+              uint32_t index_plus_one)
+    {
+      return (tag << 32) | index_plus_one;
+    }
+  }
+  
+  payload_pool::payload_pool()
+  : free_{0},
+    n_chunks_{0},
+    n_blocks_{0}
+  {
+    for( uint32_t i=0; i<max_chunks; ++i )
+    {
+      data_[i] = nullptr;
+      next_[i] = nullptr;
+    }
+  }
+  
+  uint32_t
+  payload_pool::chunk_start(uint32_t chunk)
+  {
+    return first_chunk * ((1u << chunk) - 1);
+  }
+  
+  uint32_t
+  payload_pool::chunk_of(uint32_t index)
+  {
+    // chunk c holds [first*(2^c-1), first*(2^(c+1)-1))
+    uint32_t x = index/first_chunk + 1;
+    return 31 - __builtin_clz(x);
+  }
+  
+  void
+  payload_pool::grow()
+  {
+    std::unique_lock<std::mutex> lck(grow_mtx_);
+    
+    // someone else grew the pool or released a block meanwhile
+    if( (free_.load(std::memory_order_acquire) & index_mask) != 0 )
+      return;
+    
+    if( n_chunks_ == max_chunks )
+    {
+      THROW_("payload pool exhausted");
+    }
+    
+    uint32_t c = n_chunks_;
+    uint32_t start = chunk_start(c);
+    uint32_t n = first_chunk << c;
+    data_[c] = new char[static_cast<size_t>(n)*block_size];
+    next_[c] = new link[n];
+    
+    // chain the new blocks, the last one points to the current head
+    for( uint32_t i=0; i+1<n; ++i )
+      next_[c][i].store(start+i+2, std::memory_order_relaxed);
+    
+    uint64_t head = free_.load(std::memory_order_relaxed);
+    while( true )
+    {
+      next_[c][n-1].store(static_cast<uint32_t>(head & index_mask), std::memory_order_relaxed);
+      if( free_.compare_exchange_weak(head,
+                                      make_head((head >> 32)+1, start+1),
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed) )
+      {
+        break;
+      }
+    }
+    ++n_chunks_;
+    n_blocks_.fetch_add(n, std::memory_order_relaxed);
+  }
+  
+  payload_pool::block
+  payload_pool::alloc(uint32_t size)
+  {
+    if( size == 0 || size > block_size )
+    {
+      THROW_("payload size must be between 1 and block_size");
+    }
+    
+    uint64_t head = free_.load(std::memory_order_acquire);
+    while( true )
+    {
+      uint32_t first = static_cast<uint32_t>(head & index_mask);
+      if( first == 0 )
+      {
+        grow();
+        head = free_.load(std::memory_order_acquire);
+        continue;
+      }
+      
+      uint32_t next = next_of(first-1).load(std::memory_order_relaxed);
+      if( free_.compare_exchange_weak(head,
+                                      make_head((head >> 32)+1, next),
+                                      std::memory_order_acquire,
+                                      std::memory_order_acquire) )
+      {
+        return block{first-1, size, data(first-1)};
+      }
+    }
+  }
+  
+  void
+  payload_pool::release(uint32_t index)
+  {
+    uint64_t head = free_.load(std::memory_order_relaxed);
+    while( true )
+    {
+      next_of(index).store(static_cast<uint32_t>(head & index_mask), std::memory_order_relaxed);
+      if( free_.compare_exchange_weak(head,
+                                      make_head((head >> 32)+1, index+1),
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed) )
+      {
+        return;
+      }
+    }
+  }
+  
+  uint32_t
+  payload_pool::capacity() const
+  {
+    return n_blocks_.load(std::memory_order_relaxed);
+  }
+  
+  payload_pool::~payload_pool()
+  {
+    for( uint32_t i=0; i<max_chunks; ++i )
+    {
+      delete [] data_[i];
+      delete [] next_[i];
+    }
+  }
+  
+}}
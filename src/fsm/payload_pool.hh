@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+namespace virtdb { namespace fsm {
+  
+  // fixed size payload blocks for one machine. producers take a block,
+  // fill it in place and enqueue its index; the machine hands it to the
+  // transition and releases it afterwards. blocks come from chunks of
+  // growing size that are kept until the pool is destroyed, so once the
+  // pool has grown to the peak number of payloads in flight, neither
+  // alloc() nor release() allocates. both are lock free, only growing
+  // takes a mutex.
+  class payload_pool
+  {
+  public:
+    enum {
+      block_size   = 256,
+      first_chunk  = 16,    // blocks in the first chunk, doubling after
+      max_chunks   = 16
+    };
+    
+    struct block
+    {
+      uint32_t   index_;
+      uint32_t   size_;
+      void *     data_;
+    };
+    
+  private:
+    typedef std::atomic<uint32_t> link;
+    
+    // the free list head: a tag against ABA in the high word, the index
+    // of the first free block plus one in the low word
+    std::atomic<uint64_t>   free_;
+    std::mutex              grow_mtx_;
+    uint32_t                n_chunks_;
+    std::atomic<uint32_t>   n_blocks_;
+    char *                  data_[max_chunks];
+    link *                  next_[max_chunks];
+    
+    static uint32_t chunk_of(uint32_t index);
+    static uint32_t chunk_start(uint32_t chunk);
+    
+    link & next_of(uint32_t index) const
+    {
+      uint32_t c = chunk_of(index);
+      return next_[c][index-chunk_start(c)];
+    }
+    
+    // links a new chunk into the free list
+    void grow();
+    
+    // disable copying until properly implemented
+    payload_pool(const payload_pool &) = delete;
+    payload_pool & operator=(const payload_pool &) = delete;
+    
+  public:
+    payload_pool();
+    
+    block alloc(uint32_t size);
+    void release(uint32_t index);
+    
+    void * data(uint32_t index) const
+    {
+      uint32_t c = chunk_of(index);
+      return data_[c] + static_cast<size_t>(index-chunk_start(c))*block_size;
+    }
+    
+    // blocks created so far
+    uint32_t capacity() const;
+    
+    virtual ~payload_pool();
+  };
+  
+}}
@@ -0,0 +1,185 @@
+#include <fsm/prioritized_queue.hh>
+#include <fsm/exception.hh>
+
+namespace virtdb { namespace fsm {
+  
+  prioritized_queue::prioritized_queue(const queue_options & opts)
+  : scheduling_{opts.scheduling_},
+    top_{0}
+  {
+    if( opts.priorities_ < 1 || opts.priorities_ > max_priorities )
+    {
+      THROW_("number of priorities must be between 1 and max_priorities");
+    }
+    top_ = static_cast<uint8_t>(opts.priorities_-1);
+    
+    queue_options sub{opts};
+    sub.priorities_ = 1;
+    for( uint8_t p=0; p<=top_; ++p )
+    {
+      if( opts.weights_[p] == 0 )
+      {
+        THROW_("priority weights must be positive");
+      }
+      classes_[p].queue_   = event_queue::create(sub);
+      classes_[p].weight_  = opts.weights_[p];
+      classes_[p].credit_  = opts.weights_[p];
+    }
+  }
+  
+  uint8_t
+  prioritized_queue::classes() const
+  {
+    return static_cast<uint8_t>(top_+1);
+  }
+  
+  void
+  prioritized_queue::push(const queued_event & event)
+  {
+    queue_class & c = classes_[class_of(event)];
+    c.queued_.add(event.event_);
+    c.queue_->push(event);
+  }
+  
+  bool
+  prioritized_queue::pop(queued_event & event)
+  {
+    return pop_bulk(&event, 1) == 1;
+  }
+  
+  void
+  prioritized_queue::push_runs(const queued_event * events,
+                               size_t n,
+                               bool nowait)
+  {
+    // runs of the same class go with one push
+    size_t i = 0;
+    while( i < n )
+    {
+      uint8_t p = class_of(events[i]);
+      size_t j = i;
+      while( j < n && class_of(events[j]) == p )
+        classes_[p].queued_.add(events[j++].event_);
+      if( nowait )
+        classes_[p].queue_->push_nowait(events+i, j-i);
+      else
+        classes_[p].queue_->push_bulk(events+i, j-i);
+      i = j;
+    }
+  }
+  
+  void
+  prioritized_queue::push_bulk(const queued_event * events,
+                               size_t n)
+  {
+    push_runs(events, n, false);
+  }
+  
+  void
+  prioritized_queue::push_nowait(const queued_event * events,
+                                 size_t n)
+  {
+    push_runs(events, n, true);
+  }
+  
+  size_t
+  prioritized_queue::pop_strict(queued_event * events,
+                                size_t max)
+  {
+    for( int p=top_; p>=0; --p )
+    {
+      size_t limit = (p == top_ || max < low_batch) ? max : size_t(low_batch);
+      size_t n = classes_[p].queue_->pop_bulk(events, limit);
+      if( n )
+        return n;
+    }
+    return 0;
+  }
+  
+  size_t
+  prioritized_queue::pop_weighted(queued_event * events,
+                                  size_t max)
+  {
+    // the second pass runs after the credits were refilled
+    for( int pass=0; pass<2; ++pass )
+    {
+      for( int p=top_; p>=0; --p )
+      {
+        queue_class & c = classes_[p];
+        if( c.credit_ == 0 )
+          continue;
+        
+        size_t limit = (p == top_ || max < low_batch) ? max : size_t(low_batch);
+        if( limit > c.credit_ )
+          limit = c.credit_;
+        
+        size_t n = c.queue_->pop_bulk(events, limit);
+        if( n )
+        {
+          c.credit_ -= static_cast<uint32_t>(n);
+          return n;
+        }
+      }
+      
+      for( uint8_t p=0; p<=top_; ++p )
+        classes_[p].credit_ = classes_[p].weight_;
+    }
+    return 0;
+  }
+  
+  size_t
+  prioritized_queue::pop_bulk(queued_event * events,
+                              size_t max)
+  {
+    if( scheduling_ == queue_options::weighted )
+      return pop_weighted(events, max);
+    else
+      return pop_strict(events, max);
+  }
+  
+  uint64_t
+  prioritized_queue::size() const
+  {
+    uint64_t ret = 0;
+    for( uint8_t p=0; p<=top_; ++p )
+      ret += classes_[p].queue_->size();
+    return ret;
+  }
+  
+  bool
+  prioritized_queue::drop_oldest(queued_event & event)
+  {
+    for( uint8_t p=0; p<=top_; ++p )
+    {
+      if( classes_[p].queue_->drop_oldest(event) )
+      {
+        // it will never be dispatched
+        classes_[p].queued_.remove(event.event_);
+        return true;
+      }
+    }
+    return false;
+  }
+  
+  uint64_t
+  prioritized_queue::size(uint8_t priority) const
+  {
+    return classes_[priority < top_ ? priority : top_].queued_.size();
+  }
+  
+  bool
+  prioritized_queue::has(uint16_t event,
+                         uint8_t priority) const
+  {
+    return classes_[priority < top_ ? priority : top_].queued_.has(event);
+  }
+  
+  void
+  prioritized_queue::dispatched(const queued_event & event)
+  {
+    classes_[class_of(event)].queued_.remove(event.event_);
+  }
+  
+  prioritized_queue::~prioritized_queue() {}
+  
+}}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <fsm/event_queue.hh>
+#include <fsm/event_counter.hh>
+
+namespace virtdb { namespace fsm {
+  
+  // one sub-queue of the configured kind per priority class. pop_bulk()
+  // takes from one class only and looks at a fixed number of classes,
+  // so dequeuing stays O(1). lower classes are popped in small batches,
+  // so a control event never waits behind more than low_batch others.
+  // the per class counters are maintained from push to dispatched().
+  class prioritized_queue : public event_queue
+  {
+    enum { low_batch = 16 };
+    
+    struct queue_class
+    {
+      event_queue::uptr   queue_;
+      event_counter       queued_;
+      uint32_t            weight_;
+      uint32_t            credit_;   // consumer only
+    };
+    
+    queue_options::scheduling_type   scheduling_;
+    uint8_t                          top_;
+    queue_class                      classes_[max_priorities];
+    
+    uint8_t class_of(const queued_event & event) const
+    {
+      return event.priority_ < top_ ? event.priority_ : top_;
+    }
+    
+    void push_runs(const queued_event * events, size_t n, bool nowait);
+    size_t pop_strict(queued_event * events, size_t max);
+    size_t pop_weighted(queued_event * events, size_t max);
+    
+    // disable default construction
+    prioritized_queue() = delete;
+    
+    // disable copying until properly implemented
+    prioritized_queue(const prioritized_queue &) = delete;
+    prioritized_queue & operator=(const prioritized_queue &) = delete;
+    
+  public:
+    prioritized_queue(const queue_options & opts);
+    
+    uint8_t classes() const;
+    
+    void push(const queued_event & event);
+    bool pop(queued_event & event);
+    void push_bulk(const queued_event * events, size_t n);
+    size_t pop_bulk(queued_event * events, size_t max);
+    void push_nowait(const queued_event * events, size_t n);
+    uint64_t size() const;
+    
+    // from the lowest class that has queued events
+    bool drop_oldest(queued_event & event);
+    
+    // events of the class not dispatched yet
+    uint64_t size(uint8_t priority) const;
+    bool has(uint16_t event, uint8_t priority) const;
+    void dispatched(const queued_event & event);
+    
+    virtual ~prioritized_queue();
+  };
+  
+}}
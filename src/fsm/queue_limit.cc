@@ -0,0 +1,105 @@
+#include <fsm/queue_limit.hh>
+#include <fsm/exception.hh>
+
+namespace virtdb { namespace fsm {
+  
+  queue_limit::queue_limit(const queue_options & opts)
+  : limit_{opts.limit_},
+    overflow_{opts.overflow_},
+    timeout_{opts.block_timeout_},
+    rejected_{0},
+    timed_out_{0},
+    dropped_{0},
+    coalesced_{0},
+    waiters_{0}
+  {
+    if( limit_ == 0 )
+    {
+      THROW_("queue limit must be positive");
+    }
+    else if( overflow_ == queue_options::drop_oldest &&
+             opts.kind_ == queue_options::lock_free )
+    {
+      THROW_("lock free queues can't drop their oldest event");
+    }
+    else if( timeout_.count() < 0 )
+    {
+      THROW_("block timeout must not be negative");
+    }
+  }
+  
+  enqueue_status
+  queue_limit::wait_for_room(event_counter & queued,
+                             uint16_t event)
+  {
+    auto deadline = clock_type::now() + timeout_;
+    bool added = false;
+    
+    waiters_.fetch_add(1, std::memory_order_seq_cst);
+    {
+      // checked under the lock, so a wake() after a failed check is not lost
+      lock lck(mtx_);
+      while( !(added = queued.add_below(event, limit_)) )
+      {
+        if( cv_.wait_until(lck, deadline) == std::cv_status::timeout )
+        {
+          added = queued.add_below(event, limit_);
+          break;
+        }
+      }
+    }
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+    
+    if( added )
+      return enqueued;
+    
+    timed_out_.fetch_add(1, std::memory_order_relaxed);
+    return timed_out;
+  }
+  
+  void
+  queue_limit::wake()
+  {
+    {
+      lock lck(mtx_);
+    }
+    cv_.notify_one();
+  }
+  
+  enqueue_status
+  queue_limit::reject()
+  {
+    rejected_.fetch_add(1, std::memory_order_relaxed);
+    return rejected;
+  }
+  
+  enqueue_status
+  queue_limit::coalesce()
+  {
+    coalesced_.fetch_add(1, std::memory_order_relaxed);
+    return coalesced;
+  }
+  
+  void
+  queue_limit::count_dropped()
+  {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+  
+  queue_limit::stats_snapshot
+  queue_limit::stats(const event_counter & queued) const
+  {
+    stats_snapshot ret;
+    ret.size_        = queued.size();
+    ret.high_water_  = queued.high_water();
+    ret.limit_       = limit_;
+    ret.rejected_    = rejected_.load(std::memory_order_relaxed);
+    ret.timed_out_   = timed_out_.load(std::memory_order_relaxed);
+    ret.dropped_     = dropped_.load(std::memory_order_relaxed);
+    ret.coalesced_   = coalesced_.load(std::memory_order_relaxed);
+    return ret;
+  }
+  
+  queue_limit::~queue_limit() {}
+  
+}}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <fsm/event_queue.hh>
+#include <fsm/event_counter.hh>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace virtdb { namespace fsm {
+  
+  // what happened to an enqueued event
+  enum enqueue_status : uint8_t {
+    enqueued,             // queued
+    enqueued_displacing,  // queued after the oldest event was dropped
+    coalesced,            // the same event is queued already, nothing added
+    skipped,              // the condition of enqueue_unique/if_empty failed
+    rejected,             // the queue is full
+    timed_out             // the queue stayed full for the block timeout
+  };
+  
+  inline bool admitted(enqueue_status status)
+  {
+    return status <= enqueued_displacing;
+  }
+  
+  // the capacity of a bounded machine and the counters of its overflow
+  // policy. producers blocked for room wait on the condition variable,
+  // which the consumer only touches when there are waiters.
+  class queue_limit
+  {
+  public:
+    typedef std::chrono::steady_clock clock_type;
+    
+    struct stats_snapshot
+    {
+      uint64_t   size_;
+      uint64_t   high_water_;
+      uint64_t   limit_;
+      uint64_t   rejected_;
+      uint64_t   timed_out_;
+      uint64_t   dropped_;
+      uint64_t   coalesced_;
+    };
+    
+  private:
+    typedef std::unique_lock<std::mutex> lock;
+    
+    uint64_t                        limit_;
+    queue_options::overflow_type    overflow_;
+    std::chrono::microseconds       timeout_;
+    std::atomic<uint64_t>           rejected_;
+    std::atomic<uint64_t>           timed_out_;
+    std::atomic<uint64_t>           dropped_;
+    std::atomic<uint64_t>           coalesced_;
+    std::atomic<uint32_t>           waiters_;
+    std::mutex                      mtx_;
+    std::condition_variable         cv_;
+    
+    void wake();
+    
+    // disable default construction
+    queue_limit() = delete;
+    
+    // disable copying until properly implemented
+    queue_limit(const queue_limit &) = delete;
+    queue_limit & operator=(const queue_limit &) = delete;
+    
+  public:
+    queue_limit(const queue_options & opts);
+    
+    uint64_t limit() const { return limit_; }
+    queue_options::overflow_type overflow() const { return overflow_; }
+    
+    // adds the event to the counter once it is below the limit, or
+    // gives up after the block timeout
+    enqueue_status wait_for_room(event_counter & queued, uint16_t event);
+    
+    // called by the consumer after an event left the counter
+    void room_made()
+    {
+      // pairs with the increment of waiters_ in wait_for_room()
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if( waiters_.load(std::memory_order_relaxed) )
+        wake();
+    }
+    
+    enqueue_status reject();
+    enqueue_status coalesce();
+    void count_dropped();
+    
+    stats_snapshot stats(const event_counter & queued) const;
+    
+    virtual ~queue_limit();
+  };
+  
+}}
@@ -1,93 +1,792 @@
 #include <fsm/state_machine.hh>
+#include <fsm/executor.hh>
+#include <fsm/prioritized_queue.hh>
 #include <fsm/exception.hh>
+#include <fsm/trace.hh>
 #include <sstream>
+#include <deque>
+#include <cstring>
 
 namespace virtdb { namespace fsm {
   
+  namespace
+  {
+    // the machine whose run() is executing on this thread. events
+    // enqueued by its actions are staged and published together.
+    thread_local state_machine * running_machine = nullptr;
+    
+    // the payload of the event it is dispatching
+    const payload no_payload;
+    thread_local const payload * running_payload = &no_payload;
+    
+    // one staging buffer per nesting level of run(), they keep their
+    // capacity so staging doesn't allocate in steady state. a deque
+    // keeps the outer buffers in place while it grows.
+    typedef std::vector<queued_event> staged_events;
+    thread_local std::deque<staged_events> staging;
+    thread_local size_t staging_depth = 0;
+    thread_local staged_events * running_staged = nullptr;
+    
+    // the stamped events of enqueue_bulk() calls too large for the stack
+    thread_local staged_events bulk_staging;
+    
+    // the event chained by the transition being executed
+    const uint32_t no_chain = 0x10000;
+    thread_local uint32_t running_chain = no_chain;
+    
+    const transition::trace_fun no_trace;
+    
+    std::atomic<uint32_t> next_machine_id{0};
+    
+    // dequeued with one synchronization in run()
+    const size_t run_batch_size = 64;
+    
+    struct running_guard
+    {
+      state_machine *   prev_;
+      const payload *   prev_payload_;
+      staged_events *   prev_staged_;
+      uint32_t          prev_chain_;
+      
+      running_guard(state_machine * sm)
+      : prev_{running_machine},
+        prev_payload_{running_payload},
+        prev_staged_{running_staged},
+        prev_chain_{running_chain}
+      {
+        running_chain = no_chain;
+        if( staging.size() == staging_depth )
+          staging.emplace_back();
+        running_staged = &staging[staging_depth++];
+        running_machine = sm;
+      }
+      
+      ~running_guard()
+      {
+        running_staged->clear();
+        --staging_depth;
+        running_machine = prev_;
+        running_payload = prev_payload_;
+        running_staged = prev_staged_;
+        running_chain = prev_chain_;
+      }
+    };
+    
+    // gives back the payload block of a dispatched event
+    struct block_guard
+    {
+      payload_pool *   pool_;
+      uint32_t         index_;
+      
+      block_guard(payload_pool * pool, uint32_t index)
+      : pool_{pool},
+        index_{index}
+      {
+      }
+      
+      ~block_guard()
+      {
+        if( pool_ )
+          pool_->release(index_);
+      }
+    };
+    
+    // an executor detaching from the machine waits for the notifies
+    // that saw it attached
+    struct notify_guard
+    {
+      std::atomic<uint32_t> &  notifying_;
+      
+      notify_guard(std::atomic<uint32_t> & notifying)
+      : notifying_(notifying)
+      {
+        notifying_.fetch_add(1, std::memory_order_seq_cst);
+      }
+      
+      ~notify_guard()
+      {
+        notifying_.fetch_sub(1, std::memory_order_release);
+      }
+    };
+    
+    struct stop_guard
+    {
+      stop_token &  stop_;
+      parker *      parker_;
+      
+      stop_guard(stop_token & stop, parker * p)
+      : stop_(stop),
+        parker_{p}
+      {
+        stop_.attach(parker_);
+      }
+      
+      ~stop_guard()
+      {
+        stop_.detach(parker_);
+      }
+    };
+  }
+  
+  struct state_machine::suspension
+  {
+    std::unique_ptr<transition::parked>   parked_;
+    uint16_t                              state_;   // the transition started from
+    uint16_t                              event_;
+    uint32_t                              chain_;   // chained before suspending
+    timer_handle                          wake_;    // at the deadline, if any
+    std::vector<queued_event>             held_;    // popped with the event
+  };
+  
+  struct state_machine::runtime
+  {
+    event_queue::uptr                     queue_;
+    event_counter                         queued_;
+    std::unique_ptr<queue_limit>          limit_;
+    bool                                  prioritized_;
+    std::atomic<parker *>                 parker_;
+    std::atomic<payload_pool *>           pool_;
+    trace_ring::uptr                      ring_;
+    std::unique_ptr<suspension>           suspended_;
+    std::vector<queued_event>             held_;      // popped before a throw
+    
+    runtime(const queue_options & qopts)
+    : queue_{event_queue::create(qopts)},
+      limit_{qopts.limit_ ? new queue_limit{qopts} : nullptr},
+      prioritized_{qopts.priorities_ > 1},
+      parker_{nullptr},
+      pool_{nullptr}
+    {
+    }
+    
+    // only a plain unbounded queue can wait for the first event
+    static bool deferrable(const queue_options & qopts)
+    {
+      return (qopts.kind_ == queue_options::locked &&
+              qopts.priorities_ == 1 &&
+              !qopts.limit_);
+    }
+    
+    ~runtime()
+    {
+      delete parker_.load(std::memory_order_relaxed);
+      delete pool_.load(std::memory_order_relaxed);
+    }
+  };
+  
   state_machine::state_machine(const std::string & description,
                                trace_fun trace_cb)
-  : description_{description},
-    trace_{trace_cb}
+  : def_{new machine_definition{description, trace_cb}},
+    rt_{nullptr},
+    executor_{nullptr},
+    id_{next_machine_id.fetch_add(1, std::memory_order_relaxed)},
+    timers_{UINT32_MAX},
+    notifying_{0},
+    state_{0},
+    tracing_{true},
+    collecting_{false},
+    scheduled_{false},
+    timed_{false}
+  {
+  }
+  
+  state_machine::state_machine(const std::string & description,
+                               const queue_options & qopts,
+                               trace_fun trace_cb)
+  : def_{new machine_definition{description, trace_cb}},
+    rt_{runtime::deferrable(qopts) ? nullptr : new runtime{qopts}},
+    executor_{nullptr},
+    id_{next_machine_id.fetch_add(1, std::memory_order_relaxed)},
+    timers_{UINT32_MAX},
+    notifying_{0},
+    state_{0},
+    tracing_{true},
+    collecting_{false},
+    scheduled_{false},
+    timed_{false}
+  {
+  }
+  
+  state_machine::state_machine(machine_definition::sptr def,
+                               const queue_options & qopts)
+  : def_{def},
+    rt_{nullptr},
+    executor_{nullptr},
+    id_{next_machine_id.fetch_add(1, std::memory_order_relaxed)},
+    timers_{UINT32_MAX},
+    notifying_{0},
+    state_{0},
+    tracing_{true},
+    collecting_{false},
+    scheduled_{false},
+    timed_{false}
+  {
+    if( !def_ )
+    {
+      THROW_("invalid machine definition received");
+    }
+    else if( !def_->frozen() )
+    {
+      THROW_("shared machine definitions must be frozen");
+    }
+    
+    if( !runtime::deferrable(qopts) )
+      rt_.store(new runtime{qopts}, std::memory_order_relaxed);
+  }
+  
+  state_machine::runtime &
+  state_machine::rt()
   {
+    runtime * r = rt_.load(std::memory_order_acquire);
+    if( !r )
+    {
+      // producers may race for the first event
+      runtime * fresh = new runtime{queue_options{}};
+      if( rt_.compare_exchange_strong(r, fresh, std::memory_order_acq_rel) )
+        r = fresh;
+      else
+        delete fresh;
+    }
+    return *r;
+  }
+  
+  const state_machine::runtime *
+  state_machine::find_rt() const
+  {
+    return rt_.load(std::memory_order_acquire);
+  }
+  
+  const machine_definition::sptr &
+  state_machine::definition() const
+  {
+    return def_;
+  }
+  
+  uint32_t
+  state_machine::id() const
+  {
+    return id_;
   }
   
   const std::string &
   state_machine::description() const
   {
-    return description_;
+    return def_->description();
+  }
+  
+  const state_machine::trace_fun &
+  state_machine::trace_cb() const
+  {
+    return def_->trace_cb();
+  }
+  
+  void
+  state_machine::tracing(bool on)
+  {
+    tracing_.store(on, std::memory_order_relaxed);
+  }
+  
+  bool
+  state_machine::tracing() const
+  {
+    return tracing_.load(std::memory_order_relaxed);
+  }
+  
+  void
+  state_machine::collect_stats(bool on)
+  {
+    collecting_.store(on, std::memory_order_relaxed);
+  }
+  
+  bool
+  state_machine::collecting_stats() const
+  {
+    return collecting_.load(std::memory_order_relaxed);
+  }
+  
+  state_machine::stats_snapshot
+  state_machine::stats() const
+  {
+    return def_->stats();
   }
   
-  state_machine::trace_fun
-  state_machine::trace_cb()
+  void
+  state_machine::binary_trace(uint32_t capacity)
+  {
+    rt().ring_.reset(new trace_ring{id_, capacity});
+  }
+  
+  void
+  state_machine::dump_binary_trace(std::ostream & os) const
   {
-    return trace_;
+    trace_ring::dump d;
+    d.machine_id_   = id_;
+    d.description_  = def_->description();
+    def_->names()->state_names(d.state_names_);
+    def_->names()->event_names(d.event_names_);
+    const runtime * r = find_rt();
+    if( r && r->ring_ )
+      r->ring_->snapshot(d.records_);
+    trace_ring::write(os, d);
   }
   
   void
   state_machine::add_transition(transition::sptr trans)
   {
-    if( trans )
+    def_->add_transition(trans);
+  }
+  
+  void
+  state_machine::freeze()
+  {
+    def_->freeze();
+  }
+  
+  bool
+  state_machine::frozen() const
+  {
+    return def_->frozen();
+  }
+  
+  void
+  state_machine::on_unhandled(unhandled_policy policy)
+  {
+    def_->on_unhandled(policy);
+  }
+  
+  void
+  state_machine::on_unhandled(transition::sptr fallback)
+  {
+    def_->on_unhandled(fallback);
+  }
+  
+  void
+  state_machine::on_unhandled(unhandled_fun cb)
+  {
+    def_->on_unhandled(cb);
+  }
+  
+  state_machine::unhandled_policy
+  state_machine::unhandled() const
+  {
+    return def_->unhandled();
+  }
+  
+  uint64_t
+  state_machine::unhandled_count(uint16_t state,
+                                 uint16_t event) const
+  {
+    return def_->misses().count(state, event);
+  }
+  
+  uint64_t
+  state_machine::unhandled_count() const
+  {
+    return def_->misses().total();
+  }
+  
+  queued_event
+  state_machine::stamp(uint16_t event) const
+  {
+    return queued_event{event,
+                        collecting_stats() ? latency_histogram::now_ns() : 0};
+  }
+  
+  void
+  state_machine::publish(const queued_event & event)
+  {
+    if( running_machine == this )
     {
-      state_event se{trans->state(), trans->event()};
-      transitions_[se] = trans;
+      running_staged->push_back(event);
     }
     else
     {
-      THROW_("invalid transition received");
+      rt().queue_->push(event);
+      notify();
     }
   }
   
   void
-  state_machine::enqueue(uint16_t event)
+  state_machine::notify()
   {
-    lock lck(event_mtx_);
-    events_.push_back(event);
+    if( executor_.load(std::memory_order_relaxed) )
+    {
+      notify_guard guard{notifying_};
+      executor * ex = executor_.load(std::memory_order_seq_cst);
+      if( ex && !scheduled_.exchange(true, std::memory_order_seq_cst) )
+        ex->schedule(this);
+    }
+    
+    const runtime * r = find_rt();
+    parker * p = (r ? r->parker_.load(std::memory_order_acquire) : nullptr);
+    if( p )
+      p->unpark();
   }
   
   void
-  state_machine::enqueue_if_empty(uint16_t event)
+  state_machine::publish_staged()
   {
-    lock lck(event_mtx_);
-    if( events_.empty() )
-      events_.push_back(event);
+    if( !running_staged->empty() )
+    {
+      // the consumer can't wait for itself to make room
+      rt().queue_->push_nowait(running_staged->data(), running_staged->size());
+      running_staged->clear();
+    }
   }
   
-  void
-  state_machine::enqueue_unique(uint16_t event)
+  enqueue_status
+  state_machine::admit(uint16_t event,
+                       bool may_wait)
   {
-    lock lck(event_mtx_);
-    for( auto const & e : events_ )
+    runtime & r = rt();
+    if( !r.limit_ )
+    {
+      r.queued_.add(event);
+      return enqueued;
+    }
+    
+    if( r.queued_.add_below(event, r.limit_->limit()) )
+      return enqueued;
+    
+    switch( r.limit_->overflow() )
     {
-      if( e == event )
+      case queue_options::block:
+        // the machine can't wait for itself to make room
+        if( running_machine == this )
+        {
+          r.queued_.add(event);
+          return enqueued;
+        }
+        else if( may_wait )
+        {
+          return r.limit_->wait_for_room(r.queued_, event);
+        }
+        break;
+        
+      case queue_options::drop_oldest:
       {
-        return;
+        queued_event oldest;
+        if( r.queue_->drop_oldest(oldest) )
+        {
+          discard(oldest);
+          // the freed place is not reserved, racing producers may
+          // exceed the limit by their number
+          r.queued_.add(event);
+          return enqueued_displacing;
+        }
+        // everything queued was taken by the machine already
+        break;
       }
+        
+      case queue_options::coalesce:
+        if( r.queued_.has(event) )
+          return r.limit_->coalesce();
+        break;
+        
+      default:
+        break;
+    };
+    return r.limit_->reject();
+  }
+  
+  void
+  state_machine::discard(const queued_event & event)
+  {
+    runtime & r = rt();
+    r.queued_.remove(event.event_);
+    if( event.in_block_ )
+      r.pool_.load(std::memory_order_acquire)->release(event.payload_.block_);
+    r.limit_->count_dropped();
+  }
+  
+  enqueue_status
+  state_machine::enqueue(uint16_t event)
+  {
+    // counted before publishing so a pop never sees a zero counter
+    enqueue_status status = admit(event);
+    if( admitted(status) )
+      publish(stamp(event));
+    return status;
+  }
+  
+  enqueue_status
+  state_machine::enqueue(uint16_t event,
+                         event_priority priority)
+  {
+    enqueue_status status = admit(event);
+    if( admitted(status) )
+    {
+      queued_event queued = stamp(event);
+      queued.priority_ = priority;
+      publish(queued);
     }
+    return status;
+  }
+  
+  enqueue_status
+  state_machine::enqueue_fired(uint16_t event,
+                               event_priority priority)
+  {
+    // the timer thread serves every machine, neither the limit nor a
+    // full ring can stop it
+    enqueue_status status = admit(event, false);
+    if( admitted(status) )
+    {
+      queued_event queued = stamp(event);
+      queued.priority_ = priority;
+      rt().queue_->push_nowait(&queued, 1);
+      notify();
+    }
+    return status;
+  }
+  
+  enqueue_status
+  state_machine::enqueue_if_empty(uint16_t event)
+  {
+    if( !rt().queued_.add_if_empty(event) )
+      return skipped;
     
-    events_.push_back(event);
+    publish(stamp(event));
+    return enqueued;
   }
   
-  bool
-  state_machine::queue_has(uint16_t event) const
+  enqueue_status
+  state_machine::enqueue_unique(uint16_t event)
+  {
+    if( !rt().queued_.add_unique(event) )
+      return skipped;
+    
+    publish(stamp(event));
+    return enqueued;
+  }
+  
+  size_t
+  state_machine::enqueue_bulk(const uint16_t * events,
+                              size_t n)
   {
-    lock lck(event_mtx_);
-    for( auto const & e : events_ )
+    runtime & r = rt();
+    if( r.limit_ )
     {
-      if( e == event )
+      // the policy is applied event by event
+      size_t done = 0;
+      for( size_t i=0; i<n; ++i )
       {
-        return true;
+        if( admitted(enqueue(events[i])) )
+          ++done;
       }
+      return done;
+    }
+    
+    if( running_machine == this )
+    {
+      for( size_t i=0; i<n; ++i )
+      {
+        r.queued_.add(events[i]);
+        running_staged->push_back(stamp(events[i]));
+      }
+      return n;
+    }
+    
+    // one push and one notification for the whole range
+    queued_event batch[run_batch_size];
+    queued_event * stamped = batch;
+    if( n > run_batch_size )
+    {
+      bulk_staging.resize(n);
+      stamped = bulk_staging.data();
+    }
+    for( size_t i=0; i<n; ++i )
+    {
+      r.queued_.add(events[i]);
+      stamped[i] = stamp(events[i]);
+    }
+    r.queue_->push_bulk(stamped, n);
+    notify();
+    return n;
+  }
+  
+  size_t
+  state_machine::enqueue_bulk(std::initializer_list<uint16_t> events)
+  {
+    return enqueue_bulk(events.begin(), events.size());
+  }
+  
+  payload_pool &
+  state_machine::pool()
+  {
+    runtime & r = rt();
+    payload_pool * p = r.pool_.load(std::memory_order_acquire);
+    if( !p )
+    {
+      // producers may race for the first payload
+      payload_pool * fresh = new payload_pool;
+      if( r.pool_.compare_exchange_strong(p, fresh, std::memory_order_acq_rel) )
+        p = fresh;
+      else
+        delete fresh;
+    }
+    return *p;
+  }
+  
+  enqueue_status
+  state_machine::enqueue_payload(uint16_t event,
+                                 const void * data,
+                                 uint32_t size)
+  {
+    // the block comes first, a payload that doesn't fit throws before
+    // the event is counted
+    queued_event queued = stamp(event);
+    if( size <= queued_event::inline_size )
+    {
+      ::memcpy(queued.payload_.inline_, data, size);
+    }
+    else
+    {
+      payload_pool::block blk = pool().alloc(size);
+      ::memcpy(blk.data_, data, size);
+      queued.payload_.block_  = blk.index_;
+      queued.in_block_        = true;
+    }
+    queued.payload_size_ = static_cast<uint16_t>(size);
+    
+    enqueue_status status = admit(event);
+    if( !admitted(status) )
+    {
+      if( queued.in_block_ )
+        pool().release(queued.payload_.block_);
+      return status;
+    }
+    publish(queued);
+    return status;
+  }
+  
+  payload_pool::block
+  state_machine::alloc_payload(uint32_t size)
+  {
+    return pool().alloc(size);
+  }
+  
+  enqueue_status
+  state_machine::enqueue(uint16_t event,
+                         const payload_pool::block & blk)
+  {
+    enqueue_status status = admit(event);
+    if( !admitted(status) )
+    {
+      pool().release(blk.index_);
+      return status;
+    }
+    
+    queued_event queued = stamp(event);
+    queued.payload_.block_  = blk.index_;
+    queued.payload_size_    = static_cast<uint16_t>(blk.size_);
+    queued.in_block_        = true;
+    publish(queued);
+    return status;
+  }
+  
+  void
+  state_machine::chain(uint16_t event)
+  {
+    if( running_machine != this )
+    {
+      THROW_("only the actions of a running machine can chain events");
     }
-    return false;
+    running_chain = event;
+  }
+  
+  timer_handle
+  state_machine::enqueue_after(uint16_t event,
+                               const timer_service::clock_type::duration & delay,
+                               event_priority priority)
+  {
+    return enqueue_at(event, timer_service::clock_type::now()+delay, priority);
+  }
+  
+  timer_handle
+  state_machine::enqueue_at(uint16_t event,
+                            const timer_service::clock_type::time_point & when,
+                            event_priority priority)
+  {
+    timed_.store(true, std::memory_order_relaxed);
+    return timer_service::shared().schedule(*this, event, priority, when);
+  }
+  
+  const payload &
+  state_machine::event_payload() const
+  {
+    return (running_machine == this ? *running_payload : no_payload);
+  }
+  
+  bool
+  state_machine::queue_has(uint16_t event) const
+  {
+    const runtime * r = find_rt();
+    return (r && r->queued_.has(event));
   }
   
   uint64_t
   state_machine::queue_size() const
   {
-    uint64_t ret = 0;
+    const runtime * r = find_rt();
+    return (r ? r->queued_.size() : 0);
+  }
+  
+  bool
+  state_machine::runnable() const
+  {
+    const runtime * r = find_rt();
+    if( !r )
+      return false;
+    if( r->suspended_ )
+      return r->suspended_->parked_->ready();
+    return r->queued_.size() > 0;
+  }
+  
+  bool
+  state_machine::suspended() const
+  {
+    const runtime * r = find_rt();
+    return (r && r->suspended_);
+  }
+  
+  bool
+  state_machine::queue_has(uint16_t event,
+                           event_priority priority) const
+  {
+    const runtime * r = find_rt();
+    if( !r )
+      return false;
+    if( r->prioritized_ )
+      return static_cast<const prioritized_queue *>(r->queue_.get())->has(event, priority);
+    else
+      return r->queued_.has(event);
+  }
+  
+  uint64_t
+  state_machine::queue_size(event_priority priority) const
+  {
+    const runtime * r = find_rt();
+    if( !r )
+      return 0;
+    if( r->prioritized_ )
+      return static_cast<const prioritized_queue *>(r->queue_.get())->size(priority);
+    else
+      return r->queued_.size();
+  }
+  
+  state_machine::queue_stats_snapshot
+  state_machine::queue_stats() const
+  {
+    const runtime * r = find_rt();
+    if( r && r->limit_ )
+      return r->limit_->stats(r->queued_);
+    
+    queue_stats_snapshot ret{};
+    if( r )
     {
-      lock lck(event_mtx_);
-      ret = events_.size();
+      ret.size_        = r->queued_.size();
+      ret.high_water_  = r->queued_.high_water();
     }
     return ret;
   }
@@ -95,79 +794,394 @@ namespace virtdb { namespace fsm {
   uint16_t
   state_machine::run(uint16_t initial_state)
   {
-    uint16_t act_state = initial_state;
-    while( true )
+    // a worker may be running the machine, its state can't be touched
+    if( executor_ )
+    {
+      THROW_("state machine is run by an executor");
+    }
+    else if( suspended() )
+    {
+      THROW_("a transition is suspended, the machine can only be resumed");
+    }
+    state_ = initial_state;
+    return resume();
+  }
+  
+  uint16_t
+  state_machine::run_forever(uint16_t initial_state,
+                             stop_token & stop)
+  {
+    if( executor_ )
+    {
+      THROW_("state machine is run by an executor");
+    }
+    else if( suspended() )
+    {
+      THROW_("a transition is suspended, the machine can only be resumed");
+    }
+    
+    // allocated on first use, so machines never run this way don't pay
+    runtime & r = rt();
+    parker * p = r.parker_.load(std::memory_order_acquire);
+    if( !p )
+    {
+      p = new parker;
+      r.parker_.store(p, std::memory_order_release);
+    }
+    
+    stop_guard guard{stop, p};
+    state_ = initial_state;
+    while( !stop.stop_requested() )
+    {
+      // in slices, so a queue that never empties can't hold off the
+      // stop request or the deadline
+      drain(run_batch_size);
+      
+      // an enqueue or a resume after the drain leaves the parker notified
+      if( !runnable() && !stop.stop_requested() )
+        p->park(stop.deadline());
+    }
+    return state_;
+  }
+  
+  size_t
+  state_machine::drain(size_t max_events)
+  {
+    // nothing was ever queued
+    runtime * r = rt_.load(std::memory_order_acquire);
+    if( !r )
+      return 0;
+    
+    size_t done = 0;
+    queued_event batch[run_batch_size];
+    running_guard guard{this};
+    const trace_fun & trace = (tracing() ? def_->trace_cb() : no_trace);
+    bool measure = collecting_stats();
+    
+    if( r->suspended_ )
+    {
+      if( !r->suspended_->parked_->ready() )
+        return 0;
+      resume_suspended(trace, measure);
+      ++done;
+    }
+    
+    // popped with an event that threw, they go before anything queued
+    if( !r->suspended_ && !r->held_.empty() )
+    {
+      std::vector<queued_event> held;
+      held.swap(r->held_);
+      run_batch(held.data(), held.size(), trace, measure);
+      done += held.size();
+    }
+    
+    while( done < max_events && !r->suspended_ )
+    {
+      size_t want = max_events-done < run_batch_size ? max_events-done : run_batch_size;
+      size_t n = r->queue_->pop_bulk(batch, want);
+      if( n == 0 )
+        break;
+      run_batch(batch, n, trace, measure);
+      done += n;
+    }
+    return done;
+  }
+  
+  void
+  state_machine::run_batch(const queued_event * events,
+                           size_t n,
+                           const trace_fun & trace,
+                           bool measure)
+  {
+    for( size_t i=0; i<n; ++i )
     {
-      uint16_t act_event = 0;
+      uint16_t act_state = state_;
+      try
       {
-        lock lck(event_mtx_);
-        if( events_.empty() )
-          break;
-        
-        act_event = events_.front();
-        events_.pop_front();
+        act_state = dispatch(act_state, events[i], trace, measure);
+      }
+      catch (...)
+      {
+        // a throwing unhandled callback, keep what its actions queued
+        // and the events popped after it, they are counted still
+        publish_staged();
+        rt().held_.assign(events+i+1, events+n);
+        throw;
       }
+      state_ = act_state;
+      publish_staged();
       
-      state_event se{act_state, act_event};
+      runtime & r = rt();
+      if( r.suspended_ )
+      {
+        // popped already, they follow the suspended transition
+        r.suspended_->held_.assign(events+i+1, events+n);
+        return;
+      }
+    }
+  }
+  
+  void
+  state_machine::resume_suspended(const trace_fun & trace,
+                                  bool measure)
+  {
+    runtime & r = rt();
+    std::unique_ptr<suspension> susp{std::move(r.suspended_)};
+    if( susp->parked_->has_deadline() )
+      susp->wake_.cancel();
+    
+    uint16_t act_state = susp->state_;
+    try
+    {
+      transition::outcome out;
+      running_chain = susp->chain_;
+      uint16_t next_state = susp->parked_->trans().resume(*susp->parked_,
+                                                          *this,
+                                                          trace,
+                                                          &out,
+                                                          measure);
+      act_state = settle(act_state, susp->event_, out, next_state);
       
-      auto it = transitions_.find(se);
-      if( it != transitions_.end() )
+      while( !r.suspended_ && running_chain != no_chain )
+      {
+        uint16_t act_event = static_cast<uint16_t>(running_chain);
+        running_chain = no_chain;
+        act_state = step(act_state, act_event, trace, measure);
+      }
+    }
+    catch (...)
+    {
+      // the events held behind the transition are counted still
+      publish_staged();
+      if( r.suspended_ )
+        r.suspended_->held_.swap(susp->held_);
+      else
+        r.held_.swap(susp->held_);
+      throw;
+    }
+    state_ = act_state;
+    publish_staged();
+    
+    if( r.suspended_ )
+      r.suspended_->held_.swap(susp->held_);
+    else if( !susp->held_.empty() )
+      run_batch(susp->held_.data(), susp->held_.size(), trace, measure);
+  }
+  
+  uint16_t
+  state_machine::state() const
+  {
+    return state_;
+  }
+  
+  uint16_t
+  state_machine::resume()
+  {
+    if( executor_ )
+    {
+      THROW_("state machine is run by an executor");
+    }
+    drain(SIZE_MAX);
+    return state_;
+  }
+  
+  uint16_t
+  state_machine::dispatch(uint16_t act_state,
+                          const queued_event & queued,
+                          const trace_fun & trace,
+                          bool measure)
+  {
+    runtime & r = rt();
+    uint16_t act_event = queued.event_;
+    r.queued_.remove(act_event);
+    if( r.prioritized_ )
+      static_cast<prioritized_queue *>(r.queue_.get())->dispatched(queued);
+    if( r.limit_ )
+      r.limit_->room_made();
+    
+    payload pl;
+    block_guard blk{nullptr, 0};
+    if( queued.payload_size_ )
+    {
+      if( queued.in_block_ )
       {
-        act_state = (it->second)->execute(*this, trace_);
+        blk.pool_   = r.pool_.load(std::memory_order_relaxed);
+        blk.index_  = queued.payload_.block_;
+        pl = payload{blk.pool_->data(blk.index_), queued.payload_size_};
       }
       else
       {
+        pl = payload{queued.payload_.inline_, queued.payload_size_};
+      }
+      running_payload = &pl;
+    }
+    else
+    {
+      running_payload = &no_payload;
+    }
+    
+    if( measure && queued.enqueued_ns_ )
+      def_->queue_wait().record(latency_histogram::now_ns()-queued.enqueued_ns_);
+    
+    act_state = step(act_state, act_event, trace, measure);
+    running_payload = &no_payload;
+    
+    // chained events run before anything queued, without payload
+    while( !r.suspended_ && running_chain != no_chain )
+    {
+      act_event = static_cast<uint16_t>(running_chain);
+      running_chain = no_chain;
+      act_state = step(act_state, act_event, trace, measure);
+    }
+    return act_state;
+  }
+  
+  uint16_t
+  state_machine::step(uint16_t act_state,
+                      uint16_t act_event,
+                      const trace_fun & trace,
+                      bool measure)
+  {
+    transition * trans = def_->find(act_state, act_event);
+    if( trans )
+    {
+      transition::outcome out;
+      uint16_t next_state = trans->execute(*this, trace, &out, measure);
+      return settle(act_state, act_event, out, next_state);
+    }
+    
+    uint16_t next_state = dispatch_unhandled(act_state, act_event, trace, measure);
+    runtime & r = rt();
+    if( r.ring_ )
+      r.ring_->add(act_state, act_event, 0, trace_ring::unhandled, next_state);
+    return next_state;
+  }
+  
+  uint16_t
+  state_machine::settle(uint16_t act_state,
+                        uint16_t act_event,
+                        transition::outcome & out,
+                        uint16_t next_state)
+  {
+    runtime & r = rt();
+    if( r.ring_ )
+    {
+      // transition::outcome values match the first trace_ring ones
+      r.ring_->add(act_state,
+                 act_event,
+                 out.seqno_,
+                 (out.result_ == transition::outcome::suspended ?
+                  trace_ring::suspended :
+                  static_cast<trace_ring::result_type>(out.result_)),
+                 next_state);
+    }
+    
+    if( out.parked_ )
+    {
+      r.suspended_.reset(new suspension);
+      r.suspended_->parked_  = std::move(out.parked_);
+      r.suspended_->state_   = act_state;
+      r.suspended_->event_   = act_event;
+      r.suspended_->chain_   = running_chain;
+      running_chain = no_chain;
+      
+      if( r.suspended_->parked_->has_deadline() )
+      {
+        timed_.store(true, std::memory_order_relaxed);
+        r.suspended_->wake_ = timer_service::shared().wake_at(*this, r.suspended_->parked_->deadline());
+      }
+      return act_state;
+    }
+    return next_state;
+  }
+
+  uint16_t
+  state_machine::dispatch_unhandled(uint16_t act_state,
+                                    uint16_t act_event,
+                                    const trace_fun & trace,
+                                    bool measure)
+  {
+    unhandled_policy policy = def_->unhandled();
+    if( policy == machine_definition::ignore_unhandled )
+      return act_state;
+    
+    def_->misses().add(act_state, act_event);
+    switch( policy )
+    {
+      case machine_definition::fallback_unhandled:
+        return def_->fallback()->execute(*this, trace, nullptr, measure);
+        
+      case machine_definition::callback_unhandled:
+        def_->unhandled_cb()(act_state, act_event, *this);
+        break;
+        
+      case machine_definition::trace_unhandled:
         // no such transitions
-        if( trace_ )
+        if( FSM_TRACE_ON_(trace) )
         {
           std::ostringstream os;
           os << "NO SUCH TRANSITION: [" << state_name(act_state) << " + " << event_name(act_event) << ']';
           transition tr{act_state, act_event, 0, os.str()};
-          trace_(0,"<NO ACTION>",tr,*this);
+          trace(0,"<NO ACTION>",tr,*this);
         }
-      }
-    }
+        break;
+        
+      default:
+        break;
+    };
     return act_state;
   }
-
-  state_machine::~state_machine() {}
+  
+  state_machine::~state_machine()
+  {
+    // a late resume() must not reach the machine
+    runtime * r = rt_.load(std::memory_order_relaxed);
+    if( r )
+      r->suspended_.reset();
+    
+    // a timer may be firing even when none is pending anymore
+    if( timed_.load(std::memory_order_relaxed) )
+      timer_service::shared().cancel_all(*this);
+    
+    delete r;
+  }
+  
+  void
+  state_machine::names(name_registry::sptr registry)
+  {
+    def_->names(registry);
+  }
+  
+  const name_registry::sptr &
+  state_machine::names() const
+  {
+    return def_->names();
+  }
   
   void
   state_machine::state_name(uint16_t st,
                             const std::string & name)
   {
-    lock lck(state_name_mtx_);
-    state_names_[st] = name;
+    def_->names()->state_name(st, name);
   }
   
-  std::string
+  const std::string &
   state_machine::state_name(uint16_t st) const
   {
-    lock lck(state_name_mtx_);
-    auto it = state_names_.find(st);
-    if( it != state_names_.end() )
-      return it->second;
-    else
-      return std::to_string(st);
+    return def_->state_name(st);
   }
 
   void
   state_machine::event_name(uint16_t ev,
                             const std::string & name)
   {
-    lock lck(event_name_mtx_);
-    event_names_[ev] = name;
+    def_->names()->event_name(ev, name);
   }
   
-  std::string
+  const std::string &
   state_machine::event_name(uint16_t ev) const
   {
-    lock lck(event_name_mtx_);
-    auto it = event_names_.find(ev);
-    if( it != event_names_.end() )
-      return it->second;
-    else
-      return std::to_string(ev);
+    return def_->event_name(ev);
   }
   
 }}
@@ -1,35 +1,63 @@
 #pragma once
 
-#include <fsm/transition.hh>
+#include <fsm/machine_definition.hh>
+#include <fsm/event_queue.hh>
+#include <fsm/event_counter.hh>
+#include <fsm/queue_limit.hh>
+#include <fsm/trace_ring.hh>
+#include <fsm/parker.hh>
+#include <fsm/payload.hh>
+#include <fsm/payload_pool.hh>
+#include <fsm/stop_token.hh>
+#include <fsm/timer_service.hh>
 #include <memory>
 #include <string>
-#include <functional>
-#include <map>
-#include <list>
-#include <mutex>
+#include <vector>
+#include <type_traits>
+#include <atomic>
+#include <initializer_list>
 
 namespace virtdb { namespace fsm {
   
+  class executor;
+  
+  // one running machine: the current state, the queued events and the
+  // optional binary trace. everything else is in the definition, which
+  // may be private to the machine or shared by many of them.
   class state_machine
   {
+    friend class executor;
+    friend class timer_service;
+    friend class continuation;
+    
   public:
-    typedef transition::trace_fun      trace_fun;
+    typedef machine_definition::trace_fun         trace_fun;
+    typedef machine_definition::unhandled_fun     unhandled_fun;
+    typedef machine_definition::unhandled_policy  unhandled_policy;
+    typedef machine_definition::stats_snapshot    stats_snapshot;
+    typedef queue_limit::stats_snapshot           queue_stats_snapshot;
         
   private:
-    typedef std::pair<uint16_t, uint16_t>            state_event;
-    typedef std::map<state_event,transition::sptr>   trans_map;
-    typedef std::unique_lock<std::mutex>             lock;
-    typedef std::map<uint16_t, std::string>          name_map;
-    
-    std::string           description_;
-    trace_fun             trace_;
-    trans_map             transitions_;
-    std::list<uint16_t>   events_;
-    mutable std::mutex    event_mtx_;
-    name_map              state_names_;
-    mutable std::mutex    state_name_mtx_;
-    name_map              event_names_;
-    mutable std::mutex    event_name_mtx_;
+    // the queue and whatever else a machine needs once events arrive.
+    // created by the first event, or by the constructor for queue
+    // options other than the defaults, so an idle machine is a few words.
+    struct runtime;
+    
+    // a transition parked by an action and what the machine needs to
+    // go on with it
+    struct suspension;
+    
+    machine_definition::sptr   def_;
+    std::atomic<runtime *>     rt_;
+    std::atomic<executor *>    executor_;
+    uint32_t                   id_;
+    uint32_t                   timers_;     // owned by the timer_service
+    std::atomic<uint32_t>      notifying_;  // notifies using executor_
+    uint16_t                   state_;
+    std::atomic<bool>          tracing_;
+    std::atomic<bool>          collecting_;
+    std::atomic<bool>          scheduled_;
+    std::atomic<bool>          timed_;      // ever had a delayed event
     
     // disable default construction
     state_machine() = delete;
@@ -38,33 +66,227 @@ namespace virtdb { namespace fsm {
     state_machine(const state_machine &) = delete;
     state_machine & operator=(const state_machine &) = delete;
     
+    // runs at most max_events from the current state
+    size_t drain(size_t max_events);
+    
+    // lets the executor or the parked run_forever() know about new events
+    // or a suspended transition that can go on
+    void notify();
+    
+    // has queued events, or a suspended transition that can go on
+    bool runnable() const;
+    
+    runtime & rt();
+    const runtime * find_rt() const;
+    
+    payload_pool & pool();
+    enqueue_status enqueue_payload(uint16_t event, const void * data, uint32_t size);
+    
+    // counts the event as queued or applies the overflow policy. a
+    // producer that may not wait gets the block policy as a reject.
+    enqueue_status admit(uint16_t event, bool may_wait=true);
+    void discard(const queued_event & event);
+    
+    // a delayed event of the timer_service, which never waits for room
+    // in the queue or the queue limit
+    enqueue_status enqueue_fired(uint16_t event, event_priority priority);
+    
+    void publish(const queued_event & event);
+    queued_event stamp(uint16_t event) const;
+    void publish_staged();
+    void run_batch(const queued_event * events,
+                   size_t n,
+                   const trace_fun & trace,
+                   bool measure);
+    void resume_suspended(const trace_fun & trace,
+                          bool measure);
+    uint16_t settle(uint16_t act_state,
+                    uint16_t act_event,
+                    transition::outcome & out,
+                    uint16_t next_state);
+    uint16_t dispatch(uint16_t state,
+                      const queued_event & event,
+                      const trace_fun & trace,
+                      bool measure);
+    uint16_t step(uint16_t state,
+                  uint16_t event,
+                  const trace_fun & trace,
+                  bool measure);
+    uint16_t dispatch_unhandled(uint16_t state,
+                                uint16_t event,
+                                const trace_fun & trace,
+                                bool measure);
+    
   public:
     typedef std::shared_ptr<state_machine> sptr;
     
+    // no trace callback means no tracing cost at all
     state_machine(const std::string & description,
-                  trace_fun trace_cb=[](uint16_t seqno,
-                                        const std::string & desc,
-                                        const transition & trans,
-                                        const state_machine & sm){});
+                  trace_fun trace_cb=trace_fun{});
+    
+    state_machine(const std::string & description,
+                  const queue_options & qopts,
+                  trace_fun trace_cb=trace_fun{});
+    
+    // a machine of a shared definition, which must be frozen already.
+    // the definition can't be changed through the machine.
+    state_machine(machine_definition::sptr def,
+                  const queue_options & qopts=queue_options{});
     
+    const machine_definition::sptr & definition() const;
+    
+    uint32_t id() const;
     const std::string & description() const;
-    trace_fun trace_cb();
+    const trace_fun & trace_cb() const;
+    
+    // runtime switch for the trace callback, on by default
+    void tracing(bool on);
+    bool tracing() const;
+    
+    // records every dispatched event into a binary ring of the given
+    // size. must be enabled before run() is called.
+    void binary_trace(uint32_t capacity);
+    
+    // writes the ring together with the registered names in the format
+    // read by trace_ring::read() and the fsm_trace_decode tool
+    void dump_binary_trace(std::ostream & os) const;
     
+    // per transition counters, latencies and step times, plus the time
+    // events spent in the queue. off by default, as it reads the clock
+    // around every step.
+    void collect_stats(bool on);
+    bool collecting_stats() const;
+    stats_snapshot stats() const;
+    
+    // these forward to the definition
     void add_transition(transition::sptr trans);
-    void enqueue(uint16_t event);
-    void enqueue_unique(uint16_t event);
-    void enqueue_if_empty(uint16_t event);
+    void freeze();
+    bool frozen() const;
+    void on_unhandled(unhandled_policy policy);
+    void on_unhandled(transition::sptr fallback);
+    void on_unhandled(unhandled_fun cb);
+    unhandled_policy unhandled() const;
+    uint64_t unhandled_count(uint16_t state, uint16_t event) const;
+    uint64_t unhandled_count() const;
+    
+    // a machine with a limit (queue_options::limit_) applies its
+    // overflow policy once it is full. the block policy never blocks the
+    // thread running the machine, its actions may exceed the limit. a
+    // blocked executor thread can't run machines, so block timeouts of
+    // executor machines should be short.
+    enqueue_status enqueue(uint16_t event);
+    
+    // goes into the class of the priority when the queue was created
+    // with more than one (queue_options::priorities_). with a single
+    // class every priority is the same.
+    enqueue_status enqueue(uint16_t event, event_priority priority);
+    
+    // these add at most one instance per event, they are not limited
+    enqueue_status enqueue_unique(uint16_t event);
+    enqueue_status enqueue_if_empty(uint16_t event);
+    
+    // returns the number of events admitted. without a queue limit the
+    // events are published with one push and one notification, with
+    // one they are admitted and published one by one.
+    size_t enqueue_bulk(const uint16_t * events, size_t n);
+    size_t enqueue_bulk(std::initializer_list<uint16_t> events);
+    
+    // events with a payload. small values are copied into the event,
+    // larger ones into a pool block. the transition reads them through
+    // event_payload().
+    template <typename T>
+    enqueue_status enqueue(uint16_t event, const T & value)
+    {
+      static_assert(std::is_trivially_copyable<T>::value,
+                    "payloads must be trivially copyable");
+      static_assert(alignof(T) <= alignof(uint64_t),
+                    "over-aligned payloads are not supported");
+      static_assert(sizeof(T) <= payload_pool::block_size,
+                    "payloads must fit into a payload_pool block");
+      return enqueue_payload(event, &value, sizeof(T));
+    }
+    
+    // zero copy: fill the block in place, then enqueue it. the block
+    // is released after the transition that received it finished, or
+    // right away when the event is not admitted.
+    payload_pool::block alloc_payload(uint32_t size);
+    enqueue_status enqueue(uint16_t event, const payload_pool::block & blk);
+    
+    // the payload of the event being dispatched, valid in the actions,
+    // loops and timers of the transition only
+    const payload & event_payload() const;
+    
+    // names the event that follows the transition being executed. it is
+    // dispatched right after that transition returns, before any event
+    // the transition enqueued and anything else in the queue. it never
+    // touches the queue, so it is not seen by queue_has(), the queue
+    // limit or the queue statistics. chaining again in the same
+    // transition replaces the event. only valid in the actions of the
+    // running machine. a chain that never ends starves the queue.
+    void chain(uint16_t event);
+    
+    // delayed events of the shared timer_service. they are enqueued
+    // when they fire, so the overflow policy applies then, except that
+    // the timer thread never blocks: a fired event that finds the queue
+    // at its limit with the block policy is rejected. a full lock_free
+    // ring doesn't reject it, the event waits aside for room. pending
+    // events of a destroyed machine are cancelled.
+    timer_handle enqueue_after(uint16_t event,
+                               const timer_service::clock_type::duration & delay,
+                               event_priority priority=normal_priority);
+    timer_handle enqueue_at(uint16_t event,
+                            const timer_service::clock_type::time_point & when,
+                            event_priority priority=normal_priority);
+    
+    // not allowed once the machine is added to an executor, nor while a
+    // transition is suspended
     uint16_t run(uint16_t initial_state=0);
+    
+    // runs until the token is stopped, parking while the queue is empty.
+    // enqueues wake the machine only when it is parked. a deadline of the
+    // token bounds the park time. the token is checked between batches,
+    // so it stops a machine that never runs out of events too. not
+    // allowed on executor machines.
+    uint16_t run_forever(uint16_t initial_state,
+                         stop_token & stop);
+    
+    // the state the last run() ended in, and running on from there
+    uint16_t state() const;
+    uint16_t resume();
+    
+    // an action suspended its transition (see transition::suspend()).
+    // the machine dispatches nothing else until it goes on: run() and
+    // resume() return right away, run_forever() and executors release
+    // the thread until the continuation is resumed or the deadline timer
+    // of the transition expired. the state stays the one the transition
+    // started from. the payload of the event is gone once suspended.
+    // only the transitions found for an event can suspend, not fallbacks.
+    bool suspended() const;
+    
     bool queue_has(uint16_t event) const;
     uint64_t queue_size() const;
     
+    // the same for one priority class only
+    bool queue_has(uint16_t event, event_priority priority) const;
+    uint64_t queue_size(event_priority priority) const;
+    
+    // the high water mark is kept for every machine, the limit and the
+    // overflow counters are zero for unbounded ones
+    queue_stats_snapshot queue_stats() const;
+    
+    void names(name_registry::sptr registry);
+    const name_registry::sptr & names() const;
+    
+    // lookups are lock free and the returned names stay valid
     void state_name(uint16_t st, const std::string & name);
-    std::string state_name(uint16_t st) const;
+    const std::string & state_name(uint16_t st) const;
 
     void event_name(uint16_t ev, const std::string & name);
-    std::string event_name(uint16_t ev) const;
+    const std::string & event_name(uint16_t ev) const;
     
     virtual ~state_machine();
   };
   
+  typedef state_machine machine_instance;
+  
 }}
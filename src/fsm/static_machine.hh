@@ -0,0 +1,363 @@
+#pragma once
+
+#include <fsm/event_queue.hh>
+#include <fsm/event_counter.hh>
+#include <fsm/queue_limit.hh>
+#include <fsm/exception.hh>
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <vector>
+
+namespace virtdb { namespace fsm {
+  
+  // a transition of a static_machine: in STATE, EVENT runs ACTION and
+  // moves to NEXT. actions are default constructed function objects
+  // taking the machine, usually through a template call operator:
+  //
+  //   struct send_ack {
+  //     template <typename M> void operator()(M & sm) const { ... }
+  //   };
+  struct no_action
+  {
+    template <typename MACHINE>
+    void operator()(MACHINE &) const {}
+  };
+  
+  template <uint16_t STATE,
+            uint16_t EVENT,
+            uint16_t NEXT,
+            typename ACTION=no_action>
+  struct row
+  {
+    static const uint16_t state  = STATE;
+    static const uint16_t event  = EVENT;
+    static const uint16_t next   = NEXT;
+    typedef ACTION action_type;
+  };
+  
+  template <uint16_t STATE, uint16_t EVENT, uint16_t NEXT, typename ACTION>
+  const uint16_t row<STATE, EVENT, NEXT, ACTION>::state;
+  template <uint16_t STATE, uint16_t EVENT, uint16_t NEXT, typename ACTION>
+  const uint16_t row<STATE, EVENT, NEXT, ACTION>::event;
+  template <uint16_t STATE, uint16_t EVENT, uint16_t NEXT, typename ACTION>
+  const uint16_t row<STATE, EVENT, NEXT, ACTION>::next;
+  
+  struct no_context {};
+  
+  namespace detail
+  {
+    template <size_t... I> struct indices {};
+    
+    // log depth, so large tables don't hit the instantiation limit
+    template <typename A, typename B> struct join;
+    template <size_t... A, size_t... B>
+    struct join<indices<A...>, indices<B...>>
+    {
+      typedef indices<A..., (sizeof...(A)+B)...> type;
+    };
+    
+    template <size_t N>
+    struct make_indices
+    {
+      typedef typename join<typename make_indices<N/2>::type,
+                            typename make_indices<N-N/2>::type>::type type;
+    };
+    template <> struct make_indices<0> { typedef indices<> type; };
+    template <> struct make_indices<1> { typedef indices<0> type; };
+    
+    constexpr size_t max_of(size_t a, size_t b) { return a > b ? a : b; }
+    
+    template <typename... ROWS> struct rows;
+    
+    template <>
+    struct rows<>
+    {
+      static constexpr size_t max_state() { return 0; }
+      static constexpr size_t max_event() { return 0; }
+      static constexpr size_t count(uint16_t, uint16_t) { return 0; }
+      static constexpr bool unique() { return true; }
+    };
+    
+    template <typename ROW, typename... REST>
+    struct rows<ROW, REST...>
+    {
+      typedef rows<REST...> rest;
+      
+      static constexpr size_t max_state() { return max_of(ROW::state, rest::max_state()); }
+      static constexpr size_t max_event() { return max_of(ROW::event, rest::max_event()); }
+      
+      static constexpr size_t count(uint16_t state, uint16_t event)
+      {
+        return (ROW::state == state && ROW::event == event ? 1 : 0) + rest::count(state, event);
+      }
+      
+      static constexpr bool unique()
+      {
+        return rest::count(ROW::state, ROW::event) == 0 && rest::unique();
+      }
+    };
+    
+    // the handler of the row for (state, event), or the miss handler
+    template <typename MACHINE, typename... ROWS> struct find;
+    
+    template <typename MACHINE>
+    struct find<MACHINE>
+    {
+      static constexpr typename MACHINE::handler at(uint16_t, uint16_t)
+      {
+        return &MACHINE::miss;
+      }
+    };
+    
+    template <typename MACHINE, typename ROW, typename... REST>
+    struct find<MACHINE, ROW, REST...>
+    {
+      static constexpr typename MACHINE::handler at(uint16_t state, uint16_t event)
+      {
+        return (ROW::state == state && ROW::event == event ?
+                &MACHINE::template run_row<ROW> :
+                find<MACHINE, REST...>::at(state, event));
+      }
+    };
+  }
+  
+  // a state machine whose transitions are fixed at compile time. the
+  // rows become a constexpr table of handlers indexed by state and
+  // event, one indirect call per event, and every action is inlined
+  // into the handler of its row. enqueue(), chain() and run() behave
+  // like the ones of state_machine, events go through the same queues.
+  // bounded queues, priorities, payloads, timers and tracing are left
+  // to state_machine. unhandled events are counted and ignored. an
+  // exception thrown by an action leaves run(), the machine stays in
+  // the state that transition started from and the events popped with
+  // it go first in the next run(). CONTEXT is kept in the machine for
+  // the actions.
+  template <typename CONTEXT, typename... ROWS>
+  class static_machine
+  {
+    typedef detail::rows<ROWS...> table_rows;
+    
+    static_assert(sizeof...(ROWS) > 0, "a static machine needs transitions");
+    static_assert(table_rows::unique(), "duplicate (state, event) rows");
+    
+  public:
+    typedef uint16_t (*handler)(static_machine & sm, uint16_t state);
+    
+    static const size_t n_states  = table_rows::max_state()+1;
+    static const size_t n_events  = table_rows::max_event()+1;
+    
+    static_assert(n_states*n_events <= 65536,
+                  "state and event ids are too sparse for a dense table");
+    
+    template <typename ROW>
+    static uint16_t run_row(static_machine & sm, uint16_t)
+    {
+      typename ROW::action_type{}(sm);
+      return ROW::next;
+    }
+    
+    static uint16_t miss(static_machine & sm, uint16_t state)
+    {
+      ++sm.unhandled_;
+      return state;
+    }
+    
+  private:
+    enum { run_batch_size = 64, no_chain = 0x10000 };
+    
+    template <size_t... I>
+    struct table_of
+    {
+      static constexpr handler entries_[sizeof...(I)] = {
+        detail::find<static_machine, ROWS...>::at(uint16_t(I / n_events),
+                                                  uint16_t(I % n_events))...
+      };
+    };
+    
+    template <size_t... I>
+    static table_of<I...> make_table(detail::indices<I...>);
+    
+    typedef decltype(make_table(typename detail::make_indices<n_states*n_events>::type{})) table;
+    
+    CONTEXT                     context_;
+    uint16_t                    state_;
+    uint32_t                    chained_;
+    uint64_t                    unhandled_;
+    event_queue::uptr           queue_;
+    event_counter               queued_;
+    std::vector<queued_event>   held_;    // popped before an action threw
+    
+    // the machine whose run() is executing on this thread
+    static static_machine *& running_machine()
+    {
+      static thread_local static_machine * running = nullptr;
+      return running;
+    }
+    
+    void publish(const queued_event * events, size_t n)
+    {
+      // the running machine can't wait for itself to make room
+      if( running_machine() == this )
+        queue_->push_nowait(events, n);
+      else
+        queue_->push_bulk(events, n);
+    }
+    
+    uint16_t step(uint16_t state, uint16_t event)
+    {
+      if( state >= n_states || event >= n_events )
+        return miss(*this, state);
+      return table::entries_[state*n_events + event](*this, state);
+    }
+    
+    // disable copying until properly implemented
+    static_machine(const static_machine &) = delete;
+    static_machine & operator=(const static_machine &) = delete;
+    
+  public:
+    static_machine(const queue_options & qopts=queue_options{})
+    : context_{},
+      state_{0},
+      chained_{no_chain},
+      unhandled_{0},
+      queue_{event_queue::create(qopts)}
+    {
+      if( qopts.priorities_ > 1 || qopts.limit_ )
+      {
+        THROW_("static machines have no priorities or queue limits");
+      }
+    }
+    
+    CONTEXT & context() { return context_; }
+    const CONTEXT & context() const { return context_; }
+    
+    enqueue_status enqueue(uint16_t event)
+    {
+      // counted before publishing so a pop never sees a zero counter
+      queued_.add(event);
+      queued_event queued{event, 0};
+      publish(&queued, 1);
+      return enqueued;
+    }
+    
+    enqueue_status enqueue_unique(uint16_t event)
+    {
+      if( !queued_.add_unique(event) )
+        return skipped;
+      queued_event queued{event, 0};
+      publish(&queued, 1);
+      return enqueued;
+    }
+    
+    enqueue_status enqueue_if_empty(uint16_t event)
+    {
+      if( !queued_.add_if_empty(event) )
+        return skipped;
+      queued_event queued{event, 0};
+      publish(&queued, 1);
+      return enqueued;
+    }
+    
+    size_t enqueue_bulk(const uint16_t * events, size_t n)
+    {
+      queued_event batch[run_batch_size];
+      size_t done = n;
+      while( n > 0 )
+      {
+        size_t chunk = n < run_batch_size ? n : size_t(run_batch_size);
+        for( size_t i=0; i<chunk; ++i )
+        {
+          queued_.add(events[i]);
+          batch[i] = queued_event{events[i], 0};
+        }
+        publish(batch, chunk);
+        events += chunk;
+        n -= chunk;
+      }
+      return done;
+    }
+    
+    size_t enqueue_bulk(std::initializer_list<uint16_t> events)
+    {
+      return enqueue_bulk(events.begin(), events.size());
+    }
+    
+    // the event after the running transition, before anything queued
+    void chain(uint16_t event)
+    {
+      if( running_machine() != this )
+      {
+        THROW_("only the actions of a running machine can chain events");
+      }
+      chained_ = event;
+    }
+    
+    uint16_t run(uint16_t initial_state=0)
+    {
+      struct running_guard
+      {
+        static_machine & sm_;
+        static_machine * prev_;
+        running_guard(static_machine & sm) : sm_(sm), prev_{running_machine()} { running_machine() = &sm_; }
+        ~running_guard() { running_machine() = prev_; sm_.chained_ = no_chain; }
+      } guard{*this};
+      
+      state_ = initial_state;
+      queued_event batch[run_batch_size];
+      size_t n = held_.size();
+      std::copy(held_.begin(), held_.end(), batch);
+      held_.clear();
+      if( n == 0 )
+        n = queue_->pop_bulk(batch, run_batch_size);
+      
+      while( n > 0 )
+      {
+        size_t i = 0;
+        try
+        {
+          for( ; i<n; ++i )
+          {
+            uint16_t event = batch[i].event_;
+            queued_.remove(event);
+            state_ = step(state_, event);
+            while( chained_ != no_chain )
+            {
+              event = static_cast<uint16_t>(chained_);
+              chained_ = no_chain;
+              state_ = step(state_, event);
+            }
+          }
+        }
+        catch (...)
+        {
+          // still counted, they are not lost
+          held_.assign(batch+i+1, batch+n);
+          throw;
+        }
+        n = queue_->pop_bulk(batch, run_batch_size);
+      }
+      return state_;
+    }
+    
+    uint16_t resume() { return run(state_); }
+    uint16_t state() const { return state_; }
+    
+    bool queue_has(uint16_t event) const { return queued_.has(event); }
+    uint64_t queue_size() const { return queued_.size(); }
+    uint64_t unhandled_count() const { return unhandled_; }
+    
+    virtual ~static_machine() {}
+  };
+  
+  template <typename CONTEXT, typename... ROWS>
+  const size_t static_machine<CONTEXT, ROWS...>::n_states;
+  template <typename CONTEXT, typename... ROWS>
+  const size_t static_machine<CONTEXT, ROWS...>::n_events;
+  
+  template <typename CONTEXT, typename... ROWS>
+  template <size_t... I>
+  constexpr typename static_machine<CONTEXT, ROWS...>::handler
+  static_machine<CONTEXT, ROWS...>::table_of<I...>::entries_[sizeof...(I)];
+  
+}}
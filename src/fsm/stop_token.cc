@@ -0,0 +1,57 @@
+#include <fsm/stop_token.hh>
+#include <algorithm>
+
+namespace virtdb { namespace fsm {
+  
+  stop_token::stop_token()
+  : stopped_{false},
+    deadline_{parker::clock_type::time_point::max()}
+  {
+  }
+  
+  stop_token::stop_token(const parker::clock_type::time_point & deadline)
+  : stopped_{false},
+    deadline_{deadline}
+  {
+  }
+  
+  void
+  stop_token::attach(parker * p)
+  {
+    lock lck(mtx_);
+    parkers_.push_back(p);
+  }
+  
+  void
+  stop_token::detach(parker * p)
+  {
+    lock lck(mtx_);
+    parkers_.erase(std::remove(parkers_.begin(), parkers_.end(), p), parkers_.end());
+  }
+  
+  void
+  stop_token::request_stop()
+  {
+    lock lck(mtx_);
+    stopped_.store(true, std::memory_order_release);
+    for( auto p : parkers_ )
+      p->unpark();
+  }
+  
+  bool
+  stop_token::stop_requested() const
+  {
+    return stopped_.load(std::memory_order_acquire) ||
+           (deadline_ != parker::clock_type::time_point::max() &&
+            parker::clock_type::now() >= deadline_);
+  }
+  
+  const parker::clock_type::time_point &
+  stop_token::deadline() const
+  {
+    return deadline_;
+  }
+  
+  stop_token::~stop_token() {}
+  
+}}
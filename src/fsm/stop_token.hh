@@ -0,0 +1,41 @@
+#pragma once
+
+#include <fsm/parker.hh>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace virtdb { namespace fsm {
+  
+  // tells state_machine::run_forever() to return. request_stop() wakes
+  // every machine parked on the token, an optional deadline stops them
+  // without anyone calling it. one token can stop any number of machines.
+  class stop_token
+  {
+    typedef std::unique_lock<std::mutex> lock;
+    
+    std::atomic<bool>                stopped_;
+    parker::clock_type::time_point   deadline_;
+    std::mutex                       mtx_;
+    std::vector<parker *>            parkers_;
+    
+    // disable copying until properly implemented
+    stop_token(const stop_token &) = delete;
+    stop_token & operator=(const stop_token &) = delete;
+    
+  public:
+    stop_token();
+    stop_token(const parker::clock_type::time_point & deadline);
+    
+    // parkers to wake on request_stop()
+    void attach(parker * p);
+    void detach(parker * p);
+    
+    void request_stop();
+    bool stop_requested() const;
+    const parker::clock_type::time_point & deadline() const;
+    
+    virtual ~stop_token();
+  };
+  
+}}
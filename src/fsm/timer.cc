@@ -3,21 +3,37 @@
 
 namespace virtdb { namespace fsm {
   
-  
-  timer::timer(actor fun,
+  timer::timer(clock_type::duration timeout,
                const std::string & description)
-  : fun_{fun},
+  : timeout_{timeout},
+    has_deadline_{true},
     description_{description}
   {
   }
   
+  bool
+  timer::has_deadline() const
+  {
+    return has_deadline_;
+  }
+  
+  timer::clock_type::duration
+  timer::timeout() const
+  {
+    return timeout_;
+  }
+  
   bool
   timer::execute(uint16_t seqno,
                  transition & trans,
                  state_machine & sm,
                  const clock_type::time_point & started_at)
   {
-    if( fun_ )
+    if( has_deadline_ )
+    {
+      return clock_type::now() < started_at+timeout_;
+    }
+    else if( fun_ )
     {
       return fun_(seqno,
                   trans,
@@ -1,9 +1,11 @@
 #pragma once
 
+#include <fsm/inline_function.hh>
 #include <string>
 #include <memory>
 #include <chrono>
-#include <functional>
+#include <type_traits>
+#include <utility>
 
 namespace virtdb { namespace fsm {
   
@@ -15,14 +17,16 @@ namespace virtdb { namespace fsm {
   public:
     typedef std::chrono::steady_clock clock_type;
     
-    typedef std::function<bool(uint16_t seqno,
-                               transition & trans,
-                               state_machine & sm,
-                               const clock_type::time_point & started_at)> actor;
+    typedef inline_function<bool(uint16_t seqno,
+                                 transition & trans,
+                                 state_machine & sm,
+                                 const clock_type::time_point & started_at)> actor;
     
   private:
-    actor         fun_;
-    std::string   description_;
+    actor                   fun_;
+    clock_type::duration    timeout_;
+    bool                    has_deadline_;
+    std::string             description_;
     
     // disable default construction
     timer() = delete;
@@ -34,9 +38,27 @@ namespace virtdb { namespace fsm {
   public:
     typedef std::shared_ptr<timer> sptr;
     
-    timer(actor fun,
+    // any callable that fits into actor, stored without allocating
+    template <typename F,
+              typename=typename std::enable_if<
+                !std::is_convertible<F, clock_type::duration>::value>::type>
+    timer(F && fun,
+          const std::string & description)
+    : fun_{std::forward<F>(fun)},
+      timeout_{clock_type::duration::zero()},
+      has_deadline_{false},
+      description_{description}
+    {
+    }
+    
+    // deadline timers are not polled: the transition arms them when
+    // their seqno is reached and expires them after `timeout`
+    timer(clock_type::duration timeout,
           const std::string & description);
     
+    bool has_deadline() const;
+    clock_type::duration timeout() const;
+    
     bool execute(uint16_t seqno,
                  transition & trans,
                  state_machine & sm,
@@ -0,0 +1,385 @@
+#include <fsm/timer_service.hh>
+#include <fsm/state_machine.hh>
+#include <fsm/exception.hh>
+
+namespace virtdb { namespace fsm {
+  
+  const uint32_t timer_service::none;
+  
+  bool
+  timer_handle::cancel()
+  {
+    return timer_service::shared().cancel(*this);
+  }
+  
+  bool
+  timer_handle::pending() const
+  {
+    return timer_service::shared().pending(*this);
+  }
+  
+  timer_service::timer_service(const clock_type::duration & resolution)
+  : resolution_{resolution},
+    start_{clock_type::now()},
+    now_{0},
+    wake_tick_{UINT64_MAX},
+    pending_{0},
+    free_{none},
+    firing_{nullptr},
+    stopping_{false}
+  {
+    if( resolution_ <= clock_type::duration::zero() )
+    {
+      THROW_("timer resolution must be positive");
+    }
+    
+    for( auto & h : heads_ )
+      h = none;
+    for( auto & d : due_ )
+      d = 0;
+    
+    thread_ = std::thread{[this]() { work(); }};
+  }
+  
+  timer_service &
+  timer_service::shared()
+  {
+    // never destroyed: machines with static storage may still cancel
+    // their timers during static destruction
+    static timer_service * service = new timer_service{std::chrono::milliseconds(1)};
+    return *service;
+  }
+  
+  uint32_t
+  timer_service::alloc()
+  {
+    if( free_ == none )
+    {
+      if( chunks_.size() == (none >> chunk_bits) )
+      {
+        THROW_("too many pending timers");
+      }
+      
+      uint32_t base = static_cast<uint32_t>(chunks_.size()) << chunk_bits;
+      chunks_.emplace_back(new node[chunk_size]);
+      node * c = chunks_.back().get();
+      for( uint32_t i=0; i<chunk_size; ++i )
+      {
+        c[i].machine_     = nullptr;
+        c[i].generation_  = 0;
+        c[i].next_        = (i+1 < chunk_size ? base+i+1 : none);
+      }
+      free_ = base;
+    }
+    
+    uint32_t index = free_;
+    free_ = at(index).next_;
+    return index;
+  }
+  
+  void
+  timer_service::release(uint32_t index)
+  {
+    node & n = at(index);
+    n.machine_ = nullptr;
+    ++n.generation_;
+    n.next_ = free_;
+    free_ = index;
+  }
+  
+  void
+  timer_service::place(uint32_t index)
+  {
+    node & n = at(index);
+    
+    // the level is given by the highest tick digit that differs from now
+    uint64_t x = n.tick_ ^ now_;
+    uint16_t where = overflow;
+    if( (x >> (levels*slot_bits)) == 0 )
+    {
+      uint32_t level = 0;
+      while( x >> ((level+1)*slot_bits) )
+        ++level;
+      where = static_cast<uint16_t>(level*slots + ((n.tick_ >> (level*slot_bits)) & (slots-1)));
+    }
+    
+    n.where_  = where;
+    n.prev_   = none;
+    n.next_   = heads_[where];
+    if( n.next_ != none )
+      at(n.next_).prev_ = index;
+    heads_[where] = index;
+    
+    if( where < slots )
+      due_[where/64] |= (1ULL << (where%64));
+  }
+  
+  void
+  timer_service::unlink(uint32_t index)
+  {
+    node & n = at(index);
+    
+    if( n.prev_ == none )
+      heads_[n.where_] = n.next_;
+    else
+      at(n.prev_).next_ = n.next_;
+    if( n.next_ != none )
+      at(n.next_).prev_ = n.prev_;
+    
+    if( n.where_ < slots && heads_[n.where_] == none )
+      due_[n.where_/64] &= ~(1ULL << (n.where_%64));
+    
+    if( n.machine_prev_ == none )
+      n.machine_->timers_ = n.machine_next_;
+    else
+      at(n.machine_prev_).machine_next_ = n.machine_next_;
+    if( n.machine_next_ != none )
+      at(n.machine_next_).machine_prev_ = n.machine_prev_;
+  }
+  
+  void
+  timer_service::cascade(uint16_t where)
+  {
+    uint32_t index = heads_[where];
+    heads_[where] = none;
+    while( index != none )
+    {
+      uint32_t next = at(index).next_;
+      place(index);
+      index = next;
+    }
+  }
+  
+  uint64_t
+  timer_service::next_due() const
+  {
+    // the first non-empty slot after now in this round of the first
+    // level, or the end of the round, when the next level cascades
+    uint64_t slot = (now_ & (slots-1)) + 1;
+    for( uint64_t w=slot/64; w<slots/64; ++w )
+    {
+      uint64_t bits = due_[w];
+      if( w == slot/64 )
+        bits &= (~0ULL << (slot%64));
+      if( bits )
+        return (now_ & ~uint64_t(slots-1)) + w*64 + __builtin_ctzll(bits);
+    }
+    return (now_ | (slots-1)) + 1;
+  }
+  
+  void
+  timer_service::advance(uint64_t target,
+                         lock & lck)
+  {
+    while( now_ < target )
+    {
+      uint64_t next = next_due();
+      if( next > target )
+      {
+        now_ = target;
+        break;
+      }
+      
+      now_ = next;
+      if( (now_ & (slots-1)) == 0 )
+      {
+        // higher levels first, their timers may land on lower ones
+        if( (now_ & ((1ULL << (levels*slot_bits))-1)) == 0 )
+          cascade(overflow);
+        for( uint32_t level=levels-1; level>0; --level )
+        {
+          if( (now_ & ((1ULL << (level*slot_bits))-1)) == 0 )
+            cascade(static_cast<uint16_t>(level*slots + ((now_ >> (level*slot_bits)) & (slots-1))));
+        }
+      }
+      fire(static_cast<uint16_t>(now_ & (slots-1)), lck);
+    }
+  }
+  
+  void
+  timer_service::fire(uint16_t slot,
+                      lock & lck)
+  {
+    while( heads_[slot] != none )
+    {
+      uint32_t index = heads_[slot];
+      node & n = at(index);
+      state_machine * sm = n.machine_;
+      uint16_t event = n.event_;
+      uint8_t priority = n.priority_;
+      unlink(index);
+      release(index);
+      --pending_;
+      
+      // cancel_all() waits for this, so the machine stays alive
+      firing_ = sm;
+      lck.unlock();
+      try
+      {
+        if( priority == wake_priority )
+          sm->notify();
+        else
+          sm->enqueue_fired(event, static_cast<event_priority>(priority));
+      }
+      catch (...)
+      {
+        // lost like a rejected event, the service must go on
+      }
+      lck.lock();
+      firing_ = nullptr;
+      fired_cv_.notify_all();
+    }
+  }
+  
+  uint64_t
+  timer_service::tick_after(const clock_type::time_point & tp) const
+  {
+    if( tp <= start_ )
+      return 0;
+    return static_cast<uint64_t>((tp-start_ + resolution_ - clock_type::duration{1}) / resolution_);
+  }
+  
+  uint64_t
+  timer_service::tick_before(const clock_type::time_point & tp) const
+  {
+    if( tp <= start_ )
+      return 0;
+    return static_cast<uint64_t>((tp-start_) / resolution_);
+  }
+  
+  void
+  timer_service::work()
+  {
+    lock lck(mtx_);
+    while( !stopping_ )
+    {
+      if( pending_ == 0 )
+      {
+        wake_tick_ = UINT64_MAX;
+        cv_.wait(lck);
+        continue;
+      }
+      
+      uint64_t current = tick_before(clock_type::now());
+      if( current > now_ )
+      {
+        advance(current, lck);
+        continue;
+      }
+      
+      wake_tick_ = next_due();
+      cv_.wait_until(lck, start_ + resolution_*wake_tick_);
+    }
+  }
+  
+  timer_handle
+  timer_service::schedule(state_machine & sm,
+                          uint16_t event,
+                          event_priority priority,
+                          const clock_type::time_point & when)
+  {
+    lock lck(mtx_);
+    uint32_t index = alloc();
+    node & n = at(index);
+    
+    // the current tick may be firing already
+    n.tick_       = tick_after(when);
+    if( n.tick_ <= now_ )
+      n.tick_ = now_+1;
+    n.machine_    = &sm;
+    n.event_      = event;
+    n.priority_   = priority;
+    
+    n.machine_prev_ = none;
+    n.machine_next_ = sm.timers_;
+    if( sm.timers_ != none )
+      at(sm.timers_).machine_prev_ = index;
+    sm.timers_ = index;
+    
+    place(index);
+    ++pending_;
+    
+    timer_handle ret{index, n.generation_};
+    bool wake = (n.tick_ < wake_tick_);
+    lck.unlock();
+    
+    if( wake )
+      cv_.notify_one();
+    return ret;
+  }
+  
+  timer_handle
+  timer_service::wake_at(state_machine & sm,
+                         const clock_type::time_point & when)
+  {
+    return schedule(sm, 0, static_cast<event_priority>(wake_priority), when);
+  }
+  
+  bool
+  timer_service::cancel(const timer_handle & handle)
+  {
+    lock lck(mtx_);
+    if( handle.index_ >= (chunks_.size() << chunk_bits) )
+      return false;
+    
+    node & n = at(handle.index_);
+    if( !n.machine_ || n.generation_ != handle.generation_ )
+      return false;
+    
+    unlink(handle.index_);
+    release(handle.index_);
+    --pending_;
+    return true;
+  }
+  
+  bool
+  timer_service::pending(const timer_handle & handle)
+  {
+    lock lck(mtx_);
+    if( handle.index_ >= (chunks_.size() << chunk_bits) )
+      return false;
+    
+    node & n = at(handle.index_);
+    return n.machine_ && n.generation_ == handle.generation_;
+  }
+  
+  void
+  timer_service::cancel_all(state_machine & sm)
+  {
+    lock lck(mtx_);
+    while( sm.timers_ != none )
+    {
+      uint32_t index = sm.timers_;
+      unlink(index);
+      release(index);
+      --pending_;
+    }
+    
+    while( firing_ == &sm )
+      fired_cv_.wait(lck);
+  }
+  
+  uint64_t
+  timer_service::pending()
+  {
+    lock lck(mtx_);
+    return pending_;
+  }
+  
+  timer_service::clock_type::duration
+  timer_service::resolution() const
+  {
+    return resolution_;
+  }
+  
+  timer_service::~timer_service()
+  {
+    {
+      lock lck(mtx_);
+      stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+  
+}}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <fsm/event_queue.hh>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace virtdb { namespace fsm {
+  
+  class state_machine;
+  class timer_service;
+  
+  // a delayed event. cancel() returns false once the event was fired or
+  // cancelled already, a default constructed handle refers to nothing.
+  class timer_handle
+  {
+    friend class timer_service;
+    
+    uint32_t   index_;
+    uint32_t   generation_;
+    
+    timer_handle(uint32_t index, uint32_t generation)
+    : index_{index},
+      generation_{generation}
+    {
+    }
+    
+  public:
+    timer_handle()
+    : index_{UINT32_MAX},
+      generation_{0}
+    {
+    }
+    
+    bool cancel();
+    bool pending() const;
+  };
+  
+  // the delayed events of every machine, on a single thread. timers are
+  // kept in a hierarchical timing wheel of four levels with 256 slots of
+  // one tick each on the first level, so inserting and cancelling are
+  // O(1) and the thread only looks at the slots that are due. timers
+  // further than 2^32 ticks wait in an overflow list. timer nodes come
+  // from chunks that are reused, so a steady number of pending timers
+  // doesn't allocate. events go into the normal queue of the machine
+  // when they fire, never before their time and at most a tick late.
+  class timer_service
+  {
+  public:
+    typedef std::chrono::steady_clock clock_type;
+    
+  private:
+    enum {
+      levels       = 4,
+      slot_bits    = 8,
+      slots        = 1 << slot_bits,
+      overflow     = levels*slots,    // where_ of the overflow list
+      chunk_bits   = 12,
+      chunk_size   = 1 << chunk_bits,
+      wake_priority = 0xff            // wakes the machine, no event
+    };
+    
+    static const uint32_t none = UINT32_MAX;
+    
+    typedef std::unique_lock<std::mutex> lock;
+    
+    struct node
+    {
+      uint64_t          tick_;
+      state_machine *   machine_;     // null when the node is free
+      uint32_t          next_;        // in the slot, or the free list
+      uint32_t          prev_;
+      uint32_t          machine_next_;
+      uint32_t          machine_prev_;
+      uint32_t          generation_;
+      uint16_t          where_;       // level*slots + slot
+      uint16_t          event_;
+      uint8_t           priority_;
+    };
+    
+    typedef std::unique_ptr<node[]> chunk;
+    
+    clock_type::duration              resolution_;
+    clock_type::time_point            start_;
+    uint64_t                          now_;       // every tick up to this is done
+    uint64_t                          wake_tick_; // the thread sleeps until this
+    uint64_t                          pending_;
+    uint32_t                          heads_[levels*slots+1];
+    uint64_t                          due_[slots/64];  // non-empty first level slots
+    std::vector<chunk>                chunks_;
+    uint32_t                          free_;
+    state_machine *                   firing_;
+    bool                              stopping_;
+    std::mutex                        mtx_;
+    std::condition_variable           cv_;
+    std::condition_variable           fired_cv_;
+    std::thread                       thread_;
+    
+    node & at(uint32_t index)
+    {
+      return chunks_[index >> chunk_bits][index & (chunk_size-1)];
+    }
+    
+    // callers hold the lock
+    uint32_t alloc();
+    void release(uint32_t index);
+    void place(uint32_t index);
+    void unlink(uint32_t index);
+    void cascade(uint16_t where);
+    uint64_t next_due() const;
+    void advance(uint64_t target, lock & lck);
+    void fire(uint16_t slot, lock & lck);
+    
+    uint64_t tick_after(const clock_type::time_point & tp) const;
+    uint64_t tick_before(const clock_type::time_point & tp) const;
+    
+    void work();
+    
+    // disable default construction
+    timer_service() = delete;
+    
+    // disable copying until properly implemented
+    timer_service(const timer_service &) = delete;
+    timer_service & operator=(const timer_service &) = delete;
+    
+    timer_service(const clock_type::duration & resolution);
+    
+  public:
+    // the one service, started on first use with a resolution of 1ms.
+    // it lives until the process exits.
+    static timer_service & shared();
+    
+    timer_handle schedule(state_machine & sm,
+                          uint16_t event,
+                          event_priority priority,
+                          const clock_type::time_point & when);
+    
+    // notifies the machine at the deadline of its suspended transition
+    timer_handle wake_at(state_machine & sm,
+                         const clock_type::time_point & when);
+    
+    bool cancel(const timer_handle & handle);
+    bool pending(const timer_handle & handle);
+    
+    // drops the timers of a machine being destroyed, waits if one of
+    // them is firing right now
+    void cancel_all(state_machine & sm);
+    
+    uint64_t pending();
+    clock_type::duration resolution() const;
+    
+    virtual ~timer_service();
+  };
+  
+}}
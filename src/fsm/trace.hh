@@ -0,0 +1,10 @@
+#pragma once
+
+// building with FSM_NO_TRACE removes every trace callback invocation
+// and the description strings built for them. otherwise the trace is
+// called only when a callback is set.
+#ifdef FSM_NO_TRACE
+#define FSM_TRACE_ON_(TRACE) false
+#else
+#define FSM_TRACE_ON_(TRACE) static_cast<bool>(TRACE)
+#endif // FSM_NO_TRACE
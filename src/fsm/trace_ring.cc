@@ -0,0 +1,298 @@
+#include <fsm/trace_ring.hh>
+#include <fsm/latency_histogram.hh>
+#include <istream>
+#include <ostream>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace virtdb { namespace fsm {
+  
+  namespace
+  {
+    // dump layout, native byte order:
+    //   magic, version, machine id, description,
+    //   state names, event names: count, then (id, string) pairs
+    //   records: count, then the raw records
+    const char      dump_magic[8] = { 'F','S','M','T','R','A','C','E' };
+    const uint32_t  dump_version  = 1;
+    
+    inline uint64_t
+    ticks()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return latency_histogram::now_ns();
+#endif
+    }
+    
+    template <typename T>
+    void put(std::ostream & os, const T & v)
+    {
+      os.write(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+    
+    void put_string(std::ostream & os, const std::string & s)
+    {
+      put(os, static_cast<uint32_t>(s.size()));
+      os.write(s.data(), s.size());
+    }
+    
+    void put_names(std::ostream & os, const trace_ring::name_map & names)
+    {
+      put(os, static_cast<uint32_t>(names.size()));
+      for( auto const & n : names )
+      {
+        put(os, n.first);
+        put_string(os, n.second);
+      }
+    }
+    
+    // a dump being read. counts and lengths are checked against the
+    // bytes left in the stream before anything is allocated for them.
+    // streams that can't seek are read in bounded chunks, so a corrupt
+    // count fails at the end of the data instead of allocating for it.
+    class reader
+    {
+      enum { chunk_size = 64*1024 };
+      
+      std::istream &   is_;
+      uint64_t         left_;   // UINT64_MAX when unknown
+      
+    public:
+      reader(std::istream & is)
+      : is_(is),
+        left_{UINT64_MAX}
+      {
+        std::istream::pos_type here = is_.tellg();
+        if( here == std::istream::pos_type(-1) )
+          return;
+        is_.seekg(0, std::ios::end);
+        std::istream::pos_type end = is_.tellg();
+        is_.seekg(here);
+        if( end != std::istream::pos_type(-1) && end >= here && is_ )
+          left_ = static_cast<uint64_t>(end-here);
+        else
+          is_.clear();
+      }
+      
+      // count items of at least size bytes each may follow
+      bool fits(uint64_t count, uint64_t size) const
+      {
+        return left_ == UINT64_MAX || count <= left_/size;
+      }
+      
+      bool bytes(char * dst, uint64_t n)
+      {
+        if( !fits(n, 1) || !is_.read(dst, static_cast<std::streamsize>(n)) )
+          return false;
+        if( left_ != UINT64_MAX )
+          left_ -= n;
+        return true;
+      }
+      
+      template <typename T>
+      bool get(T & v)
+      {
+        return bytes(reinterpret_cast<char *>(&v), sizeof(v));
+      }
+      
+      // n objects of T, growing by a chunk at a time
+      template <typename T>
+      bool get_array(std::vector<T> & v, uint64_t n)
+      {
+        if( !fits(n, sizeof(T)) )
+          return false;
+        v.clear();
+        while( n > 0 )
+        {
+          uint64_t chunk = n < chunk_size/sizeof(T) ? n : chunk_size/sizeof(T);
+          size_t at = v.size();
+          v.resize(at+chunk);
+          if( !bytes(reinterpret_cast<char *>(v.data()+at), chunk*sizeof(T)) )
+            return false;
+          n -= chunk;
+        }
+        return true;
+      }
+      
+      bool get_string(std::string & s)
+      {
+        uint32_t len = 0;
+        std::vector<char> buf;
+        if( !get(len) || !get_array(buf, len) )
+          return false;
+        s.assign(buf.begin(), buf.end());
+        return true;
+      }
+      
+      bool get_names(trace_ring::name_map & names)
+      {
+        // an id and a string length at least
+        uint32_t count = 0;
+        if( !get(count) || !fits(count, sizeof(uint16_t)+sizeof(uint32_t)) )
+          return false;
+        for( uint32_t i=0; i<count; ++i )
+        {
+          uint16_t id = 0;
+          if( !get(id) || !get_string(names[id]) ) return false;
+        }
+        return true;
+      }
+    };
+  }
+  
+  trace_ring::trace_ring(uint32_t machine_id,
+                         uint32_t capacity)
+  : machine_id_{machine_id},
+    mask_{0},
+    origin_ticks_{ticks()},
+    origin_ns_{latency_histogram::now_ns()},
+    pos_{0}
+  {
+    uint64_t cap = 2;
+    while( cap < capacity ) cap <<= 1;
+    
+    mask_ = cap-1;
+    slots_.reset(new slot[cap]);
+    for( uint64_t i=0; i<cap; ++i )
+    {
+      slots_[i].stamp_.store(0, std::memory_order_relaxed);
+      ::memset(&slots_[i].rec_, 0, sizeof(record));
+    }
+  }
+  
+  void
+  trace_ring::add(uint16_t state,
+                  uint16_t event,
+                  uint16_t seqno,
+                  result_type result,
+                  uint16_t next_state)
+  {
+    // a single writer, no read-modify-write needed
+    uint64_t idx = pos_.load(std::memory_order_relaxed);
+    slot & s = slots_[idx & mask_];
+    
+    s.stamp_.store(2*idx+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    
+    s.rec_.timestamp_ns_  = ticks();   // converted by snapshot()
+    s.rec_.machine_id_    = machine_id_;
+    s.rec_.state_         = state;
+    s.rec_.event_         = event;
+    s.rec_.seqno_         = seqno;
+    s.rec_.next_state_    = next_state;
+    s.rec_.result_        = static_cast<uint8_t>(result);
+    
+    s.stamp_.store(2*idx+2, std::memory_order_release);
+    pos_.store(idx+1, std::memory_order_release);
+  }
+  
+  void
+  trace_ring::snapshot(std::vector<record> & records) const
+  {
+    uint64_t end    = pos_.load(std::memory_order_acquire);
+    uint64_t begin  = end > mask_+1 ? end-(mask_+1) : 0;
+    
+    records.clear();
+    records.reserve(end-begin);
+    for( uint64_t idx=begin; idx<end; ++idx )
+    {
+      const slot & s = slots_[idx & mask_];
+      uint64_t stamp = s.stamp_.load(std::memory_order_acquire);
+      if( stamp != 2*idx+2 )
+        continue;
+      
+      record rec = s.rec_;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      
+      // skip the record if a writer lapped us while copying
+      if( s.stamp_.load(std::memory_order_relaxed) == stamp )
+        records.push_back(rec);
+    }
+    
+    // read after the records, so every stamp is in the measured range
+    uint64_t now_ticks  = ticks();
+    uint64_t now_ns     = latency_histogram::now_ns();
+    double ns_per_tick  = 1.0;
+    if( now_ticks > origin_ticks_ && now_ns > origin_ns_ )
+      ns_per_tick = double(now_ns-origin_ns_)/double(now_ticks-origin_ticks_);
+    
+    for( auto & rec : records )
+    {
+      uint64_t since = (rec.timestamp_ns_ > origin_ticks_ ? rec.timestamp_ns_-origin_ticks_ : 0);
+      rec.timestamp_ns_ = origin_ns_ + static_cast<uint64_t>(double(since)*ns_per_tick);
+    }
+  }
+  
+  uint64_t
+  trace_ring::capacity() const
+  {
+    return mask_+1;
+  }
+  
+  uint64_t
+  trace_ring::recorded() const
+  {
+    return pos_.load(std::memory_order_relaxed);
+  }
+  
+  const char *
+  trace_ring::result_name(uint8_t result)
+  {
+    switch( result )
+    {
+      case ok:         return "ok";
+      case timeout:    return "timeout";
+      case error:      return "error";
+      case exception:  return "exception";
+      case unhandled:  return "unhandled";
+      case suspended:  return "suspended";
+    };
+    return "?";
+  }
+  
+  void
+  trace_ring::write(std::ostream & os,
+                    const dump & d)
+  {
+    os.write(dump_magic, sizeof(dump_magic));
+    put(os, dump_version);
+    put(os, d.machine_id_);
+    put_string(os, d.description_);
+    put_names(os, d.state_names_);
+    put_names(os, d.event_names_);
+    put(os, static_cast<uint64_t>(d.records_.size()));
+    if( !d.records_.empty() )
+    {
+      os.write(reinterpret_cast<const char *>(d.records_.data()),
+               d.records_.size() * sizeof(record));
+    }
+  }
+  
+  bool
+  trace_ring::read(std::istream & is,
+                   dump & d)
+  {
+    reader r{is};
+    char magic[sizeof(dump_magic)];
+    uint32_t version = 0;
+    uint64_t count = 0;
+    
+    return r.bytes(magic, sizeof(magic)) &&
+           ::memcmp(magic, dump_magic, sizeof(magic)) == 0 &&
+           r.get(version) &&
+           version == dump_version &&
+           r.get(d.machine_id_) &&
+           r.get_string(d.description_) &&
+           r.get_names(d.state_names_) &&
+           r.get_names(d.event_names_) &&
+           r.get(count) &&
+           r.get_array(d.records_, count);
+  }
+  
+  trace_ring::~trace_ring() {}
+  
+}}
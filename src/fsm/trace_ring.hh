@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <iosfwd>
+#include <cstdint>
+
+namespace virtdb { namespace fsm {
+  
+  // fixed size binary history of the executed transitions. recording
+  // neither allocates nor locks, the oldest records are overwritten.
+  // records are written by the thread running the machine only. reading
+  // the clock would cost more than the record itself, so each record is
+  // stamped with the cycle counter instead. snapshot() converts the
+  // stamps to steady clock nanoseconds by the rate the counter ran at
+  // since the ring was created. that needs a counter at a constant rate,
+  // in sync across cores, like on current x86 processors. elsewhere the
+  // steady clock is read for every record.
+  class trace_ring
+  {
+  public:
+    enum result_type {
+      ok,
+      timeout,
+      error,
+      exception,
+      unhandled,  // no transition for the state and event
+      suspended   // an action suspended the transition
+    };
+    
+    struct record
+    {
+      uint64_t   timestamp_ns_;
+      uint32_t   machine_id_;
+      uint16_t   state_;
+      uint16_t   event_;
+      uint16_t   seqno_;
+      uint16_t   next_state_;
+      uint8_t    result_;
+      uint8_t    reserved_[3];
+    };
+    
+    typedef std::map<uint16_t, std::string> name_map;
+    
+    // everything the offline decoder needs
+    struct dump
+    {
+      uint32_t              machine_id_;
+      std::string           description_;
+      name_map              state_names_;
+      name_map              event_names_;
+      std::vector<record>   records_;
+    };
+    
+    static const char * result_name(uint8_t result);
+    
+    static void write(std::ostream & os, const dump & d);
+    static bool read(std::istream & is, dump & d);
+    
+  private:
+    struct slot
+    {
+      // odd while being written, 2*(index+1) when complete
+      std::atomic<uint64_t>   stamp_;
+      record                  rec_;
+    };
+    
+    uint32_t                  machine_id_;
+    uint64_t                  mask_;
+    uint64_t                  origin_ticks_;
+    uint64_t                  origin_ns_;
+    std::unique_ptr<slot[]>   slots_;
+    std::atomic<uint64_t>     pos_;
+    
+    // disable default construction
+    trace_ring() = delete;
+    
+    // disable copying until properly implemented
+    trace_ring(const trace_ring &) = delete;
+    trace_ring & operator=(const trace_ring &) = delete;
+    
+  public:
+    typedef std::unique_ptr<trace_ring> uptr;
+    
+    // capacity is rounded up to a power of two
+    trace_ring(uint32_t machine_id,
+               uint32_t capacity);
+    
+    void add(uint16_t state,
+             uint16_t event,
+             uint16_t seqno,
+             result_type result,
+             uint16_t next_state);
+    
+    // the complete records, oldest first, stamped in nanoseconds
+    void snapshot(std::vector<record> & records) const;
+    
+    uint64_t capacity() const;
+    uint64_t recorded() const;
+    
+    virtual ~trace_ring();
+  };
+  
+}}
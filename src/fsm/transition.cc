@@ -1,7 +1,15 @@
 #include <fsm/transition.hh>
+#include <fsm/trace.hh>
+#include <fsm/exception.hh>
 
 namespace virtdb { namespace fsm {
   
+  namespace
+  {
+    const std::string no_action{"<NO ACTION>"};
+    const std::string no_description;
+  }
+  
   transition::transition(uint16_t state,
                          uint16_t event,
                          uint16_t next_state,
@@ -11,258 +19,748 @@ namespace virtdb { namespace fsm {
     timeout_state_{next_state},
     error_state_{next_state},
     default_state_{next_state},
+    frozen_{false},
     description_{description}
   {
   }
   
+  transition::time_point
+  transition::run_data::at(uint16_t slot) const
+  {
+    return time_point{timer::clock_type::duration{at_[slot]}};
+  }
+  
+  void
+  transition::run_data::copy(const run_data & other)
+  {
+    started_        = other.started_;
+    armed_          = other.armed_;
+    earliest_       = other.earliest_;
+    timeout_state_  = other.timeout_state_;
+    error_state_    = other.error_state_;
+    default_state_  = other.default_state_;
+    for( uint64_t valid = started_|armed_; valid; valid &= valid-1 )
+    {
+      size_t slot = __builtin_ctzll(valid);
+      at_[slot] = other.at_[slot];
+    }
+  }
+  
+  transition::run_state::run_state(const transition * trans,
+                                   state_machine & sm,
+                                   bool parkable)
+  : trans_{trans},
+    prev_{running()},
+    sm_(sm),
+    parkable_{parkable},
+    loop_stats_{nullptr}
+  {
+    started_        = 0;
+    armed_          = 0;
+    timeout_state_  = no_override;
+    error_state_    = no_override;
+    default_state_  = no_override;
+    running() = this;
+  }
+  
+  transition::run_state::~run_state()
+  {
+    // an action suspended and threw
+    if( cont_ )
+    {
+      std::lock_guard<std::mutex> lck(cont_->mtx_);
+      cont_->machine_ = nullptr;
+    }
+    running() = prev_;
+  }
+  
+  transition::parked::parked()
+  : trans_{nullptr},
+    at_{0},
+    started_ns_{0}
+  {
+  }
+  
+  action_status
+  transition::parked::take()
+  {
+    std::lock_guard<std::mutex> lck(cont_->mtx_);
+    cont_->machine_ = nullptr;
+    if( cont_->done_.load(std::memory_order_relaxed) )
+      return cont_->status_;
+    return action_status{action_status::timeout};
+  }
+  
+  transition &
+  transition::parked::trans() const
+  {
+    return *trans_;
+  }
+  
+  bool
+  transition::parked::ready() const
+  {
+    return (cont_->done_.load(std::memory_order_seq_cst) ||
+            (run_.armed_ && timer::clock_type::now() >= run_.earliest_));
+  }
+  
   bool
-  transition::timed_out(uint16_t seqno,
-                        state_machine & sm)
+  transition::parked::has_deadline() const
   {
-    auto dummy_trace = [](uint16_t seqno,
-                          const std::string & desc,
-                          const transition & trans,
-                          const state_machine & sm) {};
+    return run_.armed_ != 0;
+  }
+  
+  timer::clock_type::time_point
+  transition::parked::deadline() const
+  {
+    return run_.earliest_;
+  }
+  
+  transition::parked::~parked()
+  {
+    // a late resume() finds nobody waiting
+    if( cont_ )
+    {
+      std::lock_guard<std::mutex> lck(cont_->mtx_);
+      cont_->machine_ = nullptr;
+    }
+  }
+  
+  transition::run_state *&
+  transition::running()
+  {
+    static thread_local run_state * run = nullptr;
+    return run;
+  }
+  
+  transition::run_state *
+  transition::find_run() const
+  {
+    run_state * run = running();
+    while( run && run->trans_ != this )
+      run = run->prev_;
+    return run;
+  }
+  
+  bool
+  transition::timed_out(state_machine & sm,
+                        run_state & run)
+  {
+    // deadline timers: only the earliest one matters
+    if( run.armed_ && timer::clock_type::now() >= run.earliest_ )
+      return true;
     
-    for( auto s : starts_ )
+    // functor timers must be asked one by one
+    for( uint64_t started = run.started_; started; started &= started-1 )
     {
-      auto a = all_actions_.find(s.first);
-      if( a != all_actions_.end() )
-      {
-        auto res = ((a->second)(s.first,
-                                *this,
-                                sm,
-                                dummy_trace));
-        if( res == timeout )
-          return true;
-      }
+      uint16_t slot = static_cast<uint16_t>(__builtin_ctzll(started));
+      if( run_timer(program_[timer_ops_[slot]], sm, run) == timeout )
+        return true;
     }
     return false;
   }
   
+  void
+  transition::arm_deadline(run_state & run,
+                           uint16_t slot,
+                           const time_point & at)
+  {
+    uint64_t bit = 1ULL << slot;
+    if( run.armed_ & bit )
+      disarm(run, slot);
+    
+    run.at_[slot] = at.time_since_epoch().count();
+    if( !run.armed_ || at < run.earliest_ )
+      run.earliest_ = at;
+    run.armed_ |= bit;
+  }
+  
+  void
+  transition::disarm(run_state & run,
+                     uint16_t slot)
+  {
+    uint64_t bit = 1ULL << slot;
+    run.started_ &= ~bit;
+    if( !(run.armed_ & bit) )
+      return;
+    
+    run.armed_ &= ~bit;
+    for( uint64_t armed = run.armed_; armed; armed &= armed-1 )
+    {
+      time_point at = run.at(static_cast<uint16_t>(__builtin_ctzll(armed)));
+      if( armed == run.armed_ || at < run.earliest_ )
+        run.earliest_ = at;
+    }
+  }
+  
   const std::string &
-  transition::seqno_description(uint16_t seqno)
+  transition::step::description() const
+  {
+    switch( kind_ )
+    {
+      case action_step:  return action_->description();
+      case loop_step:    return loop_->description();
+      case timer_step:   return timer_->description();
+      default:           return description_;
+    };
+  }
+  
+  const std::string &
+  transition::seqno_description(uint16_t seqno) const
   {
     static const std::string empty;
-    const std::string & ret = empty;
     
-    auto it = seqno_descs_.find(seqno);
-    if( it != seqno_descs_.end() )
+    auto it = all_actions_.find(seqno);
+    if( it != all_actions_.end() )
+      return it->second.description();
+    return empty;
+  }
+  
+  void
+  transition::check_not_frozen() const
+  {
+    if( frozen_ )
     {
-      const std::string & tmp = (it->second)();
-      return tmp;
+      THROW_(std::string{"cannot change a frozen transition: "}+description_);
     }
-    return ret;
+  }
+  
+  transition::step &
+  transition::add_step(uint16_t seqno,
+                       step_kind kind)
+  {
+    check_not_frozen();
+    step & st = all_actions_[seqno];
+    st = step{};
+    st.kind_ = kind;
+    return st;
   }
   
   void
-  transition::set_action(uint16_t seqno,
-                         action::sptr a)
+  transition::compile()
   {
-    auto f = [a](uint16_t seqno,
-                 transition & trans,
-                 state_machine & sm,
-                 trace_fun trace)
+    program ops;
+    std::vector<uint16_t> timer_ops;
+    std::vector<uint16_t> seqnos;
+    std::map<uint16_t, uint16_t> slots;
+    
+    ops.reserve(all_actions_.size());
+    seqnos.reserve(all_actions_.size());
+    for( auto & a : all_actions_ )
     {
-      a->execute(seqno, trans, sm);
-      return ok;
-    };
+      op o;
+      o.kind_         = a.second.kind_;
+      o.seqno_        = a.first;
+      o.timer_slot_   = no_timer;
+      o.description_  = &a.second.description();
+      o.action_       = nullptr;
+      
+      switch( o.kind_ )
+      {
+        case action_step:
+          o.action_ = a.second.action_.get();
+          break;
+          
+        case loop_step:
+          o.loop_ = a.second.loop_.get();
+          break;
+          
+        case timer_step:
+          o.timer_ = a.second.timer_.get();
+          o.timer_slot_ = static_cast<uint16_t>(timer_ops.size());
+          slots[a.first] = o.timer_slot_;
+          timer_ops.push_back(static_cast<uint16_t>(ops.size()));
+          break;
+          
+        case clear_step:
+          break;
+      };
+      ops.push_back(o);
+      seqnos.push_back(o.seqno_);
+    }
+    
+    // clear steps may come before the timer they clear
+    for( auto & o : ops )
+    {
+      if( o.kind_ == clear_step )
+      {
+        auto it = slots.find(all_actions_[o.seqno_].timer_at_);
+        if( it != slots.end() )
+          o.timer_slot_ = it->second;
+      }
+    }
     
-    all_actions_[seqno] = f;
-    seqno_descs_[seqno] = [a]() { return a->description(); };
+    program_.swap(ops);
+    timer_ops_.swap(timer_ops);
+    stats_.steps(seqnos);
+  }
+  
+  void
+  transition::set_action(uint16_t seqno,
+                         action::sptr a)
+  {
+    add_step(seqno, action_step).action_ = a;
+    compile();
   }
   
   void
   transition::set_loop(uint16_t seqno,
                        loop::sptr l)
   {
-    auto f = [l,this](uint16_t seqno,
-                      transition & trans,
-                      state_machine & sm,
-                      trace_fun trace)
+    add_step(seqno, loop_step).loop_ = l;
+    compile();
+  }
+  
+  void
+  transition::set_timer(uint16_t seqno,
+                        timer::sptr t)
+  {
+    auto it = all_actions_.find(seqno);
+    bool replaces_timer = (it != all_actions_.end() && it->second.kind_ == timer_step);
+    if( !replaces_timer && timer_ops_.size() == max_timers )
+    {
+      THROW_(std::string{"too many timers in transition: "}+description_);
+    }
+    add_step(seqno, timer_step).timer_ = t;
+    compile();
+  }
+  
+  void
+  transition::clear_timer(uint16_t seqno,
+                          uint16_t timer_at_seqno)
+  {
+    std::string clear{"CLEAR["};
+    clear += std::to_string(timer_at_seqno)+"]: ";
+    clear += seqno_description(timer_at_seqno);
+    
+    step & st = add_step(seqno, clear_step);
+    st.timer_at_     = timer_at_seqno;
+    st.description_  = clear;
+    compile();
+  }
+  
+  transition::action_result
+  transition::apply(const action_status & status,
+                    run_state & run)
+  {
+    switch( status.result_ )
+    {
+      case action_status::ok:         return ok;
+      case action_status::failed:     return failed;
+      case action_status::timeout:    return timeout;
+      case action_status::suspended:  return suspended;
+      case action_status::next_state:
+        run.default_state_ = status.state_;
+        return finished;
+    };
+    return ok;
+  }
+  
+  transition::action_result
+  transition::run_step(const op & o,
+                       state_machine & sm,
+                       run_state & run,
+                       const trace_fun & trace)
+  {
+    switch( o.kind_ )
     {
-      action_result result = ok;
-      uint64_t iteration = 0;
-      while( result == ok)
+      case action_step:
       {
-        if( timed_out(seqno, sm) )
+        action_result result = apply(o.action_->execute(o.seqno_, *this, sm), run);
+        if( result == suspended && !run.cont_ )
         {
-          result = timeout;
+          THROW_("action returned suspended without calling suspend()");
         }
-        else
+        else if( result != suspended && run.cont_ )
         {
-          if( !l->execute(seqno,
-                          trans,
-                          sm,
-                          iteration) )
-          {
-            break;
-          }
+          // suspend() was called, but the action went on after all
+          std::lock_guard<std::mutex> lck(run.cont_->mtx_);
+          run.cont_->machine_ = nullptr;
+          run.cont_.reset();
         }
-        ++iteration;
-      }
-      if( trace && iteration != 1 )
-      {
-        std::string trace_str = l->description() + "[" + std::to_string(iteration) +"]";
-        trace( seqno, trace_str, trans, sm );
+        return result;
       }
-      return result;
+        
+      case loop_step:
+        return run_loop(o.seqno_, *o.loop_, sm, run, trace);
+        
+      case timer_step:
+        return run_timer(o, sm, run);
+        
+      case clear_step:
+        if( o.timer_slot_ != no_timer )
+          disarm(run, o.timer_slot_);
+        return ok;
     };
-    
-    all_actions_[seqno] = f;
-    seqno_descs_[seqno] = [l]() { return l->description(); };
+    return ok;
   }
   
-  void
-  transition::set_timer(uint16_t seqno,
-                        timer::sptr t)
+  transition::action_result
+  transition::run_loop(uint16_t seqno,
+                       loop & l,
+                       state_machine & sm,
+                       run_state & run,
+                       const trace_fun & trace)
   {
-    auto f = [t,this](uint16_t seqno,
-                      transition & trans,
-                      state_machine & sm,
-                      trace_fun trace)
+    action_result result = ok;
+    uint64_t iteration = 0;
+    uint64_t next_check = 0;
+    uint64_t last_check = 0;
+    uint32_t interval = l.check_every();
+    loop::stats stats{0, 0, loop::clock_type::duration::zero(), false};
+    auto started_at = loop::clock_type::now();
+    auto last_check_at = started_at;
+    
+    while( result == ok)
     {
+      bool expired = false;
+      if( iteration == next_check )
       {
-        if( starts_.count(seqno) == 0 )
+        ++stats.timeout_checks_;
+        expired = timed_out(sm, run);
+        if( l.adaptive() )
         {
-          starts_[seqno] = timer::clock_type::now();
+          auto now = loop::clock_type::now();
+          interval = l.adapt(interval, iteration-last_check, now-last_check_at);
+          last_check = iteration;
+          last_check_at = now;
         }
+        next_check = iteration + interval;
       }
-      bool result = t->execute(seqno, trans, sm, starts_[seqno]);
-      return (result ? ok : timeout);
-    };
-    
-    all_actions_[seqno] = f;
-    seqno_descs_[seqno] = [t]() { return t->description(); };
+      
+      if( expired )
+      {
+        result = timeout;
+      }
+      else
+      {
+        if( !l.execute(seqno,
+                       *this,
+                       sm,
+                       iteration) )
+        {
+          break;
+        }
+      }
+      ++iteration;
+    }
+    if( FSM_TRACE_ON_(trace) && iteration != 1 )
+    {
+      stats.iterations_  = iteration;
+      stats.elapsed_     = loop::clock_type::now() - started_at;
+      stats.timed_out_   = (result == timeout);
+      run.loop_stats_ = &stats;
+      std::string trace_str = l.description() + "[" + std::to_string(iteration) +"]";
+      trace( seqno, trace_str, *this, sm );
+      run.loop_stats_ = nullptr;
+    }
+    return result;
   }
   
-  void
-  transition::clear_timer(uint16_t seqno,
-                          uint16_t timer_at_seqno)
+  transition::action_result
+  transition::run_timer(const op & o,
+                        state_machine & sm,
+                        run_state & run)
   {
-    auto f = [timer_at_seqno, this](uint16_t seqno,
-                                    transition & trans,
-                                    state_machine & sm,
-                                    trace_fun trace)
+    timer & t = *o.timer_;
+    if( t.has_deadline() )
     {
-      starts_.erase(seqno);
-      return ok;
-    };
-    
-    all_actions_[seqno] = f;
+      auto now = timer::clock_type::now();
+      arm_deadline(run, o.timer_slot_, now+t.timeout());
+      return (t.timeout() > timer::clock_type::duration::zero() ? ok : timeout);
+    }
     
-    std::string clear{"CLEAR["};
-    clear += std::to_string(timer_at_seqno)+"]: ";
-    clear += seqno_description(timer_at_seqno);
+    uint64_t bit = 1ULL << o.timer_slot_;
+    if( !(run.started_ & bit) )
+    {
+      run.at_[o.timer_slot_] = timer::clock_type::now().time_since_epoch().count();
+      run.started_ |= bit;
+    }
     
-    seqno_descs_[seqno] = [clear](){ return clear; };
+    bool result = t.execute(o.seqno_, *this, sm, run.at(o.timer_slot_));
+    return (result ? ok : timeout);
   }
-   
+  
   void
   transition::on_timeout_state(uint16_t nst)
   {
-    timeout_state_ = nst;
+    run_state * run = find_run();
+    if( run )
+    {
+      run->timeout_state_ = nst;
+    }
+    else
+    {
+      check_not_frozen();
+      timeout_state_ = nst;
+    }
   }
   
   void
   transition::on_error_state(uint16_t nst)
   {
-    error_state_ = nst;
+    run_state * run = find_run();
+    if( run )
+    {
+      run->error_state_ = nst;
+    }
+    else
+    {
+      check_not_frozen();
+      error_state_ = nst;
+    }
   }
   
   void
   transition::default_state(uint16_t nst)
   {
-    default_state_ = nst;
+    run_state * run = find_run();
+    if( run )
+    {
+      run->default_state_ = nst;
+    }
+    else
+    {
+      check_not_frozen();
+      default_state_ = nst;
+    }
   }
    
-  uint16_t
-  transition::execute(state_machine & sm,
-                      trace_fun trace)
+  continuation
+  transition::suspend()
+  {
+    run_state * run = find_run();
+    if( !run )
+    {
+      THROW_("only the actions of a running transition can suspend it");
+    }
+    else if( !run->parkable_ )
+    {
+      THROW_("this execution of the transition can't be suspended");
+    }
+    else if( run->cont_ )
+    {
+      THROW_("the transition is being suspended already");
+    }
+    run->cont_ = std::make_shared<continuation::shared_state>(&run->sm_);
+    return continuation{run->cont_};
+  }
+  
+  void
+  transition::run_program(progress & pr,
+                          run_state & run,
+                          state_machine & sm,
+                          const trace_fun & trace,
+                          bool measure)
   {
-    bool tmout    = false;
-    bool stopped  = false;
-    bool thrown   = false;
-    uint16_t last_seqno = 0;
-
-    // clear timers
-    starts_.clear();
-    
     try
     {
-      if( all_actions_.empty() )
-      {
-        trace(0, "<NO ACTION>", *this, sm);
-      }
-      else
+      for( ; pr.at_ < program_.size(); ++pr.at_ )
       {
-        for( auto a : all_actions_ )
+        const op & o = program_[pr.at_];
+        pr.last_seqno_  = o.seqno_;
+        pr.last_desc_   = o.description_;
+        if( FSM_TRACE_ON_(trace) )
         {
-          last_seqno = a.first;
-          if( trace )
-          {
-            std::string desc = seqno_description(last_seqno);
-            trace(last_seqno, desc, *this, sm);
-          }
-          if( timed_out(last_seqno, sm) )
+          trace(pr.last_seqno_, *pr.last_desc_, *this, sm);
+        }
+        if( timed_out(sm, run) )
+        {
+          pr.tmout_ = true;
+          break;
+        }
+        
+        uint64_t step_ns = (measure ? latency_histogram::now_ns() : 0);
+        auto result = run_step(o,
+                               sm,
+                               run,
+                               trace);
+        if( measure )
+          stats_.record_step(pr.at_, latency_histogram::now_ns()-step_ns);
+        
+        if( result == suspended )
+        {
+          if( !run.cont_->done_.load(std::memory_order_seq_cst) )
           {
-            tmout = true;
+            pr.suspended_ = true;
             break;
           }
-          else
+          
+          // completed before the action returned, no need to park
+          action_status status;
           {
-            auto result = (a.second)(last_seqno,
-                                     *this,
-                                     sm,
-                                     trace);
-            if( result == timeout )
-            {
-              tmout = true;
-              break;
-            }
-            else if( result == failed )
-            {
-              stopped = true;
-              break;
-            }
+            std::lock_guard<std::mutex> lck(run.cont_->mtx_);
+            run.cont_->machine_ = nullptr;
+            status = run.cont_->status_;
           }
+          run.cont_.reset();
+          result = apply(status, run);
+        }
+        
+        if( result == timeout )
+        {
+          pr.tmout_ = true;
+          break;
+        }
+        else if( result == failed )
+        {
+          pr.stopped_ = true;
+          break;
+        }
+        else if( result == action_result::finished )
+        {
+          pr.finished_ = true;
+          break;
         }
       }
     }
     catch (const std::exception & e)
     {
-      std::string desc = seqno_description(last_seqno);
-      std::string trace_str = desc + " [EXCEPTION] :" + e.what();
-      trace( last_seqno, trace_str, *this, sm );
-      thrown = true;
+      run.loop_stats_ = nullptr;
+      if( FSM_TRACE_ON_(trace) )
+      {
+        std::string trace_str = *pr.last_desc_ + " [EXCEPTION] :" + e.what();
+        trace( pr.last_seqno_, trace_str, *this, sm );
+      }
+      pr.thrown_ = true;
     }
     catch (...)
     {
-      thrown = true;
-      std::string desc = seqno_description(last_seqno);
-      std::string trace_str = desc + " [EXCEPTION] : unknown";
-      trace( last_seqno, trace_str, *this, sm );
-      thrown = true;
+      run.loop_stats_ = nullptr;
+      if( FSM_TRACE_ON_(trace) )
+      {
+        std::string trace_str = *pr.last_desc_ + " [EXCEPTION] : unknown";
+        trace( pr.last_seqno_, trace_str, *this, sm );
+      }
+      pr.thrown_ = true;
     }
-
-    // last check for timeout
-    if( !tmout )
+  }
+  
+  uint16_t
+  transition::conclude(progress & pr,
+                       run_state & run,
+                       uint64_t started_ns,
+                       state_machine & sm,
+                       const trace_fun & trace,
+                       outcome * out,
+                       bool measure)
+  {
+    if( pr.suspended_ )
+    {
+      if( FSM_TRACE_ON_(trace) )
+      {
+        std::string trace_str = *pr.last_desc_ + " [SUSPENDED]";
+        trace( pr.last_seqno_, trace_str, *this, sm );
+      }
+      
+      std::unique_ptr<parked> p{new parked};
+      p->trans_       = this;
+      p->at_          = pr.at_;
+      p->started_ns_  = started_ns;
+      p->run_.copy(run);
+      p->cont_        = std::move(run.cont_);
+      
+      out->seqno_   = pr.last_seqno_;
+      out->result_  = outcome::suspended;
+      out->parked_  = std::move(p);
+      return state_;
+    }
+    
+    // last check for timeout, unless an action chose the next state
+    if( !pr.tmout_ && !pr.finished_ )
+    {
+      pr.tmout_ = timed_out(sm, run);
+    }
+    
+    if( measure )
+    {
+      stats_.record(latency_histogram::now_ns()-started_ns);
+      if( pr.thrown_ )        stats_.count_exception();
+      else if( pr.stopped_ )  stats_.count_error();
+      else if( pr.tmout_ )    stats_.count_timeout();
+    }
+    
+    if( out )
     {
-      tmout = timed_out(last_seqno+1, sm);
+      out->seqno_   = pr.last_seqno_;
+      out->result_  = (pr.thrown_  ? outcome::exception :
+                       pr.stopped_ ? outcome::error :
+                       pr.tmout_   ? outcome::timeout :
+                                     outcome::ok);
     }
     
-    if( thrown || stopped )
+    if( pr.thrown_ || pr.stopped_ )
+    {
+      return (run.error_state_ != no_override ? run.error_state_ : error_state_);
+    }
+    else if( pr.tmout_ )
     {
-      return error_state_;
+      return (run.timeout_state_ != no_override ? run.timeout_state_ : timeout_state_);
     }
-    else if( tmout )
+    else
+    {
+      return (run.default_state_ != no_override ? run.default_state_ : default_state_);
+    }
+  }
+  
+  uint16_t
+  transition::execute(state_machine & sm,
+                      const trace_fun & trace,
+                      outcome * out,
+                      bool measure)
+  {
+    progress pr{0, 0, &no_description, false, false, false, false, false};
+    uint64_t started_ns = (measure ? latency_histogram::now_ns() : 0);
+    run_state run{this, sm, out != nullptr};
+    
+    if( program_.empty() )
     {
-      return timeout_state_;
+      if( FSM_TRACE_ON_(trace) )
+        trace(0, no_action, *this, sm);
     }
     else
     {
-      return default_state_;
+      run_program(pr, run, sm, trace, measure);
+    }
+    return conclude(pr, run, started_ns, sm, trace, out, measure);
+  }
+  
+  uint16_t
+  transition::resume(parked & p,
+                     state_machine & sm,
+                     const trace_fun & trace,
+                     outcome * out,
+                     bool measure)
+  {
+    if( p.trans_ != this || !p.cont_ )
+    {
+      THROW_("the parked transition belongs elsewhere or was resumed already");
+    }
+    
+    const op & o = program_[p.at_];
+    progress pr{p.at_, o.seqno_, o.description_, false, false, false, false, false};
+    run_state run{this, sm, out != nullptr};
+    run.copy(p.run_);
+    
+    action_status status = p.take();
+    p.cont_.reset();
+    if( FSM_TRACE_ON_(trace) )
+    {
+      std::string trace_str = *pr.last_desc_ + " [RESUMED]";
+      trace( pr.last_seqno_, trace_str, *this, sm );
     }
+    
+    switch( apply(status, run) )
+    {
+      case timeout:                   pr.tmout_ = true;     break;
+      case failed:                    pr.stopped_ = true;   break;
+      case action_result::finished:   pr.finished_ = true;  break;
+      default:
+        ++pr.at_;
+        run_program(pr, run, sm, trace, measure);
+        break;
+    };
+    return conclude(pr, run, p.started_ns_, sm, trace, out, measure);
   }
   
   const std::string &
@@ -271,6 +769,31 @@ namespace virtdb { namespace fsm {
     return description_;
   }
   
+  const transition_stats &
+  transition::stats() const
+  {
+    return stats_;
+  }
+  
+  void
+  transition::freeze()
+  {
+    frozen_ = true;
+  }
+  
+  bool
+  transition::frozen() const
+  {
+    return frozen_;
+  }
+  
+  const loop::stats *
+  transition::loop_stats() const
+  {
+    run_state * run = find_run();
+    return (run ? run->loop_stats_ : nullptr);
+  }
+  
   uint16_t
   transition::state() const
   {
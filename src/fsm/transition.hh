@@ -3,10 +3,13 @@
 #include <fsm/action.hh>
 #include <fsm/loop.hh>
 #include <fsm/timer.hh>
+#include <fsm/continuation.hh>
+#include <fsm/transition_stats.hh>
 #include <memory>
 #include <string>
 #include <functional>
 #include <map>
+#include <vector>
 
 namespace virtdb { namespace fsm {
   
@@ -24,29 +27,121 @@ namespace virtdb { namespace fsm {
     enum action_result {
       ok,
       failed,
-      timeout
+      timeout,
+      finished,   // an action chose the next state
+      suspended   // an action suspended the transition
     };
     
-    typedef std::function<action_result(uint16_t seqno,
-                                        transition & trans,
-                                        state_machine & sm,
-                                        trace_fun trace)> action_fun;
+    typedef timer::clock_type::time_point   time_point;
+    typedef timer::clock_type::rep          time_rep;
     
-    typedef std::function<const std::string & ()> seqno_desc;
+    enum {
+      no_override  = 0x10000,
+      max_timers   = 64,
+      no_timer     = 0xffff
+    };
+    
+    // the timers and the next state overrides of an execution. they
+    // are kept by their slot in a fixed array, the bitmasks tell which
+    // entries are valid, so nothing is allocated or cleared.
+    struct run_data
+    {
+      uint64_t              started_;   // functor timers, at_ is the start
+      uint64_t              armed_;     // deadline timers, at_ is the deadline
+      time_point            earliest_;  // of the armed deadlines
+      time_rep              at_[max_timers];
+      uint32_t              timeout_state_;
+      uint32_t              error_state_;
+      uint32_t              default_state_;
+      
+      time_point at(uint16_t slot) const;
+      
+      // copies the valid timers only
+      void copy(const run_data & other);
+    };
+    
+    // everything that changes while the transition executes. it lives
+    // on the stack of execute(), so the transition itself is not modified
+    // and can run for any number of machines on any number of threads.
+    struct run_state : run_data
+    {
+      const transition *          trans_;
+      run_state *                 prev_;
+      state_machine &             sm_;
+      bool                        parkable_;  // the caller takes parked transitions
+      const loop::stats *         loop_stats_;
+      continuation::state_ptr     cont_;      // of the suspending action
+      
+      run_state(const transition * trans,
+                state_machine & sm,
+                bool parkable);
+      ~run_state();
+    };
+    
+    // where execute() and resume() are in the program
+    struct progress
+    {
+      size_t                at_;
+      uint16_t              last_seqno_;
+      const std::string *   last_desc_;
+      bool                  tmout_;
+      bool                  stopped_;
+      bool                  thrown_;
+      bool                  finished_;
+      bool                  suspended_;
+    };
+    
+    enum step_kind {
+      action_step,
+      loop_step,
+      timer_step,
+      clear_step
+    };
+    
+    // what is at a seqno. the user functors are called through these
+    // directly, nothing is wrapped or copied while executing.
+    struct step
+    {
+      step_kind       kind_;
+      uint16_t        timer_at_;      // the cleared timer of clear steps
+      action::sptr    action_;
+      loop::sptr      loop_;
+      timer::sptr     timer_;
+      std::string     description_;   // of clear steps
+      
+      const std::string & description() const;
+    };
+    
+    typedef std::map<uint16_t, step>                            action_map;
     
-    typedef std::map<uint16_t, action_fun>                      action_map;
-    typedef std::map<uint16_t, timer::clock_type::time_point>   start_map;
-    typedef std::map<uint16_t, seqno_desc>                      desc_map;
+    // a step compiled for execution. the program is the steps in seqno
+    // order in one array, timers are numbered into slots of run_state.
+    struct op
+    {
+      step_kind               kind_;
+      uint16_t                seqno_;
+      uint16_t                timer_slot_;    // run or cleared, or no_timer
+      const std::string *     description_;
+      union {
+        action *              action_;
+        loop *                loop_;
+        timer *               timer_;
+      };
+    };
+    
+    typedef std::vector<op>                                     program;
     
     uint16_t                        state_;
     uint16_t                        event_;
     uint16_t                        timeout_state_;
     uint16_t                        error_state_;
     uint16_t                        default_state_;
+    bool                            frozen_;
     std::string                     description_;
     action_map                      all_actions_;
-    start_map                       starts_;
-    desc_map                        seqno_descs_;
+    program                         program_;
+    std::vector<uint16_t>           timer_ops_;   // op index by timer slot
+    transition_stats                stats_;
     
     // disable default construction
     transition() = delete;
@@ -55,14 +150,113 @@ namespace virtdb { namespace fsm {
     transition(const transition &) = delete;
     transition & operator=(const transition &) = delete;
     
-    bool timed_out(uint16_t seqno,
-                   state_machine & sm);
+    // the innermost execution of this transition on the calling thread
+    static run_state *& running();
+    run_state * find_run() const;
+    
+    bool timed_out(state_machine & sm,
+                   run_state & run);
+    
+    action_result apply(const action_status & status,
+                        run_state & run);
+    action_result run_step(const op & o,
+                           state_machine & sm,
+                           run_state & run,
+                           const trace_fun & trace);
+    action_result run_loop(uint16_t seqno,
+                           loop & l,
+                           state_machine & sm,
+                           run_state & run,
+                           const trace_fun & trace);
+    action_result run_timer(const op & o,
+                            state_machine & sm,
+                            run_state & run);
     
-    const std::string & seqno_description(uint16_t seqno);
+    static void arm_deadline(run_state & run,
+                             uint16_t slot,
+                             const time_point & at);
+    static void disarm(run_state & run,
+                       uint16_t slot);
+    
+    const std::string & seqno_description(uint16_t seqno) const;
+    void check_not_frozen() const;
+    step & add_step(uint16_t seqno, step_kind kind);
+    
+    // rebuilds program_ from all_actions_ after every change
+    void compile();
+    
+    // the steps from pr.at_ on
+    void run_program(progress & pr,
+                     run_state & run,
+                     state_machine & sm,
+                     const trace_fun & trace,
+                     bool measure);
     
   public:
+    // a transition suspended by one of its actions. its machine keeps it
+    // until the continuation is resumed or the earliest deadline timer of
+    // the transition expired, then passes it to resume().
+    class parked
+    {
+      friend class transition;
+      
+      transition *                trans_;
+      size_t                      at_;          // the suspended action
+      uint64_t                    started_ns_;
+      run_data                    run_;
+      continuation::state_ptr     cont_;
+      
+      // disable copying until properly implemented
+      parked(const parked &) = delete;
+      parked & operator=(const parked &) = delete;
+      
+      parked();
+      
+      // what the suspended action ended with, the continuation can't be
+      // resumed anymore afterwards
+      action_status take();
+      
+    public:
+      transition & trans() const;
+      bool ready() const;
+      
+      // the earliest deadline, if a deadline timer is running
+      bool has_deadline() const;
+      timer::clock_type::time_point deadline() const;
+      
+      virtual ~parked();
+    };
+    
     typedef std::shared_ptr<transition> sptr;
     
+    // how execute() ended
+    struct outcome
+    {
+      enum result_type {
+        ok,
+        timeout,
+        error,
+        exception,
+        suspended
+      };
+      
+      uint16_t                  seqno_;
+      result_type               result_;
+      std::unique_ptr<parked>   parked_;    // of a suspended transition
+    };
+    
+  private:
+    // the next state and the outcome once the steps stopped
+    uint16_t conclude(progress & pr,
+                      run_state & run,
+                      uint64_t started_ns,
+                      state_machine & sm,
+                      const trace_fun & trace,
+                      outcome * out,
+                      bool measure);
+    
+  public:
+    
     transition(uint16_t state,
                uint16_t event,
                uint16_t next_state,
@@ -77,14 +271,49 @@ namespace virtdb { namespace fsm {
     void set_timer(uint16_t seqno, timer::sptr t);
     void clear_timer(uint16_t seqno, uint16_t timer_at_seqno);
     
-    // set next states
+    // set next states. called by an action of this transition while it
+    // executes, they only override the next state of that execution.
+    // outside of an execution they change the transition itself, which
+    // is only allowed until it is frozen.
     void on_timeout_state(uint16_t nst);
     void on_error_state(uint16_t nst);
     void default_state(uint16_t nst);
     
+    // valid while the trace callback reports a finished loop
+    const loop::stats * loop_stats() const;
+    
+    // called by an action that starts an operation completing later. the
+    // action passes the continuation on and returns suspended, then the
+    // transition is parked in out->parked_ of execute() and the thread is
+    // free. timers of the transition keep running: the earliest deadline
+    // timer ends the transition in the timeout state unless resumed
+    // before, functor timers are asked when the transition goes on. only
+    // possible when execute() gets an outcome.
+    continuation suspend();
+    
     // do the transition and return next state
+    // measure: record the execution into stats()
+    // a suspended transition returns its own state with the suspended
+    // outcome, the state it ends in comes from resume()
     uint16_t execute(state_machine & sm,
-                     trace_fun trace);
+                     const trace_fun & trace,
+                     outcome * out=nullptr,
+                     bool measure=false);
+    
+    // goes on with a parked transition once it is ready
+    uint16_t resume(parked & p,
+                    state_machine & sm,
+                    const trace_fun & trace,
+                    outcome * out=nullptr,
+                    bool measure=false);
+    
+    const transition_stats & stats() const;
+    
+    // called by the definition that freezes it. the transition may run
+    // on any number of threads afterwards, so neither its steps nor its
+    // next states can be changed anymore.
+    void freeze();
+    bool frozen() const;
     
     virtual ~transition();
   };
@@ -0,0 +1,87 @@
+#include <fsm/transition_stats.hh>
+
+namespace virtdb { namespace fsm {
+  
+  transition_stats::transition_stats()
+  : executions_{0},
+    timeouts_{0},
+    errors_{0},
+    exceptions_{0}
+  {
+  }
+  
+  void
+  transition_stats::steps(const std::vector<uint16_t> & seqnos)
+  {
+    std::unique_ptr<step_counters[]> steps{new step_counters[seqnos.size()]};
+    for( size_t i=0, j=0; i<seqnos.size(); ++i )
+    {
+      // both are ordered by seqno
+      while( j < seqnos_.size() && seqnos_[j] < seqnos[i] )
+        ++j;
+      if( j < seqnos_.size() && seqnos_[j] == seqnos[i] )
+      {
+        steps[i].count_.store(steps_[j].count_.load(std::memory_order_relaxed),
+                              std::memory_order_relaxed);
+        steps[i].total_ns_.store(steps_[j].total_ns_.load(std::memory_order_relaxed),
+                                 std::memory_order_relaxed);
+      }
+    }
+    seqnos_ = seqnos;
+    steps_.swap(steps);
+  }
+  
+  void
+  transition_stats::record(uint64_t ns)
+  {
+    executions_.fetch_add(1, std::memory_order_relaxed);
+    latency_.record(ns);
+  }
+  
+  void
+  transition_stats::count_timeout()
+  {
+    timeouts_.fetch_add(1, std::memory_order_relaxed);
+  }
+  
+  void
+  transition_stats::count_error()
+  {
+    errors_.fetch_add(1, std::memory_order_relaxed);
+  }
+  
+  void
+  transition_stats::count_exception()
+  {
+    exceptions_.fetch_add(1, std::memory_order_relaxed);
+  }
+  
+  void
+  transition_stats::record_step(size_t index,
+                                uint64_t ns)
+  {
+    steps_[index].count_.fetch_add(1, std::memory_order_relaxed);
+    steps_[index].total_ns_.fetch_add(ns, std::memory_order_relaxed);
+  }
+  
+  void
+  transition_stats::take(snapshot & snap) const
+  {
+    snap.executions_  = executions_.load(std::memory_order_relaxed);
+    snap.timeouts_    = timeouts_.load(std::memory_order_relaxed);
+    snap.errors_      = errors_.load(std::memory_order_relaxed);
+    snap.exceptions_  = exceptions_.load(std::memory_order_relaxed);
+    latency_.take(snap.latency_);
+    
+    snap.steps_.clear();
+    for( size_t i=0; i<seqnos_.size(); ++i )
+    {
+      snap.steps_.push_back(step_snapshot{seqnos_[i],
+                                          steps_[i].count_.load(std::memory_order_relaxed),
+                                          steps_[i].total_ns_.load(std::memory_order_relaxed)});
+    }
+  }
+  
+  transition_stats::~transition_stats() {}
+  
+}}
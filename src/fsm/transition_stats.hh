@@ -0,0 +1,77 @@
+#pragma once
+
+#include <fsm/latency_histogram.hh>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace virtdb { namespace fsm {
+  
+  // execution statistics of one transition. the set of steps is fixed
+  // when the transition is configured, steps are recorded by their index
+  // in the step program. recording only uses relaxed atomics, so it
+  // never locks.
+  class transition_stats
+  {
+  public:
+    struct step_snapshot
+    {
+      uint16_t   seqno_;
+      uint64_t   count_;
+      uint64_t   total_ns_;
+    };
+    
+    struct snapshot
+    {
+      uint16_t                       state_;
+      uint16_t                       event_;
+      uint64_t                       executions_;
+      uint64_t                       timeouts_;
+      uint64_t                       errors_;
+      uint64_t                       exceptions_;
+      latency_histogram::snapshot    latency_;
+      std::vector<step_snapshot>     steps_;
+    };
+    
+  private:
+    typedef std::atomic<uint64_t> counter;
+    
+    struct step_counters
+    {
+      counter   count_;
+      counter   total_ns_;
+      
+      step_counters() : count_{0}, total_ns_{0} {}
+    };
+    
+    counter                            executions_;
+    counter                            timeouts_;
+    counter                            errors_;
+    counter                            exceptions_;
+    latency_histogram                  latency_;
+    std::vector<uint16_t>              seqnos_;
+    std::unique_ptr<step_counters[]>   steps_;
+    
+    // disable copying until properly implemented
+    transition_stats(const transition_stats &) = delete;
+    transition_stats & operator=(const transition_stats &) = delete;
+    
+  public:
+    transition_stats();
+    
+    // the seqnos of the step program in order. configuration time
+    // only, not thread safe. the steps that stay keep their counts.
+    void steps(const std::vector<uint16_t> & seqnos);
+    
+    void record(uint64_t ns);
+    void count_timeout();
+    void count_error();
+    void count_exception();
+    void record_step(size_t index, uint64_t ns);
+    void take(snapshot & snap) const;
+    
+    virtual ~transition_stats();
+  };
+  
+}}
@@ -0,0 +1,80 @@
+#include <fsm/work_deque.hh>
+
+namespace virtdb { namespace fsm {
+  
+  work_deque::buffer::buffer(int64_t capacity)
+  : mask_{capacity-1},
+    items_{new item[capacity]}
+  {
+  }
+  
+  work_deque::work_deque(uint32_t capacity)
+  : top_{0},
+    bottom_{0},
+    buffer_{nullptr}
+  {
+    int64_t cap = 2;
+    while( cap < capacity ) cap <<= 1;
+    
+    buffers_.push_back(buffer_uptr{new buffer{cap}});
+    buffer_.store(buffers_.back().get(), std::memory_order_relaxed);
+  }
+  
+  work_deque::buffer *
+  work_deque::grow(buffer * old,
+                   int64_t bottom,
+                   int64_t top)
+  {
+    buffers_.push_back(buffer_uptr{new buffer{(old->mask_+1)*2}});
+    buffer * fresh = buffers_.back().get();
+    for( int64_t i=top; i<bottom; ++i )
+      fresh->put(i, old->get(i));
+    buffer_.store(fresh, std::memory_order_release);
+    return fresh;
+  }
+  
+  void
+  work_deque::push(state_machine * sm)
+  {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    buffer * a = buffer_.load(std::memory_order_relaxed);
+    if( b-t > a->mask_ )
+      a = grow(a, b, t);
+    
+    a->put(b, sm);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b+1, std::memory_order_relaxed);
+  }
+  
+  state_machine *
+  work_deque::steal()
+  {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if( t >= b )
+      return nullptr;
+    
+    buffer * a = buffer_.load(std::memory_order_acquire);
+    state_machine * sm = a->get(t);
+    if( !top_.compare_exchange_strong(t, t+1,
+                                      std::memory_order_seq_cst,
+                                      std::memory_order_relaxed) )
+    {
+      return nullptr;
+    }
+    return sm;
+  }
+  
+  bool
+  work_deque::empty() const
+  {
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    int64_t t = top_.load(std::memory_order_acquire);
+    return t >= b;
+  }
+  
+  work_deque::~work_deque() {}
+  
+}}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace virtdb { namespace fsm {
+  
+  class state_machine;
+  
+  // Chase-Lev work stealing deque of scheduled machines. only the owner
+  // worker pushes, at the bottom. everyone takes from the top with a CAS,
+  // the owner included, so its own machines are served round robin.
+  // the buffer grows when full, old buffers are kept until destruction
+  // as a thief may still read them.
+  class work_deque
+  {
+    typedef std::atomic<state_machine *> item;
+    
+    struct buffer
+    {
+      int64_t                    mask_;
+      std::unique_ptr<item[]>    items_;
+      
+      buffer(int64_t capacity);
+      
+      state_machine * get(int64_t i) const
+      {
+        return items_[i & mask_].load(std::memory_order_relaxed);
+      }
+      
+      void put(int64_t i, state_machine * sm)
+      {
+        items_[i & mask_].store(sm, std::memory_order_relaxed);
+      }
+    };
+    
+    typedef std::unique_ptr<buffer> buffer_uptr;
+    
+    enum { cache_line = 64 };
+    
+    std::atomic<int64_t>       top_;
+    char                       pad0_[cache_line];
+    std::atomic<int64_t>       bottom_;
+    std::atomic<buffer *>      buffer_;
+    std::vector<buffer_uptr>   buffers_;
+    
+    buffer * grow(buffer * old, int64_t bottom, int64_t top);
+    
+    // disable copying until properly implemented
+    work_deque(const work_deque &) = delete;
+    work_deque & operator=(const work_deque &) = delete;
+    
+  public:
+    work_deque(uint32_t capacity=256);
+    
+    // owner only
+    void push(state_machine * sm);
+    
+    // any thread, nullptr when empty or when another taker won
+    state_machine * steal();
+    
+    bool empty() const;
+    
+    virtual ~work_deque();
+  };
+  
+}}
@@ -0,0 +1,718 @@
+#include <fsm/state_machine.hh>
+#include <fsm/executor.hh>
+#include <fsm/exception.hh>
+#include <fsm/static_machine.hh>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <map>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+using namespace virtdb::fsm;
+
+namespace virtdb { namespace bench {
+
+  typedef std::chrono::steady_clock clock_type;
+
+  double
+  seconds_since(const clock_type::time_point & start)
+  {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+  }
+
+  void
+  report(const std::string & name,
+         uint64_t count,
+         double seconds,
+         const char * unit="events/s")
+  {
+    std::cout << std::left << std::setw(40) << name
+              << std::right << std::setw(14) << std::fixed << std::setprecision(0)
+              << (count/seconds) << ' ' << unit << "\n";
+  }
+
+  // builds n_states*n_events transitions, every (state,event) pair is valid
+  // and leads to another state. event ids are multiplied by stride, so a
+  // large stride spreads them over the id space.
+  void
+  build_graph(state_machine & sm,
+              uint32_t n_states,
+              uint32_t n_events,
+              uint32_t stride)
+  {
+    for( uint32_t s=0; s<n_states; ++s )
+    {
+      for( uint32_t e=0; e<n_events; ++e )
+      {
+        uint16_t next = static_cast<uint16_t>((s*n_events+e+1)%n_states);
+        transition::sptr tr{new transition{uint16_t(s),uint16_t(e*stride),next,"TR"}};
+        sm.add_transition(tr);
+      }
+    }
+  }
+
+  double
+  run_dispatch(uint32_t n_states,
+               uint32_t n_events,
+               uint32_t stride,
+               bool freeze,
+               uint64_t count)
+  {
+    state_machine sm("BENCH");
+    build_graph(sm, n_states, n_events, stride);
+    if( freeze ) sm.freeze();
+
+    for( uint64_t i=0; i<count; ++i )
+      sm.enqueue(static_cast<uint16_t>((i%n_events)*stride));
+
+    auto start = clock_type::now();
+    sm.run(0);
+    return seconds_since(start);
+  }
+
+  void
+  dispatch()
+  {
+    struct graph { const char * name; uint32_t states, events, stride; };
+    graph graphs[] = {
+      { "10 transitions",          10,    1,    1 },
+      { "1k transitions",          100,   10,   1 },
+      { "1k transitions, sparse",  100,   10,   6007 },
+      { "60k transitions",         6000,  10,   6007 },
+    };
+
+    const uint64_t count = 1000000;
+    for( auto const & g : graphs )
+    {
+      report(std::string{"dispatch map   / "}+g.name,
+             count,
+             run_dispatch(g.states, g.events, g.stride, false, count));
+      report(std::string{"dispatch table / "}+g.name,
+             count,
+             run_dispatch(g.states, g.events, g.stride, true, count));
+    }
+  }
+
+  double
+  run_contention(const queue_options & qopts,
+                 uint32_t n_producers,
+                 uint64_t per_producer)
+  {
+    state_machine sm("BENCH", qopts);
+    
+    std::atomic<uint64_t> consumed{0};
+    transition::sptr tr{new transition{0,1,0,"TR"}};
+    action::sptr act{new action{[&consumed](uint16_t seqno,
+                                            transition & trans,
+                                            state_machine & sm){
+      consumed.fetch_add(1, std::memory_order_relaxed);
+    },"COUNT"}};
+    tr->set_action(1, act);
+    sm.add_transition(tr);
+    sm.freeze();
+    
+    uint64_t total = n_producers * per_producer;
+    auto start = clock_type::now();
+    
+    std::vector<std::thread> producers;
+    for( uint32_t p=0; p<n_producers; ++p )
+    {
+      producers.push_back(std::thread{[&sm,per_producer](){
+        for( uint64_t i=0; i<per_producer; ++i )
+          sm.enqueue(1);
+      }});
+    }
+    
+    while( consumed.load(std::memory_order_relaxed) < total )
+    {
+      sm.run(0);
+      std::this_thread::yield();
+    }
+    
+    for( auto & t : producers )
+      t.join();
+    
+    return seconds_since(start);
+  }
+  
+  void
+  contention()
+  {
+    const uint64_t total = 1000000;
+    for( uint32_t n : { 1, 2, 4, 8, 16, 32 } )
+    {
+      std::string threads = std::to_string(n) + " producers";
+      uint64_t per_producer = total/n;
+      report("contention locked    / "+threads,
+             n*per_producer,
+             run_contention(queue_options{queue_options::locked}, n, per_producer));
+      report("contention lock_free / "+threads,
+             n*per_producer,
+             run_contention(queue_options{queue_options::lock_free, 4096}, n, per_producer));
+    }
+  }
+
+  double
+  run_timed_loop(timer::sptr t,
+                 uint64_t iterations,
+                 uint32_t check_every=1)
+  {
+    state_machine sm("BENCH");
+    transition::sptr tr{new transition{0,1,0,"TR"}};
+    loop::sptr l{new loop{[iterations](uint16_t seqno,
+                                       transition & trans,
+                                       state_machine & sm,
+                                       uint64_t iteration) {
+      return iteration < iterations;
+    }, "LOOP", check_every}};
+    
+    tr->set_timer(1, t);
+    tr->set_timer(2, t);
+    tr->set_timer(3, t);
+    tr->set_loop(10, l);
+    sm.add_transition(tr);
+    sm.enqueue(1);
+    
+    auto start = clock_type::now();
+    sm.run(0);
+    return seconds_since(start);
+  }
+  
+  void
+  timers()
+  {
+    const uint64_t iterations = 1000000;
+    timer::sptr polled{new timer{[](uint16_t seqno,
+                                    transition & trans,
+                                    state_machine & sm,
+                                    const timer::clock_type::time_point & started_at) {
+      return timer::clock_type::now() < started_at+std::chrono::seconds(60);
+    }, "POLLED"}};
+    timer::sptr deadline{new timer{std::chrono::seconds(60), "DEADLINE"}};
+    
+    report("loop with 3 polled timers",
+           iterations,
+           run_timed_loop(polled, iterations),
+           "iterations/s");
+    report("loop with 3 deadline timers",
+           iterations,
+           run_timed_loop(deadline, iterations),
+           "iterations/s");
+    report("loop with 3 polled timers, check/64",
+           iterations,
+           run_timed_loop(polled, iterations, 64),
+           "iterations/s");
+  }
+
+  double
+  run_traced(state_machine::trace_fun trace_cb,
+             bool tracing,
+             uint64_t count)
+  {
+    state_machine sm("BENCH", trace_cb);
+    transition::sptr tr{new transition{0,1,0,"TR"}};
+    action::sptr act{new action{[](uint16_t seqno,
+                                   transition & trans,
+                                   state_machine & sm){},"ACT"}};
+    tr->set_action(1, act);
+    tr->set_action(2, act);
+    sm.add_transition(tr);
+    sm.tracing(tracing);
+    
+    for( uint64_t i=0; i<count; ++i )
+      sm.enqueue(1);
+    
+    auto start = clock_type::now();
+    sm.run(0);
+    return seconds_since(start);
+  }
+  
+  void
+  tracing()
+  {
+    const uint64_t count = 1000000;
+    auto noop = [](uint16_t seqno,
+                   const std::string & desc,
+                   const transition & trans,
+                   const state_machine & sm) {};
+    
+    report("trace / no callback", count, run_traced(state_machine::trace_fun{}, true, count));
+    report("trace / no-op callback", count, run_traced(noop, true, count));
+    report("trace / no-op callback, switched off", count, run_traced(noop, false, count));
+  }
+
+  double
+  run_recorded(bool record,
+               uint64_t count)
+  {
+    state_machine sm("BENCH");
+    build_graph(sm, 100, 10, 1);
+    sm.freeze();
+    if( record ) sm.binary_trace(4096);
+    
+    for( uint64_t i=0; i<count; ++i )
+      sm.enqueue(static_cast<uint16_t>(i%10));
+    
+    auto start = clock_type::now();
+    sm.run(0);
+    return seconds_since(start);
+  }
+  
+  void
+  recording()
+  {
+    const uint64_t count = 1000000;
+    double plain = run_recorded(false, count);
+    double recorded = run_recorded(true, count);
+    report("binary trace / off", count, plain);
+    report("binary trace / on", count, recorded);
+    std::cout << "binary trace overhead: "
+              << std::setprecision(1) << ((recorded-plain)*1e9/count)
+              << " ns/transition\n";
+  }
+
+  double
+  run_unhandled(state_machine::unhandled_policy policy,
+                uint64_t count)
+  {
+    auto noop = [](uint16_t seqno,
+                   const std::string & desc,
+                   const transition & trans,
+                   const state_machine & sm) {};
+    
+    state_machine sm("BENCH", noop);
+    transition::sptr tr{new transition{0,1,0,"TR"}};
+    sm.add_transition(tr);
+    sm.on_unhandled(policy);
+    sm.freeze();
+    
+    // nine of ten events have no transition
+    for( uint64_t i=0; i<count; ++i )
+      sm.enqueue(static_cast<uint16_t>(i%10+1));
+    
+    auto start = clock_type::now();
+    sm.run(0);
+    return seconds_since(start);
+  }
+  
+  void
+  unhandled()
+  {
+    const uint64_t count = 1000000;
+    report("unhandled / trace", count, run_unhandled(machine_definition::trace_unhandled, count));
+    report("unhandled / count", count, run_unhandled(machine_definition::count_unhandled, count));
+    report("unhandled / ignore", count, run_unhandled(machine_definition::ignore_unhandled, count));
+  }
+
+  double
+  run_executor(uint32_t n_machines,
+               uint32_t n_workers,
+               uint32_t seeds,
+               uint16_t hops)
+  {
+    // every event hops on to another machine until it did all its hops,
+    // so the work spreads from the seeding thread over all the workers
+    std::vector<machine_instance::sptr> machines;
+    machine_definition::sptr def{new machine_definition{"BENCH"}};
+    action::sptr act{new action{[&machines,hops](uint16_t seqno,
+                                                 transition & trans,
+                                                 state_machine & sm){
+      uint16_t ev = trans.event();
+      if( ev < hops )
+        machines[(sm.id()*31+ev) % machines.size()]->enqueue(ev+1);
+    },"HOP"}};
+    for( uint16_t h=1; h<=hops; ++h )
+    {
+      transition::sptr tr{new transition{0,h,0,"TR"}};
+      tr->set_action(1, act);
+      def->add_transition(tr);
+    }
+    def->freeze();
+    
+    machines.reserve(n_machines);
+    for( uint32_t i=0; i<n_machines; ++i )
+      machines.push_back(machine_instance::sptr{new machine_instance{def}});
+    
+    executor exec{n_workers, 64};
+    for( auto & sm : machines )
+      exec.add(sm);
+    
+    auto start = clock_type::now();
+    for( uint32_t s=0; s<seeds; ++s )
+      for( auto & sm : machines )
+        sm->enqueue(1);
+    exec.wait_idle();
+    return seconds_since(start);
+  }
+  
+  void
+  executor_scaling()
+  {
+    const uint16_t hops = 8;
+    const uint64_t seeded = 1000000;
+    uint32_t cores = std::thread::hardware_concurrency();
+    std::cout << "executor: " << cores << " hardware threads\n";
+    
+    for( uint32_t n_machines : { 1000, 1000000 } )
+    {
+      for( uint32_t n_workers : { 1, 2, 4, 8, 16, 32, 64 } )
+      {
+        uint32_t seeds = static_cast<uint32_t>(seeded/n_machines);
+        report("executor / "+std::to_string(n_machines)+" machines, "+
+               std::to_string(n_workers)+" workers",
+               uint64_t(seeds)*n_machines*hops,
+               run_executor(n_machines, n_workers, seeds, hops));
+      }
+    }
+  }
+
+  void
+  wakeup()
+  {
+    // latency from enqueue() to the action on a machine parked in
+    // run_forever(), one event at a time
+    const uint32_t count = 10000;
+    std::atomic<uint64_t> sent_ns{0};
+    std::atomic<uint32_t> done{0};
+    latency_histogram latency;
+    
+    state_machine sm("BENCH");
+    transition::sptr tr{new transition{0,1,0,"TR"}};
+    action::sptr act{new action{[&](uint16_t seqno,
+                                    transition & trans,
+                                    state_machine & sm){
+      latency.record(latency_histogram::now_ns()-sent_ns.load());
+      ++done;
+    },"WAKE"}};
+    tr->set_action(1, act);
+    sm.add_transition(tr);
+    sm.freeze();
+    
+    stop_token stop;
+    std::thread consumer{[&sm,&stop]() { sm.run_forever(0, stop); }};
+    
+    for( uint32_t i=0; i<count; ++i )
+    {
+      // give the consumer time to park
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+      sent_ns = latency_histogram::now_ns();
+      sm.enqueue(1);
+      while( done.load() <= i )
+        std::this_thread::yield();
+    }
+    stop.request_stop();
+    consumer.join();
+    
+    latency_histogram::snapshot snap;
+    latency.take(snap);
+    std::cout << "wakeup latency p50/p99/max: "
+              << snap.percentile(0.5)/1000.0 << "/"
+              << snap.percentile(0.99)/1000.0 << "/"
+              << snap.max_ns_/1000.0 << " us\n";
+  }
+
+  double
+  run_control_wait(uint8_t priorities,
+                   uint64_t backlog)
+  {
+    // a control event arrives behind a backlog of data events, measure
+    // how long it waits until its transition runs
+    uint64_t sent_ns = 0;
+    uint64_t waited_ns = 0;
+    state_machine sm("BENCH", queue_options{queue_options::locked, 1024, priorities});
+    transition::sptr data{new transition{0,1,0,"DATA"}};
+    transition::sptr control{new transition{0,2,0,"CONTROL"}};
+    action::sptr act{new action{[&](uint16_t seqno,
+                                    transition & trans,
+                                    state_machine & sm){
+      waited_ns = latency_histogram::now_ns()-sent_ns;
+    },"STOP"}};
+    control->set_action(1, act);
+    sm.add_transition(data);
+    sm.add_transition(control);
+    sm.freeze();
+    
+    for( uint64_t i=0; i<backlog; ++i )
+      sm.enqueue(1);
+    sent_ns = latency_histogram::now_ns();
+    sm.enqueue(2, control_priority);
+    sm.run(0);
+    return waited_ns/1000.0;
+  }
+  
+  void
+  priorities()
+  {
+    const uint64_t backlog = 100000;
+    std::cout << "control event behind " << backlog << " data events, 1 class:   "
+              << std::fixed << std::setprecision(1) << run_control_wait(1, backlog) << " us\n";
+    std::cout << "control event behind " << backlog << " data events, 4 classes: "
+              << std::fixed << std::setprecision(1) << run_control_wait(4, backlog) << " us\n";
+  }
+
+  void
+  delayed()
+  {
+    // insert and cancel with a million pending timers
+    const uint32_t count = 1000000;
+    {
+      state_machine sm("BENCH");
+      std::vector<timer_handle> handles;
+      handles.reserve(count);
+      uint64_t seed = 0x9e3779b97f4a7c15ULL;
+      
+      auto start = clock_type::now();
+      for( uint32_t i=0; i<count; ++i )
+      {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        handles.push_back(sm.enqueue_after(1, std::chrono::milliseconds(1000 + seed % 60000)));
+      }
+      report("delayed / enqueue_after, 1M pending", count, seconds_since(start), "timers/s");
+      
+      start = clock_type::now();
+      for( auto & h : handles )
+        h.cancel();
+      report("delayed / cancel, 1M pending", count, seconds_since(start), "timers/s");
+    }
+    
+    // how late the events arrive, spread over half a second
+    const uint16_t fired = 50000;
+    std::vector<clock_type::time_point> due(fired);
+    std::atomic<uint32_t> done{0};
+    latency_histogram late;
+    state_machine sm("BENCH");
+    sm.on_unhandled([&](uint16_t state, uint16_t event, state_machine & sm) {
+      late.record(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now()-due[event]).count());
+      ++done;
+    });
+    sm.freeze();
+    
+    stop_token stop;
+    std::thread consumer{[&sm,&stop]() { sm.run_forever(0, stop); }};
+    auto start = clock_type::now();
+    for( uint16_t i=0; i<fired; ++i )
+    {
+      due[i] = start + std::chrono::microseconds(100000 + (i*7919) % 500000);
+      sm.enqueue_at(i, due[i]);
+    }
+    while( done.load() < fired )
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    stop.request_stop();
+    consumer.join();
+    
+    latency_histogram::snapshot snap;
+    late.take(snap);
+    std::cout << "delayed / lateness p50/p99/max: "
+              << std::fixed << std::setprecision(1)
+              << snap.percentile(0.5)/1000.0 << "/"
+              << snap.percentile(0.99)/1000.0 << "/"
+              << snap.max_ns_/1000.0 << " us\n";
+  }
+
+  double
+  run_chain(bool chained,
+            uint64_t hops)
+  {
+    // one event walks a ring of states, each transition passes it on
+    const uint16_t n_states = 16;
+    state_machine sm("BENCH");
+    uint64_t left = hops;
+    action::sptr pass{new action{[&left,chained](uint16_t seqno,
+                                                 transition & trans,
+                                                 state_machine & sm){
+      if( --left == 0 )
+        return;
+      if( chained )
+        sm.chain(1);
+      else
+        sm.enqueue(1);
+    },"PASS"}};
+    for( uint16_t st=0; st<n_states; ++st )
+    {
+      transition::sptr tr{new transition{st,1,uint16_t((st+1)%n_states),"HOP"}};
+      tr->set_action(1, pass);
+      sm.add_transition(tr);
+    }
+    sm.freeze();
+    
+    sm.enqueue(1);
+    auto start = clock_type::now();
+    sm.run(0);
+    return seconds_since(start);
+  }
+  
+  void
+  chaining()
+  {
+    const uint64_t hops = 1000000;
+    report("chaining / enqueue", hops, run_chain(false, hops));
+    report("chaining / chain", hops, run_chain(true, hops));
+  }
+  
+  // the ring of run_chain() as a static machine
+  struct ring_context
+  {
+    uint64_t   left_;
+    bool       chained_;
+  };
+  
+  struct ring_hop
+  {
+    template <typename M> void operator()(M & sm) const
+    {
+      if( --sm.context().left_ && sm.context().chained_ )
+        sm.chain(1);
+    }
+  };
+  
+  template <uint16_t STATE>
+  using ring_row = row<STATE, 1, (STATE+1)%16, ring_hop>;
+  
+  typedef static_machine<ring_context,
+                         ring_row<0>,  ring_row<1>,  ring_row<2>,  ring_row<3>,
+                         ring_row<4>,  ring_row<5>,  ring_row<6>,  ring_row<7>,
+                         ring_row<8>,  ring_row<9>,  ring_row<10>, ring_row<11>,
+                         ring_row<12>, ring_row<13>, ring_row<14>, ring_row<15>> ring_machine;
+  
+  double
+  run_static_ring(bool chained,
+                  uint64_t hops)
+  {
+    ring_machine sm;
+    sm.context().left_     = hops;
+    sm.context().chained_  = chained;
+    
+    std::vector<uint16_t> events(chained ? 1 : hops, 1);
+    sm.enqueue_bulk(events.data(), events.size());
+    auto start = clock_type::now();
+    sm.run(0);
+    return seconds_since(start);
+  }
+  
+  double
+  run_runtime_ring(bool chained,
+                   uint64_t hops)
+  {
+    const uint16_t n_states = 16;
+    state_machine sm("BENCH");
+    uint64_t left = hops;
+    action::sptr hop{new action{[&left,chained](uint16_t seqno,
+                                                transition & trans,
+                                                state_machine & sm){
+      if( --left && chained )
+        sm.chain(1);
+    },"HOP"}};
+    for( uint16_t st=0; st<n_states; ++st )
+    {
+      transition::sptr tr{new transition{st,1,uint16_t((st+1)%n_states),"HOP"}};
+      tr->set_action(1, hop);
+      sm.add_transition(tr);
+    }
+    sm.freeze();
+    
+    std::vector<uint16_t> events(chained ? 1 : hops, 1);
+    sm.enqueue_bulk(events.data(), events.size());
+    auto start = clock_type::now();
+    sm.run(0);
+    return seconds_since(start);
+  }
+  
+  void
+  static_vs_runtime()
+  {
+    const uint64_t hops = 1000000;
+    report("ring / state_machine, queued", hops, run_runtime_ring(false, hops));
+    report("ring / static_machine, queued", hops, run_static_ring(false, hops));
+    report("ring / state_machine, chained", hops, run_runtime_ring(true, hops));
+    report("ring / static_machine, chained", hops, run_static_ring(true, hops));
+  }
+  
+  // failing actions: 0 -1-> 0 through the error state, every time
+  double
+  run_failures(bool thrown,
+               uint64_t count)
+  {
+    state_machine sm("BENCH");
+    transition::sptr tr{new transition{0,1,1,"FAIL"}};
+    tr->on_error_state(0);
+    if( thrown )
+    {
+      tr->set_action(1, action::sptr{new action{[](uint16_t seqno,
+                                                   transition & trans,
+                                                   state_machine & sm){
+        THROW_("failed");
+      },"THROW"}});
+    }
+    else
+    {
+      tr->set_action(1, action::sptr{new action{[](uint16_t seqno,
+                                                   transition & trans,
+                                                   state_machine & sm){
+        return action_status::failed;
+      },"RETURN"}});
+    }
+    sm.add_transition(tr);
+    sm.freeze();
+    
+    std::vector<uint16_t> events(count, 1);
+    sm.enqueue_bulk(events.data(), events.size());
+    auto start = clock_type::now();
+    if( sm.run(0) != 0 )
+      std::cerr << "unexpected state after failures\n";
+    return seconds_since(start);
+  }
+  
+  void
+  failures()
+  {
+    const uint64_t count = 200000;
+    report("failures / throw", count, run_failures(true, count));
+    report("failures / return", count, run_failures(false, count));
+  }
+
+}}
+
+using namespace virtdb::bench;
+
+int main(int argc, char ** argv)
+{
+  typedef void (*bench_fun)();
+  std::map<std::string, bench_fun> benches{
+    { "dispatch",    dispatch },
+    { "contention",  contention },
+    { "timers",      timers },
+    { "tracing",     tracing },
+    { "recording",   recording },
+    { "unhandled",   unhandled },
+    { "executor",    executor_scaling },
+    { "wakeup",      wakeup },
+    { "priorities",  priorities },
+    { "delayed",     delayed },
+    { "chaining",    chaining },
+    { "static",      static_vs_runtime },
+    { "failures",    failures },
+  };
+
+  // run the named benchmarks, or all of them if none given
+  if( argc < 2 )
+  {
+    for( auto const & b : benches )
+      b.second();
+    return 0;
+  }
+
+  for( int i=1; i<argc; ++i )
+  {
+    auto it = benches.find(argv[i]);
+    if( it == benches.end() )
+    {
+      std::cerr << "unknown benchmark: " << argv[i] << "\n";
+      return 1;
+    }
+    it->second();
+  }
+  return 0;
+}
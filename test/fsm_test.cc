@@ -1,10 +1,21 @@
 #include <gtest/gtest.h>
 #include <fsm/state_machine.hh>
 #include <fsm/exception.hh>
+#include <fsm/lock_free_queue.hh>
+#include <fsm/executor.hh>
+#include <fsm/static_machine.hh>
+#include <algorithm>
+#include <condition_variable>
 #include <future>
 #include <iostream>
 #include <string.h>
 #include <map>
+#include <mutex>
+#include <new>
+#include <cstdlib>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 using namespace virtdb::fsm;
 
@@ -12,6 +23,10 @@ namespace virtdb { namespace test {
   
   class FsmTest : public ::testing::Test { };
   
+  // heap allocations made by the calling thread
+  thread_local uint64_t allocations = 0;
+  thread_local uint64_t allocated_bytes = 0;
+  
   auto trace = [](uint16_t seqno,
                   const std::string & desc,
                   const transition & trans,
@@ -27,6 +42,28 @@ namespace virtdb { namespace test {
 
 using namespace virtdb::test;
 
+// none of these are inlined, so the compiler doesn't pair the malloc()
+// and free() with new and delete expressions and warn about a mismatch
+__attribute__((noinline)) void * operator new(size_t size)
+{
+  ++allocations;
+  allocated_bytes += size;
+  void * p = ::malloc(size ? size : 1);
+  if( !p )
+    throw std::bad_alloc();
+  return p;
+}
+
+__attribute__((noinline)) void operator delete(void * p) noexcept
+{
+  ::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void * p, size_t size) noexcept
+{
+  ::free(p);
+}
+
 TEST_F(FsmTest, EmptyFsm)
 {
   state_machine sm("TEST");
@@ -238,6 +275,2544 @@ TEST_F(FsmTest, OneTransitionException)
   EXPECT_EQ(terminal_state, 11);
 }
 
+TEST_F(FsmTest, FrozenDenseDispatch)
+{
+  state_machine sm("TEST");
+  
+  transition::sptr tr1{new transition{0,1,1,"TR1"}};
+  transition::sptr tr2{new transition{1,2,2,"TR2"}};
+  sm.add_transition(tr1);
+  sm.add_transition(tr2);
+  sm.freeze();
+  EXPECT_TRUE(sm.frozen());
+  
+  // the unknown event in the middle is skipped
+  sm.enqueue(1);
+  sm.enqueue(7);
+  sm.enqueue(2);
+  EXPECT_EQ(sm.run(0), 2);
+}
+
+TEST_F(FsmTest, FrozenSparseDispatch)
+{
+  state_machine sm("TEST");
+  
+  // widely spread ids force the hashed table
+  uint16_t states[] = { 0, 1000, 30000, 65535 };
+  for( int i=0; i<3; ++i )
+  {
+    transition::sptr tr{new transition{states[i],uint16_t(states[i+1]^0x5a5a),states[i+1],"TR"}};
+    sm.add_transition(tr);
+  }
+  sm.freeze();
+  
+  for( int i=0; i<3; ++i )
+    sm.enqueue(states[i+1]^0x5a5a);
+  EXPECT_EQ(sm.run(0), 65535);
+  
+  sm.enqueue(1);
+  EXPECT_EQ(sm.run(65535), 65535);
+}
+
+TEST_F(FsmTest, AddTransitionAfterFreeze)
+{
+  state_machine sm("TEST");
+  sm.freeze();
+  transition::sptr tr1{new transition{0,1,1,"TR1"}};
+  EXPECT_THROW(sm.add_transition(tr1), virtdb::fsm::exception);
+}
+
+TEST_F(FsmTest, LockFreeQueueWrapAround)
+{
+  lock_free_queue q{4};
+  queued_event ev{0, 0};
+  
+  EXPECT_EQ(q.capacity(), 4);
+  for( uint16_t round=0; round<10; ++round )
+  {
+    for( uint16_t i=0; i<4; ++i )
+      EXPECT_TRUE(q.try_push(queued_event{uint16_t(round*4+i), 0}));
+    EXPECT_FALSE(q.try_push(queued_event{999, 0}));
+    EXPECT_EQ(q.size(), 4);
+    
+    for( uint16_t i=0; i<4; ++i )
+    {
+      EXPECT_TRUE(q.pop(ev));
+      EXPECT_EQ(ev.event_, round*4+i);
+    }
+    EXPECT_FALSE(q.pop(ev));
+  }
+}
+
+TEST_F(FsmTest, LockFreeQueueProducerOrder)
+{
+  // every producer sends a strictly increasing sequence in its own
+  // event range, the consumer checks the order per producer
+  const uint16_t n_producers = 4;
+  const uint16_t per_producer = 10000;
+  lock_free_queue q{64};
+  
+  std::vector<std::thread> producers;
+  for( uint16_t p=0; p<n_producers; ++p )
+  {
+    producers.push_back(std::thread{[&q,p,per_producer](){
+      for( uint16_t i=0; i<per_producer; ++i )
+        q.push(queued_event{uint16_t(p*per_producer+i), 0});
+    }});
+  }
+  
+  std::vector<int> last(n_producers, -1);
+  uint32_t received = 0;
+  queued_event ev{0, 0};
+  while( received < n_producers*per_producer )
+  {
+    if( !q.pop(ev) )
+    {
+      std::this_thread::yield();
+      continue;
+    }
+    int p = ev.event_ / per_producer;
+    int i = ev.event_ % per_producer;
+    EXPECT_EQ(last[p]+1, i);
+    last[p] = i;
+    ++received;
+  }
+  
+  for( auto & t : producers )
+    t.join();
+  EXPECT_EQ(q.size(), 0);
+}
+
+TEST_F(FsmTest, LockFreeStateMachine)
+{
+  state_machine sm("TEST", queue_options{queue_options::lock_free, 16});
+  
+  transition::sptr tr1{new transition{0,1,1,"TR1"}};
+  transition::sptr tr2{new transition{1,2,2,"TR2"}};
+  sm.add_transition(tr1);
+  sm.add_transition(tr2);
+  
+  sm.enqueue(1);
+  sm.enqueue_unique(2);
+  sm.enqueue_unique(2);
+  sm.enqueue_if_empty(1);
+  EXPECT_TRUE(sm.queue_has(2));
+  EXPECT_EQ(sm.queue_size(), 2);
+  EXPECT_EQ(sm.run(0), 2);
+  EXPECT_EQ(sm.queue_size(), 0);
+}
+
+TEST_F(FsmTest, QueueOccupancy)
+{
+  for( auto kind : { queue_options::locked, queue_options::lock_free } )
+  {
+    state_machine sm("TEST", queue_options{kind, 1024});
+    transition::sptr tr1{new transition{0,1,0,"TR1"}};
+    sm.add_transition(tr1);
+    
+    for( int i=0; i<500; ++i )
+      sm.enqueue(1);
+    sm.enqueue_unique(40000);
+    sm.enqueue_unique(40000);
+    sm.enqueue_if_empty(2);
+    
+    EXPECT_EQ(sm.queue_size(), 501);
+    EXPECT_TRUE(sm.queue_has(1));
+    EXPECT_TRUE(sm.queue_has(40000));
+    EXPECT_FALSE(sm.queue_has(2));
+    
+    sm.run(0);
+    EXPECT_EQ(sm.queue_size(), 0);
+    EXPECT_FALSE(sm.queue_has(1));
+    EXPECT_FALSE(sm.queue_has(40000));
+    
+    // once drained the unique and the if-empty path both push again
+    sm.enqueue_if_empty(2);
+    sm.enqueue_unique(40000);
+    EXPECT_EQ(sm.queue_size(), 2);
+  }
+}
+
+TEST_F(FsmTest, ConcurrentEnqueueUnique)
+{
+  state_machine sm("TEST", queue_options{queue_options::lock_free, 64});
+  
+  std::vector<std::thread> producers;
+  for( int p=0; p<8; ++p )
+  {
+    producers.push_back(std::thread{[&sm](){
+      for( uint16_t i=0; i<1000; ++i )
+        sm.enqueue_unique(i%16);
+    }});
+  }
+  for( auto & t : producers )
+    t.join();
+  
+  EXPECT_EQ(sm.queue_size(), 16);
+}
+
+namespace virtdb { namespace test {
+  
+  // enqueues more events than the lock free ring of its machine holds
+  struct overfill
+  {
+    template <typename M> void operator()(M & sm) const
+    {
+      sm.enqueue_bulk({3, 3, 3, 3, 3});
+      sm.enqueue(3);
+      sm.enqueue_unique(2);
+    }
+  };
+  
+}}
+
+TEST_F(FsmTest, LockFreeQueueOverfilledByAction)
+{
+  // the machine can't wait for itself to make room in its ring
+  state_machine sm("TEST", queue_options{queue_options::lock_free, 4});
+  uint32_t received = 0;
+  transition::sptr tr1{new transition{0,1,1,"TR1"}};
+  transition::sptr tr2{new transition{1,2,1,"TR2"}};
+  action::sptr fill{new action{[](uint16_t seqno,
+                                  transition & trans,
+                                  state_machine & sm){
+    for( int i=0; i<5; ++i )
+      sm.enqueue(2);
+    sm.enqueue_bulk({2, 2, 2, 2, 2, 2});
+  },"FILL"}};
+  action::sptr count{new action{[&received](uint16_t seqno,
+                                            transition & trans,
+                                            state_machine & sm){
+    ++received;
+  },"COUNT"}};
+  tr1->set_action(1, fill);
+  tr2->set_action(1, count);
+  sm.add_transition(tr1);
+  sm.add_transition(tr2);
+  
+  sm.enqueue(1);
+  EXPECT_EQ(sm.run(0), 1);
+  EXPECT_EQ(received, 11);
+  EXPECT_EQ(sm.queue_size(), 0);
+  
+  // nor can the timer thread, which serves the other machines too
+  state_machine full("FULL", queue_options{queue_options::lock_free, 4});
+  state_machine other("OTHER");
+  for( int i=0; i<4; ++i )
+    full.enqueue(2);
+  full.enqueue_after(2, std::chrono::milliseconds(1));
+  other.enqueue_after(1, std::chrono::milliseconds(5));
+  for( int i=0; i<5000 && !other.queue_has(1); ++i )
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_TRUE(other.queue_has(1));
+  EXPECT_EQ(full.queue_size(), 5);
+  full.run(0);
+  EXPECT_EQ(full.queue_size(), 0);
+  
+  // the same for the static front end
+  typedef static_machine<no_context,
+                         row<0, 1, 1, overfill>,
+                         row<1, 3, 1>,
+                         row<1, 2, 2>> overfilling_machine;
+  overfilling_machine lf{queue_options{queue_options::lock_free, 4}};
+  lf.enqueue(1);
+  EXPECT_EQ(lf.run(), 2);
+  EXPECT_EQ(lf.unhandled_count(), 0);
+  EXPECT_EQ(lf.queue_size(), 0);
+}
+
+TEST_F(FsmTest, EnqueueBulk)
+{
+  for( auto kind : { queue_options::locked, queue_options::lock_free } )
+  {
+    state_machine sm("TEST", queue_options{kind, 8});
+    
+    // the path through the states is only valid in the enqueued order
+    for( uint16_t s=0; s<100; ++s )
+    {
+      transition::sptr tr{new transition{s,uint16_t(s+1000),uint16_t(s+1),"TR"}};
+      sm.add_transition(tr);
+    }
+    
+    std::vector<uint16_t> events;
+    for( uint16_t s=0; s<100; ++s )
+      events.push_back(s+1000);
+    
+    // larger than the lock free queue, pushed in capacity sized chunks
+    std::thread producer{[&sm,&events](){
+      sm.enqueue_bulk(events.data(), events.size());
+    }};
+    
+    uint16_t state = 0;
+    while( state < 100 )
+      state = sm.run(state);
+    producer.join();
+    
+    EXPECT_EQ(state, 100);
+    EXPECT_EQ(sm.queue_size(), 0);
+    
+    sm.enqueue_bulk({1000, 1001, 1002});
+    EXPECT_EQ(sm.queue_size(), 3);
+    EXPECT_EQ(sm.run(0), 3);
+  }
+}
+
+TEST_F(FsmTest, StagedActionEvents)
+{
+  state_machine sm("TEST");
+  
+  transition::sptr tr1{new transition{0,1,1,"TR1"}};
+  transition::sptr tr2{new transition{1,2,2,"TR2"}};
+  transition::sptr tr3{new transition{2,3,3,"TR3"}};
+  
+  uint64_t size_in_action = 0;
+  bool has_in_action = false;
+  action::sptr act1{new action{[&](uint16_t seqno,
+                                   transition & trans,
+                                   state_machine & sm){
+    sm.enqueue(2);
+    sm.enqueue_unique(3);
+    sm.enqueue_unique(3);
+    // staged events are already visible to the queue queries
+    size_in_action = sm.queue_size();
+    has_in_action = sm.queue_has(3);
+  },"ACT1"}};
+  tr1->set_action(1, act1);
+  
+  sm.add_transition(tr1);
+  sm.add_transition(tr2);
+  sm.add_transition(tr3);
+  
+  sm.enqueue(1);
+  EXPECT_EQ(sm.run(0), 3);
+  EXPECT_EQ(size_in_action, 2);
+  EXPECT_TRUE(has_in_action);
+}
+
+TEST_F(FsmTest, DeadlineTimerLoop)
+{
+  state_machine sm("TEST",trace);
+  
+  transition::sptr tr1{new transition{0,1,0,"TR1"}};
+  
+  tr1->default_state(10);
+  tr1->on_error_state(11);
+  tr1->on_timeout_state(12);
+  
+  loop::sptr l1{new loop{[](uint16_t seqno,
+                            transition & trans,
+                            state_machine & sm,
+                            uint64_t iteration) {
+    // loop forever, timeout supposed to catch this issue
+    return true;
+  }, "LOOP1"}};
+  
+  timer::sptr t1{new timer{std::chrono::milliseconds(50), "TIMER1"}};
+  
+  tr1->set_timer(11, t1);
+  tr1->set_loop(33, l1);
+  
+  sm.add_transition(tr1);
+  sm.enqueue(1);
+  
+  EXPECT_EQ(sm.run(0), 12);
+}
+
+TEST_F(FsmTest, ClearedTimersStayCleared)
+{
+  state_machine sm("TEST",trace);
+  
+  transition::sptr tr1{new transition{0,1,0,"TR1"}};
+  
+  tr1->default_state(10);
+  tr1->on_error_state(11);
+  tr1->on_timeout_state(12);
+  
+  timer::sptr t1{new timer{std::chrono::milliseconds(20), "TIMER1"}};
+  timer::sptr t2{new timer{[](uint16_t seqno,
+                              transition & trans,
+                              state_machine & sm,
+                              const timer::clock_type::time_point & started_at) {
+    return timer::clock_type::now() < started_at+std::chrono::milliseconds(20);
+  }, "TIMER2"}};
+  
+  // the slow action runs after both timers are cleared
+  action::sptr slow{new action{[](uint16_t seqno,
+                                  transition & trans,
+                                  state_machine & sm){
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  },"SLOW"}};
+  
+  tr1->set_timer(11, t1);
+  tr1->set_timer(12, t2);
+  tr1->clear_timer(21, 11);
+  tr1->clear_timer(22, 12);
+  tr1->set_action(30, slow);
+  
+  sm.add_transition(tr1);
+  sm.enqueue(1);
+  
+  EXPECT_EQ(sm.run(0), 10);
+}
+
+TEST_F(FsmTest, LoopCheckEvery)
+{
+  loop::stats reported{0, 0, loop::clock_type::duration::zero(), false};
+  state_machine sm("TEST",[&reported](uint16_t seqno,
+                                      const std::string & desc,
+                                      const transition & trans,
+                                      const state_machine & sm) {
+    if( trans.loop_stats() )
+      reported = *trans.loop_stats();
+  });
+  
+  transition::sptr tr1{new transition{0,1,10,"TR1"}};
+  tr1->on_timeout_state(12);
+  
+  loop::sptr l1{new loop{[](uint16_t seqno,
+                            transition & trans,
+                            state_machine & sm,
+                            uint64_t iteration) {
+    return iteration < 999;
+  }, "LOOP1", 100}};
+  
+  timer::sptr t1{new timer{std::chrono::seconds(10), "TIMER1"}};
+  tr1->set_timer(11, t1);
+  tr1->set_loop(33, l1);
+  sm.add_transition(tr1);
+  sm.enqueue(1);
+  
+  EXPECT_EQ(sm.run(0), 10);
+  EXPECT_EQ(reported.iterations_, 999);
+  EXPECT_EQ(reported.timeout_checks_, 10);
+  EXPECT_FALSE(reported.timed_out_);
+  EXPECT_GT(reported.elapsed_.count(), 0);
+}
+
+TEST_F(FsmTest, AdaptiveLoopTimeout)
+{
+  loop::stats reported{0, 0, loop::clock_type::duration::zero(), false};
+  state_machine sm("TEST",[&reported](uint16_t seqno,
+                                      const std::string & desc,
+                                      const transition & trans,
+                                      const state_machine & sm) {
+    if( trans.loop_stats() )
+      reported = *trans.loop_stats();
+  });
+  
+  transition::sptr tr1{new transition{0,1,10,"TR1"}};
+  tr1->on_timeout_state(12);
+  
+  // loop forever, timeout supposed to catch this issue
+  loop::sptr l1{new loop{[](uint16_t seqno,
+                            transition & trans,
+                            state_machine & sm,
+                            uint64_t iteration) {
+    return true;
+  }, "LOOP1", std::chrono::milliseconds(5)}};
+  
+  timer::sptr t1{new timer{std::chrono::milliseconds(50), "TIMER1"}};
+  tr1->set_timer(11, t1);
+  tr1->set_loop(33, l1);
+  sm.add_transition(tr1);
+  sm.enqueue(1);
+  
+  EXPECT_EQ(sm.run(0), 12);
+  EXPECT_TRUE(reported.timed_out_);
+  EXPECT_LT(reported.timeout_checks_, reported.iterations_/10);
+  EXPECT_LT(reported.elapsed_, std::chrono::milliseconds(500));
+}
+
+TEST_F(FsmTest, TracingSwitch)
+{
+  uint64_t calls = 0;
+  state_machine sm("TEST",[&calls](uint16_t seqno,
+                                   const std::string & desc,
+                                   const transition & trans,
+                                   const state_machine & sm) {
+    ++calls;
+  });
+  
+  transition::sptr tr1{new transition{0,1,0,"TR1"}};
+  action::sptr act1{new action{[](uint16_t seqno,
+                                  transition & trans,
+                                  state_machine & sm){},"ACT1"}};
+  tr1->set_action(1, act1);
+  tr1->set_action(2, act1);
+  sm.add_transition(tr1);
+  
+  EXPECT_TRUE(sm.tracing());
+  sm.enqueue(1);
+  sm.enqueue(2); // no such transition
+  sm.run(0);
+  EXPECT_EQ(calls, 3);
+  
+  sm.tracing(false);
+  sm.enqueue(1);
+  sm.enqueue(2);
+  sm.run(0);
+  EXPECT_EQ(calls, 3);
+  
+  sm.tracing(true);
+  sm.enqueue(1);
+  sm.run(0);
+  EXPECT_EQ(calls, 5);
+}
+
+TEST_F(FsmTest, BinaryTrace)
+{
+  state_machine sm("TEST");
+  sm.state_name(0, "IDLE");
+  sm.state_name(1, "BUSY");
+  sm.event_name(1, "START");
+  sm.binary_trace(4);
+  
+  transition::sptr tr1{new transition{0,1,1,"TR1"}};
+  transition::sptr tr2{new transition{1,2,0,"TR2"}};
+  tr2->on_error_state(5);
+  action::sptr fail{new action{[](uint16_t seqno,
+                                  transition & trans,
+                                  state_machine & sm){
+    THROW_("failed");
+  },"FAIL"}};
+  tr2->set_action(7, fail);
+  sm.add_transition(tr1);
+  sm.add_transition(tr2);
+  
+  // six events into a ring of four: the first two are overwritten
+  sm.enqueue_bulk({1, 2, 3, 3, 1, 9});
+  EXPECT_EQ(sm.run(0), 5);
+  
+  std::stringstream ss;
+  sm.dump_binary_trace(ss);
+  
+  trace_ring::dump d;
+  ASSERT_TRUE(trace_ring::read(ss, d));
+  EXPECT_EQ(d.machine_id_, sm.id());
+  EXPECT_EQ(d.description_, "TEST");
+  EXPECT_EQ(d.state_names_[1], "BUSY");
+  EXPECT_EQ(d.event_names_[1], "START");
+  ASSERT_EQ(d.records_.size(), 4);
+  
+  EXPECT_EQ(d.records_[0].event_, 3);
+  EXPECT_EQ(d.records_[0].state_, 5);
+  EXPECT_EQ(d.records_[0].result_, trace_ring::unhandled);
+  EXPECT_EQ(d.records_[2].event_, 1);
+  EXPECT_EQ(d.records_[2].result_, trace_ring::unhandled);
+  EXPECT_EQ(d.records_[3].event_, 9);
+  
+  EXPECT_LE(d.records_[0].timestamp_ns_, d.records_[3].timestamp_ns_);
+  for( auto const & r : d.records_ )
+    EXPECT_EQ(r.machine_id_, sm.id());
+}
+
+TEST_F(FsmTest, BinaryTraceTimestamps)
+{
+  typedef std::chrono::steady_clock clock_type;
+  
+  state_machine sm("TEST");
+  sm.binary_trace(8);
+  transition::sptr tr{new transition{0,1,0,"SLOW"}};
+  tr->set_action(1, action::sptr{new action{[](uint16_t seqno,
+                                               transition & trans,
+                                               state_machine & sm){
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  },"SLEEP"}});
+  sm.add_transition(tr);
+  
+  // one batch, every record has its own time
+  auto before = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now().time_since_epoch()).count();
+  sm.enqueue_bulk({1, 1, 1});
+  sm.run(0);
+  auto after = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now().time_since_epoch()).count();
+  
+  std::stringstream ss;
+  sm.dump_binary_trace(ss);
+  trace_ring::dump d;
+  ASSERT_TRUE(trace_ring::read(ss, d));
+  ASSERT_EQ(d.records_.size(), 3);
+  
+  // stamped when the transition ended, on the steady clock
+  EXPECT_GE(d.records_[0].timestamp_ns_, uint64_t(before)+20000000);
+  EXPECT_GE(d.records_[1].timestamp_ns_, d.records_[0].timestamp_ns_+15000000);
+  EXPECT_GE(d.records_[2].timestamp_ns_, d.records_[1].timestamp_ns_+15000000);
+  EXPECT_LE(d.records_[2].timestamp_ns_, uint64_t(after)+1000000);
+}
+
+TEST_F(FsmTest, BinaryTraceResults)
+{
+  state_machine sm("TEST");
+  sm.binary_trace(16);
+  
+  transition::sptr tr1{new transition{0,1,2,"TR1"}};
+  tr1->on_error_state(3);
+  action::sptr fail{new action{[](uint16_t seqno,
+                                  transition & trans,
+                                  state_machine & sm){
+    THROW_("failed");
+  },"FAIL"}};
+  tr1->set_action(7, fail);
+  sm.add_transition(tr1);
+  
+  sm.enqueue(1);
+  EXPECT_EQ(sm.run(0), 3);
+  
+  std::stringstream ss;
+  sm.dump_binary_trace(ss);
+  trace_ring::dump d;
+  ASSERT_TRUE(trace_ring::read(ss, d));
+  ASSERT_EQ(d.records_.size(), 1);
+  EXPECT_EQ(d.records_[0].seqno_, 7);
+  EXPECT_EQ(d.records_[0].result_, trace_ring::exception);
+  EXPECT_EQ(d.records_[0].next_state_, 3);
+}
+
+namespace virtdb { namespace test {
+  
+  // a stream like a pipe, it can't tell its size
+  class unseekable_buf : public std::streambuf
+  {
+    std::string data_;
+    
+  public:
+    unseekable_buf(const std::string & data)
+    : data_{data}
+    {
+      setg(&data_[0], &data_[0], &data_[0]+data_.size());
+    }
+  };
+  
+}}
+
+TEST_F(FsmTest, BinaryTraceRejectsCorruptDumps)
+{
+  state_machine sm("TEST");
+  sm.state_name(0, "IDLE");
+  sm.event_name(1, "START");
+  sm.binary_trace(8);
+  transition::sptr tr{new transition{0,1,0,"TR"}};
+  sm.add_transition(tr);
+  sm.enqueue_bulk({1, 1, 1});
+  sm.run(0);
+  
+  std::stringstream ss;
+  sm.dump_binary_trace(ss);
+  const std::string good = ss.str();
+  
+  auto readable = [](const std::string & data, bool seekable) {
+    trace_ring::dump d;
+    if( seekable )
+    {
+      std::istringstream is{data};
+      return trace_ring::read(is, d);
+    }
+    unseekable_buf buf{data};
+    std::istream is{&buf};
+    return trace_ring::read(is, d);
+  };
+  
+  EXPECT_TRUE(readable(good, true));
+  EXPECT_TRUE(readable(good, false));
+  
+  // every truncation is noticed
+  for( size_t len=0; len<good.size(); ++len )
+  {
+    EXPECT_FALSE(readable(good.substr(0, len), true)) << len;
+    EXPECT_FALSE(readable(good.substr(0, len), false)) << len;
+  }
+  
+  // counts larger than the data are rejected without allocating for them
+  auto patched = [&good](size_t at, uint64_t value, size_t size) {
+    std::string bad = good;
+    ::memcpy(&bad[at], &value, size);
+    return bad;
+  };
+  size_t records_at = good.size() - 3*sizeof(trace_ring::record) - sizeof(uint64_t);
+  size_t names_at = 8 + 4 + 4 + 4 + 4;
+  for( bool seekable : { true, false } )
+  {
+    EXPECT_FALSE(readable(patched(records_at, UINT64_MAX/2, 8), seekable));
+    EXPECT_FALSE(readable(patched(records_at, 4, 8), seekable));
+    EXPECT_FALSE(readable(patched(names_at, UINT32_MAX, 4), seekable));
+    EXPECT_FALSE(readable(patched(8 + 4 + 4, UINT32_MAX, 4), seekable));
+  }
+}
+
+TEST_F(FsmTest, LatencyHistogramBuckets)
+{
+  for( uint64_t v : { 0ULL, 1ULL, 7ULL, 8ULL, 15ULL, 16ULL, 1000ULL, 123456789ULL } )
+  {
+    uint32_t b = latency_histogram::bucket_of(v);
+    EXPECT_LE(latency_histogram::bucket_low(b), v);
+    EXPECT_GE(latency_histogram::bucket_high(b), v);
+  }
+  
+  latency_histogram h;
+  for( uint64_t v=1; v<=1000; ++v )
+    h.record(v*1000);
+  
+  latency_histogram::snapshot snap;
+  h.take(snap);
+  EXPECT_EQ(snap.count_, 1000);
+  EXPECT_EQ(snap.max_ns_, 1000000);
+  EXPECT_EQ(snap.mean(), 500500);
+  
+  // buckets are at most 12.5% wide
+  EXPECT_NEAR(snap.percentile(0.5), 500000, 500000/8);
+  EXPECT_NEAR(snap.percentile(0.99), 990000, 990000/8);
+  EXPECT_EQ(snap.percentile(1.0), 1000000);
+}
+
+TEST_F(FsmTest, TransitionStats)
+{
+  state_machine sm("TEST");
+  sm.collect_stats(true);
+  
+  transition::sptr tr1{new transition{0,1,0,"TR1"}};
+  transition::sptr tr2{new transition{0,2,0,"TR2"}};
+  tr2->on_error_state(0);
+  
+  action::sptr slow{new action{[](uint16_t seqno,
+                                  transition & trans,
+                                  state_machine & sm){
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  },"SLOW"}};
+  action::sptr fail{new action{[](uint16_t seqno,
+                                  transition & trans,
+                                  state_machine & sm){
+    THROW_("failed");
+  },"FAIL"}};
+  tr1->set_action(1, slow);
+  tr2->set_action(3, slow);
+  tr2->set_action(2, fail);
+  tr2->set_action(1, slow);
+  sm.add_transition(tr1);
+  sm.add_transition(tr2);
+  
+  sm.enqueue_bulk({1, 1, 1, 2, 2});
+  sm.run(0);
+  
+  auto snap = sm.stats();
+  ASSERT_EQ(snap.transitions_.size(), 2);
+  
+  auto const & s1 = snap.transitions_[0];
+  EXPECT_EQ(s1.state_, 0);
+  EXPECT_EQ(s1.event_, 1);
+  EXPECT_EQ(s1.executions_, 3);
+  EXPECT_EQ(s1.exceptions_, 0);
+  EXPECT_GE(s1.latency_.percentile(0.5), 2000000);
+  ASSERT_EQ(s1.steps_.size(), 1);
+  EXPECT_EQ(s1.steps_[0].seqno_, 1);
+  EXPECT_EQ(s1.steps_[0].count_, 3);
+  EXPECT_GE(s1.steps_[0].total_ns_, 6000000);
+  
+  auto const & s2 = snap.transitions_[1];
+  EXPECT_EQ(s2.executions_, 2);
+  EXPECT_EQ(s2.exceptions_, 2);
+  ASSERT_EQ(s2.steps_.size(), 3);
+  EXPECT_EQ(s2.steps_[0].seqno_, 1);
+  EXPECT_EQ(s2.steps_[0].count_, 2);
+  EXPECT_EQ(s2.steps_[2].seqno_, 3);
+  EXPECT_EQ(s2.steps_[2].count_, 0);
+  
+  // the last event waited for the slow ones in the queue
+  EXPECT_EQ(snap.queue_wait_.count_, 5);
+  EXPECT_GE(snap.queue_wait_.max_ns_, 6000000);
+}
+
+TEST_F(FsmTest, UnhandledPolicies)
+{
+  uint64_t traced = 0;
+  state_machine sm("TEST",[&traced](uint16_t seqno,
+                                    const std::string & desc,
+                                    const transition & trans,
+                                    const state_machine & sm) {
+    ++traced;
+  });
+  
+  transition::sptr tr1{new transition{0,1,1,"TR1"}};
+  sm.add_transition(tr1);
+  EXPECT_EQ(sm.unhandled(), machine_definition::trace_unhandled);
+  
+  sm.enqueue_bulk({5, 5, 1, 5});
+  EXPECT_EQ(sm.run(0), 1);
+  EXPECT_EQ(traced, 4);
+  EXPECT_EQ(sm.unhandled_count(0, 5), 2);
+  EXPECT_EQ(sm.unhandled_count(1, 5), 1);
+  
+  sm.on_unhandled(machine_definition::ignore_unhandled);
+  sm.enqueue(5);
+  sm.run(1);
+  EXPECT_EQ(traced, 4);
+  EXPECT_EQ(sm.unhandled_count(1, 5), 1);
+  
+  sm.on_unhandled(machine_definition::count_unhandled);
+  sm.enqueue_bulk({5, 6});
+  sm.run(1);
+  EXPECT_EQ(traced, 4);
+  EXPECT_EQ(sm.unhandled_count(1, 5), 2);
+  EXPECT_EQ(sm.unhandled_count(1, 6), 1);
+  EXPECT_EQ(sm.unhandled_count(), 5);
+  
+  std::vector<std::pair<uint16_t,uint16_t>> seen;
+  sm.on_unhandled([&seen](uint16_t state,
+                          uint16_t event,
+                          state_machine & sm) {
+    seen.push_back(std::make_pair(state, event));
+  });
+  sm.enqueue(7);
+  sm.run(1);
+  ASSERT_EQ(seen.size(), 1);
+  EXPECT_EQ(seen[0].first, 1);
+  EXPECT_EQ(seen[0].second, 7);
+  
+  transition::sptr fallback{new transition{0,0,99,"FALLBACK"}};
+  sm.on_unhandled(fallback);
+  sm.enqueue(8);
+  EXPECT_EQ(sm.run(1), 99);
+  EXPECT_EQ(sm.unhandled_count(1, 8), 1);
+  
+  EXPECT_THROW(sm.on_unhandled(machine_definition::fallback_unhandled), virtdb::fsm::exception);
+  
+  auto snap = sm.stats();
+  EXPECT_EQ(snap.unhandled_.size(), 5);
+}
+
+TEST_F(FsmTest, UnhandledCallbackThrows)
+{
+  state_machine sm{"THROWING"};
+  std::vector<uint16_t> seen;
+  sm.on_unhandled([&seen](uint16_t state,
+                          uint16_t event,
+                          state_machine & sm) {
+    seen.push_back(event);
+    if( seen.size() == 1 )
+      throw std::runtime_error{"unhandled"};
+  });
+  
+  sm.enqueue_bulk({1, 2, 3});
+  EXPECT_THROW(sm.run(0), std::runtime_error);
+  
+  // the events popped with the failed one are still queued
+  EXPECT_EQ(sm.queue_size(), 2);
+  EXPECT_TRUE(sm.queue_has(2));
+  EXPECT_EQ(sm.enqueue_unique(3), skipped);
+  EXPECT_EQ(sm.queue_stats().size_, 2);
+  
+  // and run before the ones queued later
+  sm.enqueue(4);
+  EXPECT_EQ(sm.run(0), 0);
+  EXPECT_EQ(sm.queue_size(), 0);
+  EXPECT_EQ(seen, (std::vector<uint16_t>{1, 2, 3, 4}));
+}
+
+TEST_F(FsmTest, SharedNameRegistry)
+{
+  state_machine sm1("TEST1");
+  state_machine sm2("TEST2");
+  
+  sm1.state_name(1, "ONE");
+  sm1.event_name(2, "TWO");
+  EXPECT_EQ(sm2.state_name(1), "1");
+  
+  sm2.names(sm1.names());
+  EXPECT_EQ(sm2.state_name(1), "ONE");
+  EXPECT_EQ(sm2.event_name(2), "TWO");
+  EXPECT_EQ(sm2.event_name(1), "1");
+  
+  // lookups return the same interned string every time
+  const std::string & one = sm1.state_name(1);
+  EXPECT_EQ(&one, &sm2.state_name(1));
+  EXPECT_EQ(&sm1.state_name(7), &sm2.state_name(7));
+  
+  // re-registering keeps the earlier string alive
+  sm2.state_name(1, "UNO");
+  EXPECT_EQ(one, "ONE");
+  EXPECT_EQ(sm1.state_name(1), "UNO");
+  
+  name_registry::name_map names;
+  sm1.names()->state_names(names);
+  EXPECT_EQ(names.size(), 1);
+  EXPECT_EQ(names[1], "UNO");
+}
+
+TEST_F(FsmTest, SharedDefinition)
+{
+  machine_definition::sptr def{new machine_definition{"SESSION"}};
+  
+  // the action moves the machine to the sink state 2 when an odd
+  // number of events is still queued
+  transition::sptr tr{new transition{0,0,1,"TR"}};
+  action::sptr act{new action{[](uint16_t seqno,
+                                 transition & trans,
+                                 state_machine & sm){
+    if( sm.queue_size() % 2 )
+      trans.default_state(2);
+  },"ACT"}};
+  tr->set_action(1, act);
+  timer::sptr tmr{new timer{std::chrono::seconds(60), "TIMER"}};
+  tr->set_timer(2, tmr);
+  def->add_transition(tr);
+  def->add_transition(transition::sptr{new transition{1,0,0,"BACK"}});
+  
+  EXPECT_THROW(state_machine{def}, virtdb::fsm::exception);
+  def->freeze();
+  EXPECT_THROW(def->on_unhandled(machine_definition::count_unhandled), virtdb::fsm::exception);
+  
+  const int n_threads = 4;
+  const int n_instances = 1000;
+  std::vector<std::future<int>> results;
+  for( int t=0; t<n_threads; ++t )
+  {
+    results.push_back(std::async(std::launch::async, [def,t]() {
+      std::vector<machine_instance::sptr> instances;
+      for( int i=0; i<n_instances; ++i )
+        instances.push_back(machine_instance::sptr{new machine_instance{def}});
+      
+      int correct = 0;
+      for( int i=0; i<n_instances; ++i )
+      {
+        // odd counts go 0->1->0->1, even counts end in the sink
+        int n = 1+(i+t)%4;
+        for( int e=0; e<n; ++e )
+          instances[i]->enqueue(0);
+        instances[i]->run(0);
+        
+        uint16_t expected = (n%2 ? 1 : 2);
+        if( instances[i]->state() == expected )
+          ++correct;
+      }
+      return correct;
+    }));
+  }
+  
+  for( auto & r : results )
+    EXPECT_EQ(r.get(), n_instances);
+  
+  // the override did not change the shared transition
+  machine_instance sm{def};
+  sm.enqueue(0);
+  EXPECT_EQ(sm.run(0), 1);
+  EXPECT_EQ(sm.state(), 1);
+  sm.enqueue(0);
+  EXPECT_EQ(sm.resume(), 0);
+}
+
+TEST_F(FsmTest, InstanceSize)
+{
+  machine_definition::sptr def{new machine_definition{"SESSION"}};
+  def->freeze();
+  
+  // the definition, the state and a few flags. the queue comes with the
+  // first event.
+  EXPECT_LE(sizeof(machine_instance), 64);
+  uint64_t before = allocations;
+  {
+    machine_instance sm{def};
+    EXPECT_EQ(sm.definition(), def);
+    EXPECT_EQ(sm.description(), "SESSION");
+    EXPECT_EQ(sm.queue_size(), 0);
+    EXPECT_FALSE(sm.queue_has(1));
+    EXPECT_FALSE(sm.suspended());
+  }
+  EXPECT_EQ(allocations-before, 0);
+  
+  // unnamed ids don't need a registry, the first name creates it
+  state_machine priv{"PRIVATE"};
+  EXPECT_EQ(name_registry::numeric(5), "5");
+  uint64_t bytes = allocated_bytes;
+  EXPECT_EQ(priv.state_name(5), "5");
+  EXPECT_EQ(priv.event_name(5), "5");
+  EXPECT_EQ(allocated_bytes, bytes);
+  priv.state_name(5, "FIVE");
+  EXPECT_EQ(priv.state_name(5), "FIVE");
+  EXPECT_EQ(priv.event_name(5), "5");
+  EXPECT_GE(allocated_bytes-bytes, sizeof(name_registry));
+}
+
+TEST_F(FsmTest, FrozenTransitions)
+{
+  transition::sptr tr{new transition{0,1,2,"SHARED"}};
+  tr->set_action(1, action::sptr{new action{[](uint16_t seqno,
+                                               transition & trans,
+                                               state_machine & sm){
+    // overrides this execution only
+    trans.default_state(3);
+  },"OVERRIDE"}});
+  
+  machine_definition::sptr def{new machine_definition{"SHARED"}};
+  def->add_transition(tr);
+  EXPECT_FALSE(tr->frozen());
+  def->freeze();
+  EXPECT_TRUE(tr->frozen());
+  
+  // machines on other threads may run it, it can't change anymore
+  EXPECT_THROW(tr->default_state(4), std::exception);
+  EXPECT_THROW(tr->on_error_state(4), std::exception);
+  EXPECT_THROW(tr->on_timeout_state(4), std::exception);
+  EXPECT_THROW(tr->set_action(2, action::sptr{}), std::exception);
+  EXPECT_THROW(tr->clear_timer(2, 1), std::exception);
+  
+  machine_instance sm1{def}, sm2{def};
+  sm1.enqueue(1);
+  EXPECT_EQ(sm1.run(0), 3);
+  sm2.enqueue(1);
+  EXPECT_EQ(sm2.run(0), 3);
+}
+
+TEST_F(FsmTest, ExecutorRunsMachines)
+{
+  const uint32_t n_machines = 200;
+  const uint32_t n_producers = 4;
+  const uint32_t per_producer = 2000;
+  
+  std::vector<machine_instance::sptr> machines;
+  std::vector<std::atomic<uint32_t>> counts(n_machines);
+  std::vector<std::atomic<bool>> running(n_machines);
+  std::atomic<uint32_t> overlaps{0};
+  
+  machine_definition::sptr def{new machine_definition{"EXEC"}};
+  uint32_t first_id = 0;
+  transition::sptr tr{new transition{0,1,0,"TR"}};
+  action::sptr act{new action{[&](uint16_t seqno,
+                                  transition & trans,
+                                  state_machine & sm){
+    uint32_t i = sm.id()-first_id;
+    if( running[i].exchange(true) )
+      ++overlaps;
+    ++counts[i];
+    std::this_thread::yield();
+    running[i] = false;
+  },"COUNT"}};
+  tr->set_action(1, act);
+  def->add_transition(tr);
+  def->freeze();
+  
+  executor exec{4, 16};
+  EXPECT_EQ(exec.workers(), 4);
+  for( uint32_t i=0; i<n_machines; ++i )
+  {
+    counts[i] = 0;
+    running[i] = false;
+    machines.push_back(machine_instance::sptr{new machine_instance{def}});
+    if( i == 0 ) first_id = machines[0]->id();
+    exec.add(machines.back());
+  }
+  EXPECT_THROW(machines[0]->run(5), virtdb::fsm::exception);
+  EXPECT_EQ(machines[0]->state(), 0);
+  
+  std::vector<std::thread> producers;
+  for( uint32_t p=0; p<n_producers; ++p )
+  {
+    producers.push_back(std::thread{[&machines,p]() {
+      for( uint32_t i=0; i<per_producer; ++i )
+        machines[(i*7+p) % n_machines]->enqueue(1);
+    }});
+  }
+  for( auto & t : producers )
+    t.join();
+  
+  exec.wait_idle();
+  
+  uint32_t total = 0;
+  for( uint32_t i=0; i<n_machines; ++i )
+  {
+    total += counts[i];
+    EXPECT_EQ(machines[i]->queue_size(), 0);
+  }
+  EXPECT_EQ(total, n_producers*per_producer);
+  EXPECT_EQ(overlaps, 0);
+}
+
+TEST_F(FsmTest, ExecutorFairness)
+{
+  std::vector<uint32_t> order;
+  machine_definition::sptr def{new machine_definition{"EXEC"}};
+  transition::sptr tr{new transition{0,1,0,"TR"}};
+  action::sptr act{new action{[&order](uint16_t seqno,
+                                       transition & trans,
+                                       state_machine & sm){
+    order.push_back(sm.id());
+  },"RECORD"}};
+  tr->set_action(1, act);
+  def->add_transition(tr);
+  def->freeze();
+  
+  machine_instance::sptr hot{new machine_instance{def}};
+  machine_instance::sptr cold{new machine_instance{def}};
+  for( int i=0; i<1000; ++i )
+    hot->enqueue(1);
+  cold->enqueue(1);
+  
+  // a single worker, so the order is the execution order
+  executor exec{1, 8};
+  exec.add(hot);
+  exec.add(cold);
+  exec.wait_idle();
+  
+  ASSERT_EQ(order.size(), 1001);
+  auto it = std::find(order.begin(), order.end(), cold->id());
+  ASSERT_NE(it, order.end());
+  EXPECT_LT(it-order.begin(), 1000);
+}
+
+TEST_F(FsmTest, ExecutorReportsErrors)
+{
+  std::vector<uint16_t> seen;
+  machine_definition::sptr def{new machine_definition{"EXEC"}};
+  def->on_unhandled([&seen](uint16_t state,
+                            uint16_t event,
+                            state_machine & sm) {
+    seen.push_back(event);
+    if( event == 1 )
+      throw std::runtime_error{"unhandled"};
+  });
+  def->freeze();
+  
+  std::vector<std::string> errors;
+  std::vector<uint32_t> failed;
+  executor exec{1, 16, [&](state_machine & sm, std::exception_ptr err) {
+    failed.push_back(sm.id());
+    try
+    {
+      std::rethrow_exception(err);
+    }
+    catch (const std::exception & e)
+    {
+      errors.push_back(e.what());
+    }
+  }};
+  
+  // the events popped with the failing one still run
+  machine_instance::sptr sm{new machine_instance{def}};
+  sm->enqueue_bulk({1, 2, 3});
+  exec.add(sm);
+  exec.wait_idle();
+  
+  EXPECT_EQ(exec.errors(), 1);
+  EXPECT_EQ(failed, (std::vector<uint32_t>{sm->id()}));
+  EXPECT_EQ(errors, (std::vector<std::string>{"unhandled"}));
+  EXPECT_EQ(seen, (std::vector<uint16_t>{1, 2, 3}));
+  EXPECT_EQ(sm->queue_size(), 0);
+}
+
+TEST_F(FsmTest, ExecutorStop)
+{
+  std::atomic<uint32_t> count{0};
+  machine_definition::sptr def{new machine_definition{"EXEC"}};
+  transition::sptr tr{new transition{0,1,0,"TR"}};
+  tr->set_action(1, action::sptr{new action{[&count](uint16_t seqno,
+                                                     transition & trans,
+                                                     state_machine & sm){
+    ++count;
+  },"COUNT"}});
+  def->add_transition(tr);
+  def->freeze();
+  
+  machine_instance::sptr sm{new machine_instance{def}};
+  {
+    executor exec{2};
+    exec.add(sm);
+    sm->enqueue(1);
+    exec.wait_idle();
+    EXPECT_EQ(count, 1);
+    
+    // nothing runs after stopping, waiting doesn't hang
+    exec.stop();
+    sm->enqueue(1);
+    exec.wait_idle();
+    EXPECT_EQ(count, 1);
+    EXPECT_EQ(sm->queue_size(), 1);
+    EXPECT_THROW(exec.add(machine_instance::sptr{new machine_instance{def}}),
+                 virtdb::fsm::exception);
+    
+    // timers fire while the executor goes away
+    for( int i=0; i<100; ++i )
+      sm->enqueue_after(1, std::chrono::microseconds(i*10));
+  }
+  
+  // the machine runs on its own afterwards
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while( sm->queue_size() < 101 && std::chrono::steady_clock::now() < deadline )
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_EQ(sm->run(0), 0);
+  EXPECT_EQ(count, 102);
+}
+
+TEST_F(FsmTest, ParkerWakeups)
+{
+  parker p;
+  
+  // an earlier unpark is not lost
+  p.unpark();
+  p.park();
+  
+  auto start = parker::clock_type::now();
+  p.park(start+std::chrono::milliseconds(20));
+  EXPECT_GE(parker::clock_type::now()-start, std::chrono::milliseconds(20));
+  
+  std::thread t{[&p]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    p.unpark();
+  }};
+  start = parker::clock_type::now();
+  p.park(start+std::chrono::seconds(10));
+  EXPECT_LT(parker::clock_type::now()-start, std::chrono::seconds(5));
+  t.join();
+}
+
+TEST_F(FsmTest, RunForever)
+{
+  std::atomic<uint32_t> count{0};
+  state_machine sm("TEST");
+  transition::sptr tr1{new transition{0,1,1,"TR1"}};
+  transition::sptr tr2{new transition{1,1,0,"TR2"}};
+  action::sptr act{new action{[&count](uint16_t seqno,
+                                       transition & trans,
+                                       state_machine & sm){
+    ++count;
+  },"COUNT"}};
+  tr1->set_action(1, act);
+  tr2->set_action(1, act);
+  sm.add_transition(tr1);
+  sm.add_transition(tr2);
+  sm.freeze();
+  
+  stop_token stop;
+  auto result = std::async(std::launch::async, [&sm,&stop]() {
+    return sm.run_forever(0, stop);
+  });
+  
+  // every event finds the machine parked, awake or in between
+  for( int i=0; i<101; ++i )
+  {
+    sm.enqueue(1);
+    if( i % 10 == 0 )
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  while( count < 101 )
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  
+  stop.request_stop();
+  EXPECT_EQ(result.get(), 1);
+  EXPECT_EQ(sm.state(), 1);
+  
+  // the deadline stops an idle machine on its own
+  auto start = parker::clock_type::now();
+  stop_token timed{start+std::chrono::milliseconds(20)};
+  EXPECT_EQ(sm.run_forever(1, timed), 1);
+  EXPECT_GE(parker::clock_type::now()-start, std::chrono::milliseconds(20));
+}
+
+TEST_F(FsmTest, RunForeverStopsBusyMachine)
+{
+  // every event enqueues the next one, the queue never runs empty
+  std::atomic<uint64_t> count{0};
+  state_machine sm("TEST");
+  transition::sptr tr{new transition{0,1,0,"TR"}};
+  action::sptr again{new action{[&count](uint16_t seqno,
+                                         transition & trans,
+                                         state_machine & sm){
+    ++count;
+    sm.enqueue(1);
+  },"AGAIN"}};
+  tr->set_action(1, again);
+  sm.add_transition(tr);
+  sm.freeze();
+  
+  sm.enqueue(1);
+  stop_token timed{parker::clock_type::now()+std::chrono::milliseconds(20)};
+  EXPECT_EQ(sm.run_forever(0, timed), 0);
+  EXPECT_GT(count, 0);
+  EXPECT_EQ(sm.queue_size(), 1);
+  
+  stop_token stop;
+  auto result = std::async(std::launch::async, [&sm,&stop]() {
+    return sm.run_forever(0, stop);
+  });
+  uint64_t before = count;
+  while( count < before+1000 )
+    std::this_thread::yield();
+  stop.request_stop();
+  EXPECT_EQ(result.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  EXPECT_EQ(sm.queue_size(), 1);
+}
+
+TEST_F(FsmTest, EventPayloads)
+{
+  struct small { int32_t a_; int32_t b_; };
+  struct large { uint64_t values_[12]; };
+  
+  std::vector<int64_t> seen;
+  state_machine sm("TEST");
+  transition::sptr tr{new transition{0,1,0,"TR"}};
+  action::sptr act{new action{[&seen](uint16_t seqno,
+                                      transition & trans,
+                                      state_machine & sm){
+    const payload & pl = sm.event_payload();
+    if( pl.empty() )
+      seen.push_back(-1);
+    else if( pl.size() == sizeof(small) )
+      seen.push_back(pl.as<small>().a_ + pl.as<small>().b_);
+    else
+      seen.push_back(static_cast<int64_t>(pl.as<large>().values_[11]));
+  },"READ"}};
+  tr->set_action(1, act);
+  sm.add_transition(tr);
+  
+  large l;
+  for( int i=0; i<12; ++i )
+    l.values_[i] = i*100;
+  
+  sm.enqueue(1);
+  sm.enqueue(1, small{3, 4});
+  sm.enqueue(1, l);
+  
+  // filled in place
+  payload_pool::block blk = sm.alloc_payload(sizeof(large));
+  static_cast<large *>(blk.data_)->values_[11] = 42;
+  sm.enqueue(1, blk);
+  
+  EXPECT_TRUE(sm.event_payload().empty());
+  sm.run(0);
+  ASSERT_EQ(seen.size(), 4);
+  EXPECT_EQ(seen[0], -1);
+  EXPECT_EQ(seen[1], 7);
+  EXPECT_EQ(seen[2], 1100);
+  EXPECT_EQ(seen[3], 42);
+  
+  EXPECT_THROW(sm.alloc_payload(payload_pool::block_size+1), virtdb::fsm::exception);
+}
+
+TEST_F(FsmTest, PayloadBlocksAreRecycled)
+{
+  struct large { char bytes_[200]; };
+  
+  uint64_t sum = 0;
+  state_machine sm("TEST");
+  transition::sptr tr{new transition{0,1,0,"TR"}};
+  action::sptr act{new action{[&sum](uint16_t seqno,
+                                     transition & trans,
+                                     state_machine & sm){
+    sum += sm.event_payload().as<large>().bytes_[0];
+  },"READ"}};
+  tr->set_action(1, act);
+  sm.add_transition(tr);
+  sm.freeze();
+  
+  large l;
+  l.bytes_[0] = 1;
+  for( int round=0; round<1000; ++round )
+  {
+    for( int i=0; i<10; ++i )
+      sm.enqueue(1, l);
+    sm.run(0);
+  }
+  EXPECT_EQ(sum, 10000);
+  
+  // never more than ten in flight, so the first chunk was enough
+  payload_pool::block blk = sm.alloc_payload(8);
+  EXPECT_LT(blk.index_, payload_pool::first_chunk);
+  sm.enqueue(2, blk);
+  sm.run(0);
+  
+  // released blocks are reused without growing the pool
+  payload_pool pool;
+  std::vector<uint32_t> blocks;
+  for( int i=0; i<100; ++i )
+    blocks.push_back(pool.alloc(8).index_);
+  uint32_t capacity = pool.capacity();
+  EXPECT_GE(capacity, 100);
+  for( int round=0; round<100; ++round )
+  {
+    for( auto b : blocks )
+      pool.release(b);
+    for( auto & b : blocks )
+      b = pool.alloc(8).index_;
+  }
+  EXPECT_EQ(pool.capacity(), capacity);
+}
+
+TEST_F(FsmTest, StrictPriorities)
+{
+  std::vector<uint16_t> order;
+  state_machine sm("TEST", queue_options{queue_options::locked, 1024, 3});
+  action::sptr record{new action{[&order](uint16_t seqno,
+                                          transition & trans,
+                                          state_machine & sm){
+    order.push_back(trans.event());
+    
+    // a control event raised in the middle of the data
+    if( order.size() == 10 )
+      sm.enqueue(4, control_priority);
+  },"RECORD"}};
+  for( uint16_t ev=1; ev<=4; ++ev )
+  {
+    transition::sptr tr{new transition{0,ev,0,"TR"}};
+    tr->set_action(1, record);
+    sm.add_transition(tr);
+  }
+  sm.freeze();
+  
+  for( int i=0; i<100; ++i )
+    sm.enqueue(1);
+  sm.enqueue(2, high_priority);
+  sm.enqueue(3, control_priority);
+  
+  EXPECT_EQ(sm.queue_size(), 102);
+  EXPECT_EQ(sm.queue_size(normal_priority), 100);
+  EXPECT_EQ(sm.queue_size(control_priority), 1);
+  EXPECT_TRUE(sm.queue_has(3, control_priority));
+  EXPECT_FALSE(sm.queue_has(3, normal_priority));
+  
+  // priorities above the configured classes go to the highest one
+  EXPECT_TRUE(sm.queue_has(3, urgent_priority));
+  
+  sm.run(0);
+  ASSERT_EQ(order.size(), 103);
+  EXPECT_EQ(order[0], 3);
+  EXPECT_EQ(order[1], 2);
+  auto it = std::find(order.begin(), order.end(), 4);
+  ASSERT_NE(it, order.end());
+  EXPECT_LE(it-order.begin(), 10+16);
+  EXPECT_EQ(sm.queue_size(control_priority), 0);
+}
+
+TEST_F(FsmTest, WeightedPriorities)
+{
+  std::vector<uint16_t> order;
+  queue_options opts{queue_options::lock_free, 1024, 2, queue_options::weighted};
+  opts.weights_[normal_priority] = 1;
+  opts.weights_[high_priority]   = 4;
+  state_machine sm("TEST", opts);
+  action::sptr record{new action{[&order](uint16_t seqno,
+                                          transition & trans,
+                                          state_machine & sm){
+    order.push_back(trans.event());
+  },"RECORD"}};
+  for( uint16_t ev=1; ev<=2; ++ev )
+  {
+    transition::sptr tr{new transition{0,ev,0,"TR"}};
+    tr->set_action(1, record);
+    sm.add_transition(tr);
+  }
+  
+  for( int i=0; i<50; ++i )
+  {
+    sm.enqueue(1);
+    sm.enqueue(2, high_priority);
+  }
+  sm.run(0);
+  ASSERT_EQ(order.size(), 100);
+  
+  // four high ones for every normal one while both have events
+  EXPECT_EQ(std::count(order.begin(), order.begin()+50, 2), 40);
+  EXPECT_EQ(order[4], 1);
+  
+  EXPECT_THROW(state_machine("TEST", queue_options{queue_options::locked, 16, 5}),
+               virtdb::fsm::exception);
+  EXPECT_THROW(state_machine("TEST", queue_options{queue_options::locked, 16, 0}),
+               virtdb::fsm::exception);
+  EXPECT_THROW(event_queue::create(queue_options{queue_options::lock_free, 16, 0}),
+               virtdb::fsm::exception);
+}
+
+TEST_F(FsmTest, BoundedQueuePolicies)
+{
+  std::vector<uint16_t> order;
+  action::sptr record{new action{[&order](uint16_t seqno,
+                                          transition & trans,
+                                          state_machine & sm){
+    order.push_back(trans.event());
+  },"RECORD"}};
+  machine_definition::sptr def{new machine_definition{"TEST"}};
+  for( uint16_t ev=1; ev<=5; ++ev )
+  {
+    transition::sptr tr{new transition{0,ev,0,"TR"}};
+    tr->set_action(1, record);
+    def->add_transition(tr);
+  }
+  def->freeze();
+  
+  queue_options opts;
+  opts.limit_ = 3;
+  
+  // reject
+  {
+    state_machine sm(def, opts);
+    EXPECT_EQ(sm.enqueue(1), enqueued);
+    EXPECT_EQ(sm.enqueue(2, high_priority), enqueued);
+    EXPECT_EQ(sm.enqueue(3, uint64_t(7)), enqueued);
+    EXPECT_EQ(sm.enqueue(4), rejected);
+    EXPECT_EQ(sm.enqueue(4, uint64_t(7)), rejected);
+    EXPECT_EQ(sm.enqueue_unique(5), enqueued);
+    EXPECT_EQ(sm.enqueue_unique(5), skipped);
+    EXPECT_EQ(sm.enqueue_if_empty(5), skipped);
+    
+    queue_limit::stats_snapshot st = sm.queue_stats();
+    EXPECT_EQ(st.size_, 4);
+    EXPECT_EQ(st.high_water_, 4);
+    EXPECT_EQ(st.limit_, 3);
+    EXPECT_EQ(st.rejected_, 2);
+    
+    order.clear();
+    sm.run(0);
+    EXPECT_EQ(order, (std::vector<uint16_t>{1, 2, 3, 5}));
+    EXPECT_EQ(sm.enqueue_bulk({1, 2, 3, 4, 5}), 3);
+    EXPECT_EQ(sm.queue_stats().rejected_, 4);
+  }
+  
+  // drop oldest
+  {
+    opts.overflow_ = queue_options::drop_oldest;
+    state_machine sm(def, opts);
+    sm.enqueue(1);
+    sm.enqueue(2);
+    sm.enqueue(3);
+    EXPECT_EQ(sm.enqueue(4), enqueued_displacing);
+    EXPECT_EQ(sm.enqueue(5, uint64_t(7)), enqueued_displacing);
+    EXPECT_FALSE(sm.queue_has(1));
+    EXPECT_EQ(sm.queue_size(), 3);
+    EXPECT_EQ(sm.queue_stats().dropped_, 2);
+    
+    order.clear();
+    sm.run(0);
+    EXPECT_EQ(order, (std::vector<uint16_t>{3, 4, 5}));
+    EXPECT_EQ(sm.queue_stats().high_water_, 3);
+    
+    // dropped payload blocks go back to the pool
+    struct large { char bytes_[100]; } l;
+    for( int i=0; i<1000; ++i )
+      sm.enqueue(1, l);
+    EXPECT_EQ(sm.queue_size(), 3);
+    payload_pool::block blk = sm.alloc_payload(sizeof(l));
+    EXPECT_LT(blk.index_, payload_pool::first_chunk);
+    sm.enqueue(1, blk);
+    sm.run(0);
+    
+    queue_options lock_free{queue_options::lock_free};
+    lock_free.limit_     = 3;
+    lock_free.overflow_  = queue_options::drop_oldest;
+    EXPECT_THROW(state_machine(def, lock_free), virtdb::fsm::exception);
+  }
+  
+  // coalesce
+  {
+    opts.overflow_ = queue_options::coalesce;
+    state_machine sm(def, opts);
+    EXPECT_EQ(sm.enqueue_bulk({1, 2, 2, 1, 1, 3}), 3);
+    EXPECT_EQ(sm.queue_stats().coalesced_, 2);
+    EXPECT_EQ(sm.enqueue(4), rejected);
+    
+    order.clear();
+    sm.run(0);
+    EXPECT_EQ(order, (std::vector<uint16_t>{1, 2, 2}));
+  }
+  
+  // unbounded machines keep the high water mark only
+  state_machine sm(def);
+  for( int i=0; i<10; ++i )
+    EXPECT_EQ(sm.enqueue(1), enqueued);
+  sm.run(0);
+  sm.enqueue(1);
+  queue_limit::stats_snapshot st = sm.queue_stats();
+  EXPECT_EQ(st.size_, 1);
+  EXPECT_EQ(st.high_water_, 10);
+  EXPECT_EQ(st.limit_, 0);
+  EXPECT_EQ(st.rejected_, 0);
+}
+
+TEST_F(FsmTest, RejectedPayloadsLeaveNoTrace)
+{
+  struct large { char bytes_[200]; };
+  
+  queue_options opts;
+  opts.limit_     = 1;
+  opts.overflow_  = queue_options::reject;
+  state_machine sm("TEST", opts);
+  sm.freeze();
+  
+  large l;
+  l.bytes_[0] = 1;
+  EXPECT_EQ(sm.enqueue(1), enqueued);
+  EXPECT_EQ(sm.enqueue(2, l), rejected);
+  
+  // the blocks of rejected payloads go back to the pool
+  uint64_t before = allocations;
+  for( int i=0; i<1000; ++i )
+    EXPECT_EQ(sm.enqueue(2, l), rejected);
+  EXPECT_EQ(allocations-before, 0);
+  EXPECT_EQ(sm.queue_size(), 1);
+  EXPECT_FALSE(sm.queue_has(2));
+  
+  sm.run(0);
+  EXPECT_EQ(sm.enqueue_if_empty(2), enqueued);
+  EXPECT_EQ(sm.queue_size(), 1);
+}
+
+TEST_F(FsmTest, BoundedQueueBlocks)
+{
+  std::atomic<uint32_t> count{0};
+  std::atomic<uint64_t> max_size{0};
+  machine_definition::sptr def{new machine_definition{"TEST"}};
+  transition::sptr tr{new transition{0,1,0,"TR"}};
+  tr->set_action(1, action::sptr{new action{[&](uint16_t seqno,
+                                                transition & trans,
+                                                state_machine & sm){
+    if( sm.queue_size() > max_size )
+      max_size = sm.queue_size();
+    
+    // the machine's own events are never blocked
+    if( ++count % 100 == 0 )
+    {
+      EXPECT_EQ(sm.enqueue_bulk({2, 2, 2, 2, 2}), 5);
+    }
+  },"SLOW"}});
+  def->add_transition(tr);
+  def->freeze();
+  
+  queue_options opts;
+  opts.limit_          = 4;
+  opts.overflow_       = queue_options::block;
+  opts.block_timeout_  = std::chrono::seconds(10);
+  state_machine sm(def, opts);
+  
+  stop_token stop;
+  auto result = std::async(std::launch::async, [&sm,&stop]() {
+    return sm.run_forever(0, stop);
+  });
+  
+  // the producer waits for the slow consumer
+  for( int i=0; i<1000; ++i )
+    EXPECT_EQ(sm.enqueue(1), enqueued);
+  while( count < 1000 )
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  stop.request_stop();
+  result.get();
+  
+  EXPECT_LE(max_size, 4+5);
+  EXPECT_EQ(sm.queue_stats().timed_out_, 0);
+  
+  // nobody makes room
+  opts.block_timeout_ = std::chrono::milliseconds(5);
+  state_machine idle(def, opts);
+  for( int i=0; i<4; ++i )
+    idle.enqueue(1);
+  auto start = queue_limit::clock_type::now();
+  EXPECT_EQ(idle.enqueue(1), timed_out);
+  EXPECT_GE(queue_limit::clock_type::now()-start, std::chrono::milliseconds(5));
+  EXPECT_EQ(idle.queue_stats().timed_out_, 1);
+  EXPECT_EQ(idle.queue_size(), 4);
+  
+  // the shared timer thread doesn't wait, nor do the other timers
+  opts.block_timeout_ = std::chrono::seconds(10);
+  state_machine full(def, opts);
+  for( int i=0; i<4; ++i )
+    full.enqueue(1);
+  state_machine other("OTHER");
+  start = queue_limit::clock_type::now();
+  full.enqueue_after(1, std::chrono::milliseconds(1));
+  other.enqueue_after(1, std::chrono::milliseconds(2));
+  while( (other.queue_size() == 0 || full.queue_stats().rejected_ == 0) &&
+         queue_limit::clock_type::now()-start < std::chrono::seconds(5) )
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_EQ(other.queue_size(), 1);
+  EXPECT_EQ(full.queue_stats().rejected_, 1);
+  EXPECT_EQ(full.queue_size(), 4);
+}
+
+TEST_F(FsmTest, DelayedEvents)
+{
+  typedef timer_service::clock_type clock_type;
+  
+  std::vector<uint16_t> order;
+  std::atomic<uint32_t> count{0};
+  state_machine sm("TEST");
+  action::sptr record{new action{[&](uint16_t seqno,
+                                     transition & trans,
+                                     state_machine & sm){
+    order.push_back(trans.event());
+    ++count;
+  },"RECORD"}};
+  for( uint16_t ev=1; ev<=4; ++ev )
+  {
+    transition::sptr tr{new transition{0,ev,0,"TR"}};
+    tr->set_action(1, record);
+    sm.add_transition(tr);
+  }
+  sm.freeze();
+  
+  stop_token stop;
+  auto result = std::async(std::launch::async, [&sm,&stop]() {
+    return sm.run_forever(0, stop);
+  });
+  
+  auto start = clock_type::now();
+  sm.enqueue_after(3, std::chrono::milliseconds(30));
+  sm.enqueue_at(2, start+std::chrono::milliseconds(20));
+  timer_handle cancelled = sm.enqueue_after(4, std::chrono::milliseconds(10));
+  timer_handle fired = sm.enqueue_after(1, clock_type::duration::zero());
+  
+  EXPECT_TRUE(cancelled.pending());
+  EXPECT_TRUE(cancelled.cancel());
+  EXPECT_FALSE(cancelled.cancel());
+  EXPECT_FALSE(cancelled.pending());
+  EXPECT_FALSE(timer_handle{}.cancel());
+  
+  while( count < 3 )
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_GE(clock_type::now()-start, std::chrono::milliseconds(30));
+  EXPECT_FALSE(fired.pending());
+  EXPECT_FALSE(fired.cancel());
+  
+  stop.request_stop();
+  result.get();
+  EXPECT_EQ(order, (std::vector<uint16_t>{1, 2, 3}));
+  
+  // a destroyed machine takes its pending timers with it
+  uint64_t pending = timer_service::shared().pending();
+  {
+    state_machine tmp("TMP");
+    for( int i=0; i<1000; ++i )
+      tmp.enqueue_after(1, std::chrono::hours(1));
+    EXPECT_EQ(timer_service::shared().pending(), pending+1000);
+  }
+  EXPECT_EQ(timer_service::shared().pending(), pending);
+}
+
+TEST_F(FsmTest, TimerWheel)
+{
+  typedef timer_service::clock_type clock_type;
+  
+  // delays cross the first level, so timers cascade on the way
+  const uint16_t n_timers = 4000;
+  std::vector<clock_type::time_point> due(n_timers);
+  std::atomic<uint32_t> fired{0};
+  std::atomic<uint32_t> early{0};
+  state_machine sm("TEST");
+  sm.on_unhandled([&](uint16_t state, uint16_t event, state_machine & sm) {
+    if( clock_type::now() < due[event] )
+      ++early;
+    ++fired;
+  });
+  sm.freeze();
+  
+  stop_token stop;
+  auto result = std::async(std::launch::async, [&sm,&stop]() {
+    return sm.run_forever(0, stop);
+  });
+  
+  auto start = clock_type::now();
+  std::vector<timer_handle> handles;
+  for( uint16_t i=0; i<n_timers; ++i )
+  {
+    // the ones cancelled below are due long after the setup
+    auto delay = std::chrono::microseconds((i*7919) % 600000);
+    if( i % 2 == 0 )
+      delay += std::chrono::seconds(5);
+    due[i] = start + delay;
+    handles.push_back(sm.enqueue_at(i, due[i]));
+  }
+  
+  // every other one is cancelled
+  uint32_t cancelled = 0;
+  for( uint16_t i=0; i<n_timers; i+=2 )
+    cancelled += handles[i].cancel();
+  
+  auto deadline = start + std::chrono::seconds(10);
+  while( fired < n_timers-cancelled && clock_type::now() < deadline )
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  
+  stop.request_stop();
+  result.get();
+  EXPECT_EQ(cancelled, n_timers/2);
+  EXPECT_EQ(fired, n_timers-cancelled);
+  EXPECT_EQ(early, 0);
+}
+
+TEST_F(FsmTest, ChainedEvents)
+{
+  std::vector<uint16_t> order;
+  state_machine sm("TEST");
+  action::sptr record{new action{[&order](uint16_t seqno,
+                                          transition & trans,
+                                          state_machine & sm){
+    order.push_back(trans.event());
+    switch( trans.event() )
+    {
+      case 1:
+        sm.enqueue(5);
+        sm.chain(3);    // replaced
+        sm.chain(2);
+        break;
+        
+      case 2:
+        EXPECT_FALSE(sm.queue_has(2));
+        sm.chain(3);
+        break;
+        
+      default:
+        break;
+    };
+  },"RECORD"}};
+  
+  // 0 -1-> 1 -2-> 2 -3-> 3, the others don't change the state
+  for( uint16_t ev=1; ev<=5; ++ev )
+  {
+    uint16_t from = (ev <= 3 ? ev-1 : 3);
+    uint16_t to = (ev <= 3 ? ev : 3);
+    transition::sptr tr{new transition{from,ev,to,"TR"}};
+    tr->set_action(1, record);
+    sm.add_transition(tr);
+  }
+  sm.freeze();
+  
+  // the chain runs before the external event already queued and
+  // before the event enqueued by its first transition
+  sm.enqueue(1);
+  sm.enqueue(4);
+  EXPECT_EQ(sm.run(0), 3);
+  EXPECT_EQ(order, (std::vector<uint16_t>{1, 2, 3, 4, 5}));
+  EXPECT_EQ(sm.queue_size(), 0);
+  
+  // only the running machine can chain
+  EXPECT_THROW(sm.chain(1), virtdb::fsm::exception);
+}
+
+TEST_F(FsmTest, AllocationFreeExecution)
+{
+  const uint64_t n_transitions = 1000000;
+  uint64_t left = 0;
+  uint64_t executed = 0;
+  state_machine sm("TEST");
+  
+  // 0 -1-> 1 -2-> 2 -3-> 0 with every kind of step on the way
+  transition::sptr tr1{new transition{0,1,1,"TR1"}};
+  tr1->set_action(1, action::sptr{new action{[&](uint16_t seqno,
+                                                 transition & trans,
+                                                 state_machine & sm){
+    ++executed;
+    sm.enqueue(2, uint64_t(executed));
+  },"ENQUEUE"}});
+  
+  transition::sptr tr2{new transition{1,2,2,"TR2"}};
+  tr2->set_timer(1, timer::sptr{new timer{[](uint16_t seqno,
+                                             transition & trans,
+                                             state_machine & sm,
+                                             const timer::clock_type::time_point & started_at){
+    return true;
+  },"TIMER"}});
+  tr2->set_loop(2, loop::sptr{new loop{[](uint16_t seqno,
+                                          transition & trans,
+                                          state_machine & sm,
+                                          uint64_t iteration){
+    return iteration < 5;
+  },"LOOP"}});
+  tr2->set_action(3, action::sptr{new action{[&](uint16_t seqno,
+                                                 transition & trans,
+                                                 state_machine & sm){
+    ++executed;
+    EXPECT_EQ(sm.event_payload().as<uint64_t>(), executed-1);
+    sm.chain(3);
+  },"CHAIN"}});
+  tr2->clear_timer(4, 1);
+  
+  transition::sptr tr3{new transition{2,3,1,"TR3"}};
+  tr3->set_timer(1, timer::sptr{new timer{std::chrono::hours(1), "DEADLINE"}});
+  tr3->set_action(2, action::sptr{new action{[&](uint16_t seqno,
+                                                 transition & trans,
+                                                 state_machine & sm){
+    ++executed;
+    trans.default_state(0);
+    if( --left )
+      sm.enqueue(1);
+  },"AGAIN"}});
+  tr3->clear_timer(3, 1);
+  
+  sm.add_transition(tr1);
+  sm.add_transition(tr2);
+  sm.add_transition(tr3);
+  sm.freeze();
+  sm.collect_stats(true);
+  sm.binary_trace(64);
+  
+  // the first round grows the queue, the staging and the timer buffers
+  left = 10;
+  sm.enqueue(1);
+  sm.run(0);
+  
+  left = n_transitions/3;
+  executed = 0;
+  uint64_t before = allocations;
+  sm.enqueue(1);
+  EXPECT_EQ(sm.run(0), 0);
+  EXPECT_EQ(allocations-before, 0);
+  EXPECT_EQ(executed, left ? 0 : n_transitions/3*3);
+}
+
+namespace virtdb { namespace test {
+  
+  // a connection: idle -connect-> connecting -connected-> open, data
+  // keeps it open, close goes back to idle through a chained event
+  enum { st_idle, st_connecting, st_open, st_closing };
+  enum { ev_connect=1, ev_connected, ev_data, ev_close, ev_closed };
+  
+  struct protocol_log
+  {
+    std::vector<uint16_t> events_;
+  };
+  
+  template <uint16_t EVENT>
+  struct log_event
+  {
+    template <typename M> void operator()(M & sm) const
+    {
+      sm.context().events_.push_back(EVENT);
+    }
+  };
+  
+  struct start_close
+  {
+    template <typename M> void operator()(M & sm) const
+    {
+      sm.context().events_.push_back(ev_close);
+      sm.chain(ev_closed);
+    }
+  };
+  
+  typedef static_machine<protocol_log,
+                         row<st_idle,       ev_connect,    st_connecting, log_event<ev_connect>>,
+                         row<st_connecting, ev_connected,  st_open,       log_event<ev_connected>>,
+                         row<st_open,       ev_data,       st_open,       log_event<ev_data>>,
+                         row<st_open,       ev_close,      st_closing,    start_close>,
+                         row<st_closing,    ev_closed,     st_idle>> protocol_machine;
+  
+}}
+
+TEST_F(FsmTest, StaticMachine)
+{
+  EXPECT_EQ(protocol_machine::n_states, 4);
+  EXPECT_EQ(protocol_machine::n_events, 6);
+  
+  protocol_machine sm;
+  EXPECT_EQ(sm.run(), st_idle);
+  
+  EXPECT_EQ(sm.enqueue(ev_connect), enqueued);
+  sm.enqueue(ev_data);       // not handled while connecting
+  sm.enqueue(ev_connected);
+  EXPECT_EQ(sm.enqueue_unique(ev_data), skipped);
+  EXPECT_EQ(sm.queue_size(), 3);
+  EXPECT_TRUE(sm.queue_has(ev_data));
+  EXPECT_EQ(sm.run(st_idle), st_open);
+  EXPECT_EQ(sm.unhandled_count(), 1);
+  EXPECT_EQ(sm.queue_size(), 0);
+  
+  // the chained event runs before the queued data
+  EXPECT_EQ(sm.enqueue_bulk({ev_data, ev_data, ev_close, ev_data, 999}), 5);
+  EXPECT_EQ(sm.resume(), st_idle);
+  EXPECT_EQ(sm.unhandled_count(), 3);
+  EXPECT_EQ(sm.context().events_,
+            (std::vector<uint16_t>{ev_connect, ev_connected, ev_data, ev_data, ev_close}));
+  
+  EXPECT_THROW(sm.chain(ev_closed), virtdb::fsm::exception);
+  
+  queue_options bounded;
+  bounded.limit_ = 10;
+  EXPECT_THROW(protocol_machine{bounded}, virtdb::fsm::exception);
+  
+  // the lock free queue works the same
+  protocol_machine lf{queue_options{queue_options::lock_free}};
+  lf.enqueue_bulk({ev_connect, ev_connected, ev_close});
+  EXPECT_EQ(lf.run(), st_idle);
+}
+
+namespace virtdb { namespace test {
+  
+  struct throw_once
+  {
+    template <typename M> void operator()(M & sm) const
+    {
+      if( sm.context().events_.empty() )
+      {
+        sm.context().events_.push_back(0);
+        throw std::runtime_error("action failed");
+      }
+    }
+  };
+  
+  typedef static_machine<protocol_log,
+                         row<0, 1, 1, throw_once>,
+                         row<1, 2, 1, log_event<2>>,
+                         row<1, 3, 0, log_event<3>>> throwing_machine;
+  
+}}
+
+TEST_F(FsmTest, StaticMachineKeepsEventsAfterThrow)
+{
+  throwing_machine sm;
+  sm.enqueue_bulk({1, 2, 3});
+  EXPECT_THROW(sm.run(0), std::runtime_error);
+  EXPECT_EQ(sm.state(), 0);
+  
+  // the events popped with the failed one are still queued
+  EXPECT_EQ(sm.queue_size(), 2);
+  EXPECT_TRUE(sm.queue_has(2));
+  EXPECT_EQ(sm.enqueue_unique(2), skipped);
+  
+  EXPECT_EQ(sm.run(1), 0);
+  EXPECT_EQ(sm.queue_size(), 0);
+  EXPECT_EQ(sm.enqueue_unique(2), enqueued);
+  EXPECT_EQ(sm.context().events_, (std::vector<uint16_t>{0, 2, 3}));
+}
+
+namespace virtdb { namespace test {
+  
+  // a move-only callable owning what it adds
+  struct owning_adder
+  {
+    std::unique_ptr<int>   p_;
+    std::shared_ptr<int>   owned_;
+    
+    uint64_t operator()(uint64_t x) const { return uint64_t(*p_ + *owned_) + x; }
+  };
+  
+}}
+
+TEST_F(FsmTest, InlineCallables)
+{
+  typedef inline_function<uint64_t(uint64_t)> fun;
+  
+  // captures up to the capacity are stored inline
+  uint64_t a = 1, b = 2, c = 3, d = 4, e = 5;
+  uint64_t before = allocations;
+  fun f{[a,b,c,d,e](uint64_t x) { return a+b+c+d+e+x; }};
+  EXPECT_EQ(allocations, before);
+  EXPECT_TRUE(static_cast<bool>(f));
+  EXPECT_EQ(f(10), 25u);
+  
+  // move only, the source becomes empty
+  fun g{std::move(f)};
+  EXPECT_FALSE(static_cast<bool>(f));
+  EXPECT_EQ(g(0), 15u);
+  EXPECT_THROW(f(0), std::bad_function_call);
+  
+  // move-only captures and destruction of the callable
+  std::shared_ptr<int> owned{new int{7}};
+  {
+    std::unique_ptr<int> p{new int{35}};
+    fun h{owning_adder{std::move(p), owned}};
+    EXPECT_EQ(owned.use_count(), 2);
+    EXPECT_EQ(h(0), 42u);
+    g = std::move(h);
+    EXPECT_EQ(g(1), 43u);
+    EXPECT_EQ(owned.use_count(), 2);
+  }
+  g = nullptr;
+  EXPECT_EQ(owned.use_count(), 1);
+  
+  // null function pointers and std::functions stay empty
+  uint64_t (*none)(uint64_t) = nullptr;
+  EXPECT_FALSE(static_cast<bool>(fun{none}));
+  EXPECT_FALSE(static_cast<bool>(fun{std::function<uint64_t(uint64_t)>{}}));
+  EXPECT_TRUE(static_cast<bool>(fun{std::function<uint64_t(uint64_t)>{[](uint64_t x) { return x; }}}));
+  
+  // actions, loops and timers don't allocate for their functions,
+  // empty ones still report when executed
+  state_machine sm("TEST");
+  transition tr{0,1,1,"TR"};
+  uint64_t called = 0;
+  before = allocations;
+  action act{[&called,a,b,c](uint16_t seqno,
+                             transition & trans,
+                             state_machine & sm){
+    called += a+b+c;
+  },""};
+  loop lp{[&called](uint16_t seqno,
+                    transition & trans,
+                    state_machine & sm,
+                    uint64_t iteration){
+    return ++called < 10;
+  },"",uint32_t(4)};
+  EXPECT_EQ(allocations, before);
+  act.execute(1, tr, sm);
+  EXPECT_EQ(called, 6u);
+  EXPECT_TRUE(lp.execute(2, tr, sm, 0));
+  EXPECT_EQ(called, 7u);
+  
+  action empty_act{std::function<void(uint16_t, transition &, state_machine &)>{}, "EMPTY"};
+  EXPECT_THROW(empty_act.execute(1, tr, sm), virtdb::fsm::exception);
+  loop empty_loop{nullptr, "EMPTY"};
+  EXPECT_THROW(empty_loop.execute(1, tr, sm, 0), virtdb::fsm::exception);
+  timer empty_timer{nullptr, "EMPTY"};
+  EXPECT_THROW(empty_timer.execute(1, tr, sm, timer::clock_type::now()), virtdb::fsm::exception);
+}
+
+TEST_F(FsmTest, StepProgramTimers)
+{
+  state_machine sm("TEST");
+  
+  // clearing the earliest deadline falls back to the next one, and a
+  // clear step may be configured before the timer it clears
+  transition::sptr tr1{new transition{0,1,10,"TR1"}};
+  tr1->on_timeout_state(12);
+  tr1->clear_timer(3, 2);
+  tr1->set_timer(1, timer::sptr{new timer{std::chrono::hours(1), "LONG"}});
+  tr1->set_timer(2, timer::sptr{new timer{std::chrono::milliseconds(5), "SHORT"}});
+  tr1->set_action(4, action::sptr{new action{[](uint16_t seqno,
+                                                transition & trans,
+                                                state_machine & sm){
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  },"SLOW"}});
+  
+  // the remaining deadline still expires after the clear
+  transition::sptr tr2{new transition{10,1,20,"TR2"}};
+  tr2->on_timeout_state(22);
+  tr2->set_timer(1, timer::sptr{new timer{std::chrono::milliseconds(5), "FIRST"}});
+  tr2->set_timer(2, timer::sptr{new timer{std::chrono::hours(1), "SECOND"}});
+  tr2->clear_timer(3, 2);
+  tr2->set_action(4, action::sptr{new action{[](uint16_t seqno,
+                                                transition & trans,
+                                                state_machine & sm){
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  },"SLOW"}});
+  
+  sm.add_transition(tr1);
+  sm.add_transition(tr2);
+  sm.enqueue(1);
+  EXPECT_EQ(sm.run(0), 10);
+  sm.enqueue(1);
+  EXPECT_EQ(sm.run(10), 22);
+  
+  // timers are kept in a fixed table per execution
+  transition tr3{0,1,0,"TR3"};
+  for( uint16_t i=0; i<64; ++i )
+    tr3.set_timer(i, timer::sptr{new timer{std::chrono::hours(1), "T"}});
+  EXPECT_THROW(tr3.set_timer(64, timer::sptr{new timer{std::chrono::hours(1), "T"}}),
+               virtdb::fsm::exception);
+  tr3.set_timer(63, timer::sptr{new timer{std::chrono::hours(2), "REPLACED"}});
+  tr3.set_action(0, action::sptr{new action{[](uint16_t seqno,
+                                               transition & trans,
+                                               state_machine & sm){},"ACTION"}});
+  tr3.set_timer(64, timer::sptr{new timer{std::chrono::hours(1), "T"}});
+}
+
+TEST_F(FsmTest, ActionStatus)
+{
+  state_machine sm("TEST");
+  std::vector<uint16_t> ran;
+  
+  auto add = [&](uint16_t event, action_status status) {
+    transition::sptr tr{new transition{0,event,10,"TR"}};
+    tr->on_error_state(11);
+    tr->on_timeout_state(12);
+    tr->set_action(1, action::sptr{new action{[&ran,status](uint16_t seqno,
+                                                            transition & trans,
+                                                            state_machine & sm){
+      ran.push_back(seqno);
+      return status;
+    },"STATUS"}});
+    tr->set_action(2, action::sptr{new action{[&ran](uint16_t seqno,
+                                                     transition & trans,
+                                                     state_machine & sm){
+      ran.push_back(seqno);
+    },"VOID"}});
+    sm.add_transition(tr);
+  };
+  
+  add(1, action_status::ok);
+  add(2, action_status::failed);
+  add(3, action_status::timeout);
+  add(4, action_status{action_status::next_state, 42});
+  sm.collect_stats(true);
+  
+  // ok goes on with the next step, the others end the transition
+  sm.enqueue(1);
+  EXPECT_EQ(sm.run(0), 10);
+  EXPECT_EQ(ran, (std::vector<uint16_t>{1, 2}));
+  
+  ran.clear();
+  sm.enqueue(2);
+  EXPECT_EQ(sm.run(0), 11);
+  EXPECT_EQ(ran, (std::vector<uint16_t>{1}));
+  
+  ran.clear();
+  sm.enqueue(3);
+  EXPECT_EQ(sm.run(0), 12);
+  EXPECT_EQ(ran, (std::vector<uint16_t>{1}));
+  
+  ran.clear();
+  sm.enqueue(4);
+  EXPECT_EQ(sm.run(0), 42);
+  EXPECT_EQ(ran, (std::vector<uint16_t>{1}));
+  
+  // failures are counted like thrown ones, without the exception
+  auto stats = sm.stats();
+  ASSERT_EQ(stats.transitions_.size(), 4u);
+  EXPECT_EQ(stats.transitions_[1].errors_, 1u);
+  EXPECT_EQ(stats.transitions_[1].exceptions_, 0u);
+  EXPECT_EQ(stats.transitions_[2].timeouts_, 1u);
+  EXPECT_EQ(stats.transitions_[3].errors_+stats.transitions_[3].timeouts_, 0u);
+}
+
+namespace virtdb { namespace test {
+  
+  // completes operations on its own thread after a delay, like the
+  // client of a socket or a database would. the results of resume()
+  // are kept for the tests.
+  class fake_io
+  {
+    typedef std::chrono::steady_clock clock_type;
+    
+    struct request
+    {
+      clock_type::time_point   due_;
+      continuation             cont_;
+      action_status            status_;
+    };
+    
+    std::mutex                mtx_;
+    std::condition_variable   cv_;
+    std::vector<request>      requests_;
+    std::vector<bool>         resumed_;
+    bool                      paused_;
+    bool                      stopping_;
+    std::thread               thread_;
+    
+    void work()
+    {
+      std::unique_lock<std::mutex> lck(mtx_);
+      while( !stopping_ )
+      {
+        if( requests_.empty() || paused_ )
+        {
+          cv_.wait(lck);
+          continue;
+        }
+        
+        auto first = std::min_element(requests_.begin(), requests_.end(),
+                                       [](const request & a, const request & b) { return a.due_ < b.due_; });
+        if( clock_type::now() < first->due_ )
+        {
+          cv_.wait_until(lck, first->due_);
+          continue;
+        }
+        
+        request req = *first;
+        requests_.erase(first);
+        lck.unlock();
+        bool resumed = req.cont_.resume(req.status_);
+        lck.lock();
+        resumed_.push_back(resumed);
+        cv_.notify_all();
+      }
+    }
+    
+  public:
+    fake_io()
+    : paused_{false},
+      stopping_{false},
+      thread_{[this]() { work(); }}
+    {
+    }
+    
+    void submit(const clock_type::duration & delay,
+                continuation cont,
+                action_status status=action_status{})
+    {
+      std::lock_guard<std::mutex> lck(mtx_);
+      requests_.push_back(request{clock_type::now()+delay, cont, status});
+      cv_.notify_all();
+    }
+    
+    // holds back the completions
+    void pause(bool on)
+    {
+      std::lock_guard<std::mutex> lck(mtx_);
+      paused_ = on;
+      cv_.notify_all();
+    }
+    
+    // the results of resume() once n operations completed
+    std::vector<bool> wait_completed(size_t n)
+    {
+      std::unique_lock<std::mutex> lck(mtx_);
+      cv_.wait(lck, [this,n]() { return resumed_.size() >= n; });
+      return resumed_;
+    }
+    
+    ~fake_io()
+    {
+      {
+        std::lock_guard<std::mutex> lck(mtx_);
+        stopping_ = true;
+      }
+      cv_.notify_all();
+      thread_.join();
+    }
+  };
+  
+  // an action suspending its transition on a fake operation
+  action::sptr async_action(fake_io & io,
+                            std::chrono::milliseconds delay,
+                            action_status status=action_status{})
+  {
+    return action::sptr{new action{[&io,delay,status](uint16_t seqno,
+                                                      transition & trans,
+                                                      state_machine & sm){
+      io.submit(delay, trans.suspend(), status);
+      return action_status::suspended;
+    },"ASYNC"}};
+  }
+  
+  action::sptr log_action(std::vector<uint16_t> & log)
+  {
+    return action::sptr{new action{[&log](uint16_t seqno,
+                                          transition & trans,
+                                          state_machine & sm){
+      log.push_back(seqno);
+    },"LOG"}};
+  }
+  
+}}
+
+TEST_F(FsmTest, AsyncActions)
+{
+  fake_io io;
+  std::vector<uint16_t> log;
+  state_machine sm("TEST");
+  sm.binary_trace(16);
+  
+  // 0 -1-> 1 suspends between its steps, 1 -2-> 2 and 2 -3-> 3 are plain
+  transition::sptr tr1{new transition{0,1,1,"TR1"}};
+  tr1->set_action(1, log_action(log));
+  tr1->set_action(2, async_action(io, std::chrono::milliseconds(20)));
+  tr1->set_action(3, log_action(log));
+  transition::sptr tr2{new transition{1,2,2,"TR2"}};
+  tr2->set_action(1, log_action(log));
+  transition::sptr tr3{new transition{2,3,3,"TR3"}};
+  tr3->set_action(1, log_action(log));
+  sm.add_transition(tr1);
+  sm.add_transition(tr2);
+  sm.add_transition(tr3);
+  
+  // run() returns at the suspension, the rest of the batch waits
+  io.pause(true);
+  sm.enqueue_bulk({1, 2});
+  EXPECT_EQ(sm.run(0), 0);
+  EXPECT_TRUE(sm.suspended());
+  EXPECT_EQ(log, (std::vector<uint16_t>{1}));
+  EXPECT_EQ(sm.queue_size(), 1);
+  EXPECT_THROW(sm.run(0), virtdb::fsm::exception);
+  
+  // nothing is dispatched before the operation completed
+  sm.enqueue(3);
+  EXPECT_EQ(sm.resume(), 0);
+  EXPECT_TRUE(sm.suspended());
+  EXPECT_EQ(log, (std::vector<uint16_t>{1}));
+  io.pause(false);
+  EXPECT_EQ(io.wait_completed(1), (std::vector<bool>{true}));
+  
+  // then the transition goes on at the next step, the events follow
+  EXPECT_EQ(sm.resume(), 3);
+  EXPECT_FALSE(sm.suspended());
+  EXPECT_EQ(log, (std::vector<uint16_t>{1, 3, 1, 1}));
+  EXPECT_EQ(sm.queue_size(), 0);
+  
+  std::ostringstream os;
+  sm.dump_binary_trace(os);
+  std::istringstream is{os.str()};
+  trace_ring::dump dump;
+  ASSERT_TRUE(trace_ring::read(is, dump));
+  ASSERT_EQ(dump.records_.size(), 4);
+  EXPECT_EQ(dump.records_[0].result_, trace_ring::suspended);
+  EXPECT_EQ(dump.records_[0].seqno_, 2);
+  EXPECT_EQ(dump.records_[1].result_, trace_ring::ok);
+  EXPECT_EQ(dump.records_[1].next_state_, 1);
+}
+
+TEST_F(FsmTest, ResumedTransitionThrows)
+{
+  fake_io io;
+  std::vector<uint16_t> seen;
+  state_machine sm("TEST");
+  sm.on_unhandled([&seen](uint16_t state,
+                          uint16_t event,
+                          state_machine & sm) {
+    seen.push_back(event);
+    if( event == 9 )
+      throw std::runtime_error{"unhandled"};
+  });
+  
+  // the step after the suspension chains an event the callback throws on
+  transition::sptr tr{new transition{0,1,1,"TR"}};
+  tr->set_action(1, async_action(io, std::chrono::milliseconds(1)));
+  tr->set_action(2, action::sptr{new action{[](uint16_t seqno,
+                                               transition & trans,
+                                               state_machine & sm){
+    sm.chain(9);
+  },"CHAIN"}});
+  sm.add_transition(tr);
+  
+  sm.enqueue_bulk({1, 5, 6});
+  EXPECT_EQ(sm.run(0), 0);
+  EXPECT_TRUE(sm.suspended());
+  EXPECT_EQ(sm.queue_size(), 2);
+  EXPECT_EQ(io.wait_completed(1), (std::vector<bool>{true}));
+  EXPECT_THROW(sm.resume(), std::runtime_error);
+  
+  // the events held behind the transition are queued still
+  EXPECT_FALSE(sm.suspended());
+  EXPECT_EQ(sm.queue_size(), 2);
+  EXPECT_TRUE(sm.queue_has(5));
+  EXPECT_EQ(sm.enqueue_unique(6), skipped);
+  
+  // the machine stays in the state the transition started from
+  EXPECT_EQ(sm.resume(), 0);
+  EXPECT_EQ(sm.queue_size(), 0);
+  EXPECT_EQ(seen, (std::vector<uint16_t>{9, 5, 6}));
+}
+
+TEST_F(FsmTest, AsyncActionResults)
+{
+  fake_io io;
+  std::vector<uint16_t> log;
+  state_machine sm("TEST");
+  
+  auto add = [&](uint16_t event, action::sptr a) {
+    transition::sptr tr{new transition{0,event,10,"TR"}};
+    tr->on_error_state(11);
+    tr->on_timeout_state(12);
+    tr->set_timer(1, timer::sptr{new timer{std::chrono::milliseconds(50), "DEADLINE"}});
+    tr->set_action(2, a);
+    tr->set_action(3, log_action(log));
+    sm.add_transition(tr);
+  };
+  
+  add(1, async_action(io, std::chrono::milliseconds(1), action_status::failed));
+  add(2, async_action(io, std::chrono::milliseconds(1), action_status{action_status::next_state, 42}));
+  add(3, async_action(io, std::chrono::hours(1)));
+  
+  // completed before the action returned, no suspension
+  add(4, action::sptr{new action{[](uint16_t seqno,
+                                    transition & trans,
+                                    state_machine & sm){
+    continuation cont = trans.suspend();
+    EXPECT_TRUE(cont.pending());
+    EXPECT_TRUE(cont.resume());
+    EXPECT_FALSE(cont.resume());
+    return action_status::suspended;
+  },"SYNC"}});
+  
+  // returning suspended without suspend() is an error
+  add(5, action::sptr{new action{[](uint16_t seqno,
+                                    transition & trans,
+                                    state_machine & sm){
+    return action_status::suspended;
+  },"BROKEN"}});
+  
+  sm.enqueue(1);
+  EXPECT_EQ(sm.run(0), 0);
+  io.wait_completed(1);
+  EXPECT_EQ(sm.resume(), 11);
+  
+  sm.enqueue(2);
+  EXPECT_EQ(sm.run(0), 0);
+  io.wait_completed(2);
+  EXPECT_EQ(sm.resume(), 42);
+  EXPECT_TRUE(log.empty());
+  
+  sm.enqueue(4);
+  EXPECT_EQ(sm.run(0), 10);
+  EXPECT_FALSE(sm.suspended());
+  EXPECT_EQ(log, (std::vector<uint16_t>{3}));
+  
+  sm.enqueue(5);
+  EXPECT_EQ(sm.run(0), 11);
+  
+  // the deadline timer still applies while suspended
+  sm.enqueue(3);
+  EXPECT_EQ(sm.run(0), 0);
+  EXPECT_EQ(sm.resume(), 0);
+  EXPECT_TRUE(sm.suspended());
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  EXPECT_EQ(sm.resume(), 12);
+  EXPECT_FALSE(sm.suspended());
+  
+  // run_forever() sleeps until the deadline wakes it, then dispatches
+  // what was queued in the meantime
+  std::promise<void> reached;
+  transition::sptr tr6{new transition{12,6,0,"REACHED"}};
+  tr6->set_action(1, action::sptr{new action{[&reached](uint16_t seqno,
+                                                        transition & trans,
+                                                        state_machine & sm){
+    reached.set_value();
+  },"REACHED"}});
+  sm.add_transition(tr6);
+  
+  stop_token stop;
+  sm.enqueue_bulk({3, 6});
+  std::thread runner{[&sm,&stop]() { sm.run_forever(0, stop); }};
+  EXPECT_EQ(reached.get_future().wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  stop.request_stop();
+  runner.join();
+  EXPECT_EQ(sm.state(), 0);
+  
+  // suspend() only works in the actions of a running transition
+  transition tr{0,1,1,"TR"};
+  EXPECT_THROW(tr.suspend(), virtdb::fsm::exception);
+}
+
+TEST_F(FsmTest, AsyncActionsReleaseThreads)
+{
+  fake_io io;
+  std::atomic<uint64_t> fast_done{0};
+  std::atomic<bool> slow_done{false};
+  
+  // a single worker runs both machines, the fast one goes on while
+  // the slow one waits for its operation
+  machine_instance::sptr slow{new machine_instance{"SLOW"}};
+  transition::sptr tr1{new transition{0,1,1,"WAIT"}};
+  tr1->set_action(1, async_action(io, std::chrono::milliseconds(100)));
+  tr1->set_action(2, action::sptr{new action{[&](uint16_t seqno,
+                                                 transition & trans,
+                                                 state_machine & sm){
+    slow_done = true;
+  },"DONE"}});
+  slow->add_transition(tr1);
+  
+  machine_instance::sptr fast{new machine_instance{"FAST"}};
+  transition::sptr tr2{new transition{0,1,0,"COUNT"}};
+  tr2->set_action(1, action::sptr{new action{[&](uint16_t seqno,
+                                                 transition & trans,
+                                                 state_machine & sm){
+    ++fast_done;
+  },"COUNT"}});
+  fast->add_transition(tr2);
+  
+  slow->enqueue(1);
+  executor exec{1, 8};
+  exec.add(slow);
+  exec.add(fast);
+  for( int i=0; i<1000; ++i )
+    fast->enqueue(1);
+  exec.wait_idle();
+  
+  EXPECT_EQ(fast_done, 1000u);
+  EXPECT_TRUE(slow->suspended());
+  EXPECT_FALSE(slow_done);
+  
+  // the completion schedules the machine again
+  io.wait_completed(1);
+  auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while( !slow_done && std::chrono::steady_clock::now() < give_up )
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  exec.wait_idle();
+  EXPECT_TRUE(slow_done);
+  EXPECT_EQ(slow->state(), 1);
+  EXPECT_FALSE(slow->suspended());
+}
+
 int main(int argc, char ** argv)
 {
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,71 @@
+#include <fsm/trace_ring.hh>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+using namespace virtdb::fsm;
+
+namespace {
+  
+  std::string
+  name_of(const trace_ring::name_map & names,
+          uint16_t id)
+  {
+    auto it = names.find(id);
+    if( it != names.end() )
+      return it->second;
+    else
+      return std::to_string(id);
+  }
+  
+  int
+  decode(std::istream & is,
+         const char * source)
+  {
+    trace_ring::dump d;
+    if( !trace_ring::read(is, d) )
+    {
+      std::cerr << "invalid trace dump: " << source << "\n";
+      return 1;
+    }
+    
+    std::cout << "# machine " << d.machine_id_ << " [" << d.description_ << "] "
+              << d.records_.size() << " records\n";
+    
+    for( auto const & r : d.records_ )
+    {
+      std::cout << r.timestamp_ns_ << " "
+                << r.machine_id_ << " "
+                << name_of(d.state_names_, r.state_) << " + "
+                << name_of(d.event_names_, r.event_) << " ("
+                << r.seqno_ << ") "
+                << trace_ring::result_name(r.result_) << " -> "
+                << name_of(d.state_names_, r.next_state_) << "\n";
+    }
+    return 0;
+  }
+  
+}
+
+// usage: fsm_trace_decode [dump files...], reads stdin without arguments
+int main(int argc, char ** argv)
+{
+  if( argc < 2 )
+    return decode(std::cin, "<stdin>");
+  
+  int ret = 0;
+  for( int i=1; i<argc; ++i )
+  {
+    std::ifstream is{argv[i], std::ios::binary};
+    if( !is )
+    {
+      std::cerr << "cannot open: " << argv[i] << "\n";
+      ret = 1;
+    }
+    else if( decode(is, argv[i]) != 0 )
+    {
+      ret = 1;
+    }
+  }
+  return ret;
+}